@@ -1,21 +1,634 @@
+#define _FILE_OFFSET_BITS 64  // смещения и размеры файлов больше 2 ГБ
+#define _GNU_SOURCE           // copy_file_range, fallocate
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/falloc.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include <sqlite3.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/ioprio.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define DB_PATH         "antivir.db"
+#define SIG_CACHE_PATH  DB_PATH ".sigcache"  // скомпилированный набор сигнатур
+#define STATS_PROM_PATH DB_PATH ".prom"      // статистика для textfile-коллектора node exporter
+#define STATS_JSON_PATH DB_PATH ".json"
+#define QUAR_KEY_PATH   DB_PATH ".key"       // ключ шифрования карантина
+
+// ====================================== Телеметрия ======================================
+// Счётчики и гистограммы проверки копятся всё время работы программы. Обновления - атомарные
+// сложения без блокировок, поэтому их можно вызывать из любых потоков поиска.
+// Гистограммы логарифмические: в корзину i попадают значения от 2^(i-1) до 2^i - 1.
+#define HIST_BUCKETS 40
+
+enum phase { PHASE_WALK, PHASE_READ, PHASE_HASH, PHASE_MATCH, PHASE_DB, PHASE_THROTTLE, PHASE_DELETE, PHASE_HEAL, PHASE_QUAR, PHASE_COUNT };
+
+enum counter {
+    CTR_FILES_VISITED,      // обычные файлы, найденные обходом
+    CTR_FILES_SKIPPED,      // не изменились с прошлой чистой проверки
+    CTR_FILES_SCANNED,
+    CTR_FILES_INFECTED,
+    CTR_HITS,
+    CTR_BYTES_READ,
+    CTR_STAT_ERRORS,
+    CTR_OPEN_ERRORS,
+    CTR_READ_ERRORS,
+    CTR_DEDUP_LINKS,        // пути inode, уже проверенного по другой жёсткой ссылке
+    CTR_DEDUP_COPIES,       // файлы с уже проверенным содержимым
+    CTR_WATCH_EVENTS,       // события fanotify/inotify в режиме watch
+    CTR_WATCH_COALESCED,    // из них слито с уже ожидающим проверки файлом
+    CTR_DAEMON_REQUESTS,    // запросы к службе на сокете
+    CTR_GOV_WAITS,          // пауз ограничителя нагрузки
+    CTR_GOV_BACKOFFS,       // снижений скорости из-за давления на систему
+    CTR_COUNT
+};
+
+enum hist { HIST_SCAN_LATENCY, HIST_FILE_SIZE, HIST_DB_WRITE, HIST_WATCH_LATENCY, HIST_DAEMON_LATENCY, HIST_COUNT };
+
+struct histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+uint64_t counters[CTR_COUNT];
+uint64_t phase_ns[PHASE_COUNT];     // суммарное время этапа по всем потокам
+struct histogram histograms[HIST_COUNT];
+
+static const char *counter_names[CTR_COUNT][2] = {
+    { "files_visited_total",  "Файлов найдено обходом" },
+    { "files_skipped_total",  "Пропущено неизменённых" },
+    { "files_scanned_total",  "Файлов проверено" },
+    { "files_infected_total", "Файлов с сигнатурами" },
+    { "hits_total",           "Совпадений" },
+    { "bytes_read_total",     "Байт прочитано" },
+    { "stat_errors_total",    "Ошибок stat" },
+    { "open_errors_total",    "Ошибок открытия" },
+    { "read_errors_total",    "Ошибок чтения" },
+    { "dedup_links_total",    "Жёстких ссылок без проверки" },
+    { "dedup_copies_total",   "Копий без проверки" },
+    { "watch_events_total",   "Событий наблюдения" },
+    { "watch_coalesced_total", "Событий слито в очереди" },
+    { "daemon_requests_total", "Запросов к службе" },
+    { "throttle_waits_total", "Пауз ограничителя" },
+    { "throttle_backoffs_total", "Снижений скорости по давлению" },
+};
+
+static const char *phase_names[PHASE_COUNT][2] = {
+    { "walk", "обход" }, { "read", "чтение" }, { "hash", "хэш содержимого" }, { "match", "поиск" }, { "db", "запись в БД" },
+    { "throttle", "ожидание ограничителя" },
+    { "delete", "удаление" }, { "heal", "лечение" }, { "quarantine", "карантин" },
+};
+
+// Имя метрики, единица измерения (ns - наносекунды, выгружаются в секундах), подпись
+static const char *hist_names[HIST_COUNT][3] = {
+    { "scan_latency_seconds", "ns", "Время проверки файла" },
+    { "file_size_bytes",      "b",  "Размер файла" },
+    { "db_write_seconds",     "ns", "Время записи в БД" },
+    { "watch_latency_seconds", "ns", "От события до вердикта" },
+    { "daemon_request_seconds", "ns", "Ответ службы" },
+};
+
+static inline uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void stat_add(enum counter c, uint64_t v) {
+    __atomic_fetch_add(&counters[c], v, __ATOMIC_RELAXED);
+}
+
+static inline void hist_observe(enum hist h, uint64_t v) {
+    int b = v ? 64 - __builtin_clzll(v) : 0;
+    if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+    __atomic_fetch_add(&histograms[h].buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histograms[h].count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histograms[h].sum, v, __ATOMIC_RELAXED);
+}
+
+static inline void phase_add(enum phase p, uint64_t ns) {
+    __atomic_fetch_add(&phase_ns[p], ns, __ATOMIC_RELAXED);
+    if (p == PHASE_DB) hist_observe(HIST_DB_WRITE, ns);
+}
+
+#ifdef AV_BENCH
+void bench_file_done(uint64_t ns, uint64_t bytes);
+#endif
+
+// Проверка файла закончена: t - время начала, size - его размер
+static inline void file_done(uint64_t t, uint64_t size) {
+    uint64_t ns = clock_ns() - t;
+    stat_add(CTR_FILES_SCANNED, 1);
+    hist_observe(HIST_SCAN_LATENCY, ns);
+    hist_observe(HIST_FILE_SIZE, size);
+#ifdef AV_BENCH
+    bench_file_done(ns, size);
+#endif
+}
+
+#define PHASE_START(t)     uint64_t t = clock_ns()
+#define PHASE_STOP(p, t)   phase_add((p), clock_ns() - (t))
+#define FILE_DONE(t, size) file_done((t), (size))
+
+// Верхняя граница корзины, в которой набирается доля q всех значений
+static uint64_t hist_quantile(const struct histogram *h, double q) {
+    uint64_t need = (uint64_t)(h->count * q), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > need || seen == h->count) return b ? (1ull << b) - 1 : 0;
+    }
+    return 0;
+}
+
+static void stats_snapshot(uint64_t *ctr, uint64_t *ph, struct histogram *hist) {
+    for (int i = 0; i < CTR_COUNT; i++) ctr[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    for (int i = 0; i < PHASE_COUNT; i++) ph[i] = __atomic_load_n(&phase_ns[i], __ATOMIC_RELAXED);
+    for (int i = 0; i < HIST_COUNT; i++) {
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            hist[i].buckets[b] = __atomic_load_n(&histograms[i].buckets[b], __ATOMIC_RELAXED);
+        }
+        hist[i].count = __atomic_load_n(&histograms[i].count, __ATOMIC_RELAXED);
+        hist[i].sum = __atomic_load_n(&histograms[i].sum, __ATOMIC_RELAXED);
+    }
+}
+
+static double hist_scale(int h) {
+    return strcmp(hist_names[h][1], "ns") == 0 ? 1e-9 : 1;
+}
+
+// Команда stats
+void print_stats() {
+    uint64_t ctr[CTR_COUNT], ph[PHASE_COUNT];
+    struct histogram hist[HIST_COUNT];
+    stats_snapshot(ctr, ph, hist);
+
+    printf("Счётчики:\n");
+    for (int i = 0; i < CTR_COUNT; i++) printf("  %12llu  %s\n", (unsigned long long)ctr[i], counter_names[i][1]);
+
+    printf("Время этапов, с (сумма по потокам):\n");
+    for (int i = 0; i < PHASE_COUNT; i++) printf("  %12.3f  %s\n", ph[i] / 1e9, phase_names[i][1]);
+
+    printf("Распределения (среднее / p50 / p99 / макс. корзина):\n");
+    for (int i = 0; i < HIST_COUNT; i++) {
+        const struct histogram *h = &hist[i];
+        const char *unit = strcmp(hist_names[i][1], "ns") == 0 ? "мс" : "Б";
+        double k = strcmp(hist_names[i][1], "ns") == 0 ? 1e-6 : 1;
+        printf("  %s, %s: %llu шт.", hist_names[i][2], unit, (unsigned long long)h->count);
+        if (h->count) {
+            printf(" %.3f / %.3f / %.3f / %.3f", (double)h->sum / h->count * k, hist_quantile(h, 0.5) * k,
+                   hist_quantile(h, 0.99) * k, hist_quantile(h, 1.0) * k);
+        }
+        printf("\n");
+    }
+}
+
+static int stats_write_prom(FILE *f) {
+    uint64_t ctr[CTR_COUNT], ph[PHASE_COUNT];
+    struct histogram hist[HIST_COUNT];
+    stats_snapshot(ctr, ph, hist);
+
+    for (int i = 0; i < CTR_COUNT; i++) {
+        fprintf(f, "# TYPE av_%s counter\nav_%s %llu\n", counter_names[i][0], counter_names[i][0],
+                (unsigned long long)ctr[i]);
+    }
+
+    fprintf(f, "# TYPE av_phase_seconds_total counter\n");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(f, "av_phase_seconds_total{phase=\"%s\"} %.9f\n", phase_names[i][0], ph[i] / 1e9);
+    }
+
+    for (int i = 0; i < HIST_COUNT; i++) {
+        const char *name = hist_names[i][0];
+        double k = hist_scale(i);
+        uint64_t cumulative = 0;
+
+        fprintf(f, "# TYPE av_%s histogram\n", name);
+        for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+            cumulative += hist[i].buckets[b];
+            fprintf(f, "av_%s_bucket{le=\"%.9g\"} %llu\n", name, ((1ull << b) - 1) * k, (unsigned long long)cumulative);
+        }
+        fprintf(f, "av_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)hist[i].count);
+        fprintf(f, "av_%s_sum %.9g\n", name, hist[i].sum * k);
+        fprintf(f, "av_%s_count %llu\n", name, (unsigned long long)hist[i].count);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+static int stats_write_json(FILE *f) {
+    uint64_t ctr[CTR_COUNT], ph[PHASE_COUNT];
+    struct histogram hist[HIST_COUNT];
+    stats_snapshot(ctr, ph, hist);
+
+    fprintf(f, "{\n  \"counters\": {");
+    for (int i = 0; i < CTR_COUNT; i++) {
+        fprintf(f, "%s\n    \"%s\": %llu", i ? "," : "", counter_names[i][0], (unsigned long long)ctr[i]);
+    }
+
+    fprintf(f, "\n  },\n  \"phase_seconds\": {");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(f, "%s\n    \"%s\": %.9f", i ? "," : "", phase_names[i][0], ph[i] / 1e9);
+    }
+
+    fprintf(f, "\n  },\n  \"histograms\": {");
+    for (int i = 0; i < HIST_COUNT; i++) {
+        double k = hist_scale(i);
+        fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"sum\": %.9g, \"p50\": %.9g, \"p99\": %.9g, \"buckets\": [",
+                i ? "," : "", hist_names[i][0], (unsigned long long)hist[i].count, hist[i].sum * k,
+                hist_quantile(&hist[i], 0.5) * k, hist_quantile(&hist[i], 0.99) * k);
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            fprintf(f, "%s%llu", b ? ", " : "", (unsigned long long)hist[i].buckets[b]);
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n  }\n}\n");
+    return ferror(f) ? -1 : 0;
+}
+
+// Запись через временный файл и rename: сборщик не увидит файл наполовину
+static void stats_write_file(const char *path, int (*write)(FILE *)) {
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        perror("Ошибка записи статистики");
+        return;
+    }
+    int rc = write(f);
+    if (fclose(f) != 0 || rc != 0 || rename(tmp_path, path) != 0) {
+        perror("Ошибка записи статистики");
+        unlink(tmp_path);
+    }
+}
+
+// Выгрузка в конце check и start
+void stats_export() {
+    stats_write_file(STATS_PROM_PATH, stats_write_prom);
+    stats_write_file(STATS_JSON_PATH, stats_write_json);
+}
+
+// ====================================== Пул буферов ======================================
+// Буферы блоков (поиск, лечение, карантин) живут в потоке, пока он работает, а после него ждут
+// следующего в общем пуле, а не возвращаются системе: потоки check, действий и службы
+// создаются заново, и свежие буферы по мегабайту давали бы промахи страниц на каждом запуске.
+// Размер округляется до степени двойки. Буферы от 2 МБ выровнены по 2 МБ и помечены
+// MADV_HUGEPAGE: буфер поиска (блок 1 МБ + перекрытие) занимает одну большую страницу.
+#define POOL_MIN      (64u << 10)
+#define POOL_HUGE     (2u << 20)
+#define POOL_CLASSES  12                // 64 КБ .. 128 МБ
+#define POOL_KEEP     32                // свободных буферов одного размера
+
+struct pool_free {
+    struct pool_free *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct pool_free *free[POOL_CLASSES];
+    unsigned count[POOL_CLASSES];
+} buf_pool = { PTHREAD_MUTEX_INITIALIZER };
+
+// Номер размера для size байт (-1 - больше пула), *rounded - размер буфера
+static int pool_class(size_t size, size_t *rounded) {
+    size_t s = POOL_MIN;
+    int c = 0;
+    while (s < size) {
+        s <<= 1;
+        c++;
+    }
+    *rounded = s;
+    return c < POOL_CLASSES ? c : -1;
+}
+
+// Буфер не меньше size байт, *capacity - его размер. NULL - нет памяти.
+void *pool_get(size_t size, size_t *capacity) {
+    size_t rounded;
+    int c = pool_class(size, &rounded);
+    void *p = NULL;
+
+    if (c >= 0) {
+        pthread_mutex_lock(&buf_pool.lock);
+        struct pool_free *f = buf_pool.free[c];
+        if (f) {
+            buf_pool.free[c] = f->next;
+            buf_pool.count[c]--;
+            p = f;
+        }
+        pthread_mutex_unlock(&buf_pool.lock);
+    }
+    if (!p) {
+        if (posix_memalign(&p, rounded >= POOL_HUGE ? POOL_HUGE : 4096, rounded) != 0) return NULL;
+        if (rounded >= POOL_HUGE) madvise(p, rounded, MADV_HUGEPAGE);
+    }
+    *capacity = rounded;
+    return p;
+}
+
+// Возврат буфера размера capacity (из pool_get)
+void pool_put(void *p, size_t capacity) {
+    size_t rounded;
+    int c = p ? pool_class(capacity, &rounded) : -1;
+
+    if (c >= 0 && rounded == capacity) {
+        pthread_mutex_lock(&buf_pool.lock);
+        if (buf_pool.count[c] < POOL_KEEP) {
+            struct pool_free *f = p;
+            f->next = buf_pool.free[c];
+            buf_pool.free[c] = f;
+            buf_pool.count[c]++;
+            p = NULL;
+        }
+        pthread_mutex_unlock(&buf_pool.lock);
+    }
+    free(p);
+}
+
+// ====================================== Ограничение нагрузки ======================================
+// check и watch на рабочем сервере не должны отнимать диск и кэш страниц у соседних служб.
+// - Скорость: общие для всех потоков поиска вёдра жетонов на байты и на файлы в секунду.
+//   Прочитанное списывается в долг; поток, уведший ведро в минус, спит, пока долг не погасится.
+// - Приоритет: потоки поиска переходят в класс ввода-вывода idle (ioprio_set; его учитывают
+//   планировщики bfq и mq-deadline) и/или поднимают себе nice. Nice действует на поток.
+// - Кэш: страницы проверенного файла сбрасываются posix_fadvise(DONTNEED). Сбрасываются и
+//   страницы, бывшие в кэше до проверки, поэтому по умолчанию выключено.
+// - Отступление: раз в GOV_SAMPLE_MS считается доля времени, когда задачи ждали диск (рост total
+//   в /proc/pressure/io, строка some), и берётся loadavg за минуту. Выше порога допустимая
+//   скорость уменьшается вдвое (до 1/GOV_BACKOFF_MAX), ниже - растёт в полтора раза. Без заданного
+//   предела за исходную берётся скорость проверки за интервал перед первым снижением.
+//   В давление и нагрузку входят и ожидания самой проверки: порог ограничивает систему в целом.
+// Служба на сокете не ограничивается: в ней ждёт клиент.
+#define GOV_BURST_MS    100         // запас ведра
+#define GOV_SAMPLE_MS   500
+#define GOV_BACKOFF_MAX 64
+
+uint64_t gov_bytes_rate = 0;    // байт/с, 0 - без предела
+uint64_t gov_files_rate = 0;    // файлов/с
+double gov_psi_max = 0;         // порог ожидания диска, %; 0 - не следить
+double gov_load_max = 0;        // порог loadavg; 0 - не следить
+int gov_idle = 0;               // класс ввода-вывода idle для потоков поиска
+int gov_nice = 0;               // nice потоков поиска (только повышение)
+int gov_dontneed = 0;           // сбрасывать страницы проверенных файлов
+
+struct gov_bucket {
+    double rate;                // единиц в секунду с учётом отступления, 0 - без предела
+    double tokens;              // меньше нуля - долг
+    uint64_t stamp;             // время пополнения
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int active;                 // идёт check или watch
+    int metered;                // заданы пределы или пороги: чтения проходят через вёдра
+    struct gov_bucket bytes, files;
+    double factor;              // доля исходной скорости при отступлении
+    double base_bytes, base_files;
+    uint64_t sample_at;         // время следующего замера давления
+    uint64_t window_start, window_bytes, window_files;
+    uint64_t psi_total;         // мкс ожидания диска на прошлом замере
+    double psi, load;           // последние замеры
+    int saved_ioprio, saved_nice;
+} gov = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int gov_tid() {
+    return syscall(SYS_gettid);
+}
+
+// Накопленное время, когда хотя бы одна задача ждала диск (мкс). -1 - PSI недоступен.
+static int gov_psi_total(uint64_t *total) {
+    FILE *f = fopen("/proc/pressure/io", "r");
+    if (!f) return -1;
+    unsigned long long v;
+    int ok = fscanf(f, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", &v) == 1;
+    fclose(f);
+    if (ok) *total = v;
+    return ok ? 0 : -1;
+}
+
+static void gov_bucket_set(struct gov_bucket *b, double rate, uint64_t now) {
+    b->rate = rate;
+    b->stamp = now;
+    if (b->tokens > rate * GOV_BURST_MS / 1000) b->tokens = rate * GOV_BURST_MS / 1000;
+}
+
+// Списание n единиц. Возвращает, сколько спать до погашения долга, нс.
+static uint64_t gov_take(struct gov_bucket *b, double n, uint64_t now) {
+    if (b->rate <= 0) return 0;
+    double burst = b->rate * GOV_BURST_MS / 1000;
+    b->tokens += (now - b->stamp) * b->rate / 1e9;
+    if (b->tokens > burst) b->tokens = burst;
+    b->stamp = now;
+    b->tokens -= n;
+    return b->tokens < 0 ? (uint64_t)(-b->tokens / b->rate * 1e9) : 0;
+}
+
+// Замер давления и пересчёт скорости (под gov.lock)
+static void gov_sample(uint64_t now) {
+    double dt = (now - gov.window_start) / 1e9;
+    int high = 0;
+    uint64_t total;
+
+    if (gov_psi_max > 0 && gov_psi_total(&total) == 0) {
+        if (gov.psi_total && dt > 0) gov.psi = (total - gov.psi_total) / (dt * 1e4);  // мкс за dt с, в %
+        gov.psi_total = total;
+        high |= gov.psi > gov_psi_max;
+    }
+    if (gov_load_max > 0 && getloadavg(&gov.load, 1) == 1) high |= gov.load > gov_load_max;
+
+    if (high) {
+        if (gov.factor >= 1) {
+            gov.base_bytes = gov_bytes_rate ? gov_bytes_rate : dt > 0 ? gov.window_bytes / dt : 0;
+            gov.base_files = gov_files_rate ? gov_files_rate : dt > 0 ? gov.window_files / dt : 0;
+        }
+        gov.factor = gov.factor / 2 < 1.0 / GOV_BACKOFF_MAX ? 1.0 / GOV_BACKOFF_MAX : gov.factor / 2;
+        stat_add(CTR_GOV_BACKOFFS, 1);
+    } else if (gov.factor < 1) {
+        gov.factor = gov.factor * 1.5 > 1 ? 1 : gov.factor * 1.5;
+    }
+
+    if (gov.factor < 1) {
+        gov_bucket_set(&gov.bytes, gov.base_bytes * gov.factor, now);
+        gov_bucket_set(&gov.files, gov.base_files * gov.factor, now);
+    } else {
+        gov_bucket_set(&gov.bytes, gov_bytes_rate, now);
+        gov_bucket_set(&gov.files, gov_files_rate, now);
+    }
+    gov.sample_at = now + GOV_SAMPLE_MS * 1000000ull;
+    gov.window_start = now;
+    gov.window_bytes = gov.window_files = 0;
+}
+
+static void gov_charge(uint64_t bytes, uint64_t files) {
+    uint64_t now = clock_ns(), wait = 0;
+
+    pthread_mutex_lock(&gov.lock);
+    gov.window_bytes += bytes;
+    gov.window_files += files;
+    if (now >= gov.sample_at && (gov_psi_max > 0 || gov_load_max > 0)) gov_sample(now);
+    if (bytes) wait = gov_take(&gov.bytes, bytes, now);
+    if (files) {
+        uint64_t w = gov_take(&gov.files, files, now);
+        if (w > wait) wait = w;
+    }
+    pthread_mutex_unlock(&gov.lock);
+
+    if (wait) {
+        struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+        stat_add(CTR_GOV_WAITS, 1);
+        PHASE_START(t);
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+        PHASE_STOP(PHASE_THROTTLE, t);
+    }
+}
+
+// Прочитано bytes байт проверяемого файла
+static inline void gov_read(uint64_t bytes) {
+    if (__atomic_load_n(&gov.metered, __ATOMIC_RELAXED)) gov_charge(bytes, 0);
+}
+
+// Начало проверки очередного файла
+static inline void gov_file() {
+    if (__atomic_load_n(&gov.metered, __ATOMIC_RELAXED)) gov_charge(0, 1);
+}
+
+// Проверка файла закончена: его страницы больше не нужны
+static inline void gov_drop(int fd, uint64_t offset, uint64_t len) {
+    if (gov_dontneed && __atomic_load_n(&gov.active, __ATOMIC_RELAXED)) {
+        posix_fadvise(fd, offset, len == UINT64_MAX ? 0 : len, POSIX_FADV_DONTNEED);   // 0 - до конца файла
+    }
+}
+
+// Приоритет текущего потока поиска
+void gov_thread() {
+    if (!__atomic_load_n(&gov.active, __ATOMIC_RELAXED)) return;
+    if (gov_idle && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) != 0) {
+        perror("Ошибка ioprio_set");
+    }
+    if (gov_nice > 0) {
+        errno = 0;
+        int cur = getpriority(PRIO_PROCESS, gov_tid());
+        if (errno == 0 && cur < gov_nice && setpriority(PRIO_PROCESS, gov_tid(), gov_nice) != 0) {
+            perror("Ошибка setpriority");
+        }
+    }
+}
+
+// Начало check или watch в текущем потоке: ограничения и приоритет вступают в силу
+void gov_begin() {
+    uint64_t now = clock_ns();
+
+    pthread_mutex_lock(&gov.lock);
+    gov.factor = 1;
+    gov.bytes = (struct gov_bucket){ 0 };
+    gov.files = (struct gov_bucket){ 0 };
+    gov_bucket_set(&gov.bytes, gov_bytes_rate, now);
+    gov_bucket_set(&gov.files, gov_files_rate, now);
+    gov.psi_total = 0;
+    gov.psi = gov.load = 0;
+    if (gov_psi_max > 0) gov_psi_total(&gov.psi_total);
+    gov.sample_at = now + GOV_SAMPLE_MS * 1000000ull;
+    gov.window_start = now;
+    gov.window_bytes = gov.window_files = 0;
+    __atomic_store_n(&gov.metered, gov_bytes_rate || gov_files_rate || gov_psi_max > 0 || gov_load_max > 0,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&gov.active, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&gov.lock);
+
+    gov.saved_ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    errno = 0;
+    gov.saved_nice = getpriority(PRIO_PROCESS, gov_tid());
+    if (errno != 0) gov.saved_nice = INT_MIN;
+    gov_thread();
+}
+
+// Конец check или watch: прежний приоритет потока. Вернуть nice ниже текущего без
+// CAP_SYS_NICE (или RLIMIT_NICE) ядро не даст - об этом сообщается.
+void gov_end() {
+    __atomic_store_n(&gov.metered, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&gov.active, 0, __ATOMIC_RELAXED);
+    if (gov_idle && gov.saved_ioprio >= 0) syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, gov.saved_ioprio);
+    if (gov_nice > 0 && gov.saved_nice != INT_MIN && gov.saved_nice < gov_nice &&
+        setpriority(PRIO_PROCESS, gov_tid(), gov.saved_nice) != 0) {
+        perror("Не удалось вернуть приоритет процессора");
+    }
+}
+
+void gov_print() {
+    printf("Скорость: ");
+    if (gov_bytes_rate) printf("%.1f МБ/с", gov_bytes_rate / (1024.0 * 1024.0));
+    else printf("без предела");
+    if (gov_files_rate) printf(", %llu файлов/с", (unsigned long long)gov_files_rate);
+    printf("\nОтступление: ожидание диска ");
+    if (gov_psi_max > 0) printf("> %.1f%%", gov_psi_max);
+    else printf("не учитывается");
+    printf(", loadavg ");
+    if (gov_load_max > 0) printf("> %.2f", gov_load_max);
+    else printf("не учитывается");
+    printf("\nКласс ввода-вывода: %s, nice: %d, сброс кэша: %s\n", gov_idle ? "idle" : "как у процесса", gov_nice,
+           gov_dontneed ? "да" : "нет");
+}
 
 // ====================================== Взаимодействие с бд ======================================
 sqlite3 *db;
+
+// Добавление колонки в таблицу, если её ещё нет
+static int add_column(sqlite3 *db, const char *table, const char *column, const char *decl) {
+    char sql[256];
+    sqlite3_stmt *probe;
+
+    snprintf(sql, sizeof(sql), "SELECT %s FROM %s LIMIT 0;", column, table);
+    if (sqlite3_prepare_v2(db, sql, -1, &probe, NULL) == SQLITE_OK) {
+        sqlite3_finalize(probe);
+        return 0;
+    }
+
+    char *err_msg = NULL;
+    snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN %s %s;", table, column, decl);
+    if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
 // Функция для открытия базы данных и создания таблицы (signatures)
 void initialize_db(sqlite3 **db) {
     const char *create_signatures_table  =
         "CREATE TABLE IF NOT EXISTS Signatures ("
         "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-        "signature BLOB UNIQUE NOT NULL);";
+        "signature BLOB UNIQUE NOT NULL, "
+        "kind INTEGER NOT NULL DEFAULT 0);";
 
     const char *create_found_files_table =
         "CREATE TABLE IF NOT EXISTS FoundFiles ("
@@ -29,64 +642,356 @@ void initialize_db(sqlite3 **db) {
         "CREATE TABLE IF NOT EXISTS QuarTable ("
         "id INTEGER PRIMARY KEY AUTOINCREMENT, "
         "path TEXT UNIQUE NOT NULL, "
-        "hash TEXT UNIQUE NOT NULL);";
+        "hash TEXT UNIQUE NOT NULL, "
+        "content_hash TEXT, "
+        "cipher TEXT, "
+        "iv BLOB, "
+        "tag BLOB);";
+
+    // Счётчик поколений набора сигнатур: растёт при любом изменении таблицы Signatures
+    const char *create_meta_table =
+        "CREATE TABLE IF NOT EXISTS Meta ("
+        "key TEXT PRIMARY KEY, "
+        "value INTEGER NOT NULL);"
+        "INSERT OR IGNORE INTO Meta (key, value) VALUES ('sig_generation', 0);"
+        "CREATE TRIGGER IF NOT EXISTS sig_generation_insert AFTER INSERT ON Signatures BEGIN "
+        "UPDATE Meta SET value = value + 1 WHERE key = 'sig_generation'; END;"
+        "CREATE TRIGGER IF NOT EXISTS sig_generation_delete AFTER DELETE ON Signatures BEGIN "
+        "UPDATE Meta SET value = value + 1 WHERE key = 'sig_generation'; END;"
+        "CREATE TRIGGER IF NOT EXISTS sig_generation_update AFTER UPDATE ON Signatures BEGIN "
+        "UPDATE Meta SET value = value + 1 WHERE key = 'sig_generation'; END;"
+        "INSERT OR IGNORE INTO Meta (key, value) VALUES ('sig_added_generation', 0);"
+        "CREATE TRIGGER IF NOT EXISTS sig_added_insert AFTER INSERT ON Signatures BEGIN "
+        "UPDATE Meta SET value = value + 1 WHERE key = 'sig_added_generation'; END;"
+        "CREATE TRIGGER IF NOT EXISTS sig_added_update AFTER UPDATE ON Signatures BEGIN "
+        "UPDATE Meta SET value = value + 1 WHERE key = 'sig_added_generation'; END;"
+        "INSERT OR IGNORE INTO Meta (key, value) VALUES ('sig_removed_generation', 0);"
+        "CREATE TRIGGER IF NOT EXISTS sig_removed_delete AFTER DELETE ON Signatures BEGIN "
+        "UPDATE Meta SET value = value + 1 WHERE key = 'sig_removed_generation'; END;"
+        "CREATE TRIGGER IF NOT EXISTS sig_removed_update AFTER UPDATE ON Signatures BEGIN "
+        "UPDATE Meta SET value = value + 1 WHERE key = 'sig_removed_generation'; END;"
+        "INSERT OR IGNORE INTO Meta (key, value) VALUES ('feed_seq', 0);";
+
+    // Состояние файлов на момент последней чистой проверки
+    const char *create_scan_state_table =
+        "CREATE TABLE IF NOT EXISTS ScanState ("
+        "dev INTEGER NOT NULL, "
+        "ino INTEGER NOT NULL, "
+        "size INTEGER NOT NULL, "
+        "mtime INTEGER NOT NULL, "
+        "ctime INTEGER NOT NULL, "
+        "generation INTEGER NOT NULL, "
+        "PRIMARY KEY (dev, ino));";
+
+    // Вердикты по содержимому (SHA-256) для копий файлов с другими inode
+    const char *create_content_verdicts_table =
+        "CREATE TABLE IF NOT EXISTS ContentVerdicts ("
+        "sha256 BLOB PRIMARY KEY, "
+        "size INTEGER NOT NULL, "
+        "generation INTEGER NOT NULL, "
+        "hits INTEGER NOT NULL) WITHOUT ROWID;";
+
+    // Контрольная точка прерванной проверки: корень, счётчики и каталоги, обойденные целиком
+    const char *create_scan_progress_table =
+        "CREATE TABLE IF NOT EXISTS ScanProgress ("
+        "id INTEGER PRIMARY KEY CHECK (id = 1), "
+        "root TEXT NOT NULL, "
+        "generation INTEGER NOT NULL, "
+        "files INTEGER NOT NULL DEFAULT 0, "
+        "bytes INTEGER NOT NULL DEFAULT 0, "
+        "hits INTEGER NOT NULL DEFAULT 0, "
+        "updated INTEGER NOT NULL);"
+        "CREATE TABLE IF NOT EXISTS ScanProgressDirs ("
+        "path TEXT PRIMARY KEY) WITHOUT ROWID;";
 
     char *err_msg = NULL;
 
     // Открываем базу данных
-    if (sqlite3_open("antivir.db", db) != SQLITE_OK) {
+    if (sqlite3_open(DB_PATH, db) != SQLITE_OK) {
         fprintf(stderr, "Ошибка открытия бд: %s\n", sqlite3_errmsg(*db));
         exit(1);
     }
 
+    // WAL: читатели не блокируют запись, fsync только на контрольных точках
+    const char *tune_db =
+        "PRAGMA journal_mode = WAL;"
+        "PRAGMA synchronous = NORMAL;"
+        "PRAGMA temp_store = MEMORY;"
+        "PRAGMA foreign_keys = ON;";
+
+    // Все совпадения, найденные в файле за одну проверку
+    const char *create_hits_table =
+        "CREATE TABLE IF NOT EXISTS Hits ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "file_id INTEGER NOT NULL REFERENCES FoundFiles (id) ON DELETE CASCADE, "
+        "signature_id INTEGER NOT NULL, "
+        "offset INTEGER NOT NULL, "
+        "length INTEGER NOT NULL);";
+
+    const char *create_indexes =
+        "CREATE INDEX IF NOT EXISTS FoundFiles_status ON FoundFiles (status);"
+        "CREATE INDEX IF NOT EXISTS Hits_file ON Hits (file_id, offset);";
+
     // Создаём таблицы
-    if (sqlite3_exec(*db, create_signatures_table, NULL, NULL, &err_msg) != SQLITE_OK ||
+    if (sqlite3_exec(*db, tune_db, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(*db, create_signatures_table, NULL, NULL, &err_msg) != SQLITE_OK ||
         sqlite3_exec(*db, create_found_files_table, NULL, NULL, &err_msg) != SQLITE_OK || 
-        sqlite3_exec(*db, create_quar_table, NULL, NULL, &err_msg) != SQLITE_OK ) {
+        sqlite3_exec(*db, create_quar_table, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(*db, create_meta_table, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(*db, create_scan_state_table, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(*db, create_content_verdicts_table, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(*db, create_scan_progress_table, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(*db, create_hits_table, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(*db, create_indexes, NULL, NULL, &err_msg) != SQLITE_OK ) {
         fprintf(stderr, "SQL error: %s\n", err_msg);
         sqlite3_free(err_msg);
         sqlite3_close(*db);
         exit(1);
     }
 
+    // Базы, созданные до маскированных сигнатур и нового карантина, получают недостающие колонки
+    if (add_column(*db, "Signatures", "kind", "INTEGER NOT NULL DEFAULT 0") != 0 ||
+        add_column(*db, "QuarTable", "content_hash", "TEXT") != 0 ||
+        add_column(*db, "QuarTable", "cipher", "TEXT") != 0 ||
+        add_column(*db, "QuarTable", "iv", "BLOB") != 0 ||
+        add_column(*db, "QuarTable", "tag", "BLOB") != 0) {
+        sqlite3_close(*db);
+        exit(1);
+    }
+
     printf("БД инициализирована.\n");
 }
 
-// Функция для добавления сигнатуры в таблицу
-void insert_signature(const unsigned char *signature, int sig_length) {
-    const char *insert_sql = "INSERT INTO Signatures (signature) VALUES (?);";
-    sqlite3_stmt *stmt;
+// ----- Кэш подготовленных запросов -----
+// Каждый запрос готовится один раз при первом использовании и дальше только сбрасывается.
+// Кэшем пользуется тот поток, который в данный момент владеет соединением.
+enum stmt_id {
+    STMT_GET_META,
+    STMT_SET_META,
+    STMT_INSERT_SIGNATURE,
+    STMT_IMPORT_SIGNATURE,
+    STMT_DELETE_SIGNATURE,
+    STMT_INSERT_FOUND_FILE,
+    STMT_UPDATE_STATUS,
+    STMT_DELETE_FOUND_FILE,
+    STMT_SAVE_SCAN_STATE,
+    STMT_DELETE_SCAN_STATE,
+    STMT_INSERT_QUAR,
+    STMT_INSERT_HIT,
+    STMT_DELETE_HITS,
+    STMT_SAVE_CONTENT_VERDICT,
+    STMT_SAVE_PROGRESS,
+    STMT_DELETE_PROGRESS_DIRS,
+    STMT_INSERT_PROGRESS_DIR,
+    STMT_COUNT
+};
+
+static const char *stmt_sql[STMT_COUNT] = {
+    [STMT_GET_META]          = "SELECT value FROM Meta WHERE key = ?;",
+    [STMT_SET_META]          = "UPDATE Meta SET value = ? WHERE key = ?;",
+    [STMT_INSERT_SIGNATURE]  = "INSERT INTO Signatures (signature, kind) VALUES (?, ?);",
+    [STMT_IMPORT_SIGNATURE]  = "INSERT OR IGNORE INTO Signatures (signature, kind) VALUES (?, ?);",
+    [STMT_DELETE_SIGNATURE]  = "DELETE FROM Signatures WHERE signature = ? AND kind = ?;",
+    [STMT_INSERT_FOUND_FILE] = "INSERT INTO FoundFiles (path, offset, signature, status) VALUES (?, ?, ?, 0) "
+                               "ON CONFLICT (path) DO UPDATE SET offset = excluded.offset, "
+                               "signature = excluded.signature RETURNING id;",
+    [STMT_UPDATE_STATUS]     = "UPDATE FoundFiles SET status = ? WHERE id = ?;",
+    [STMT_DELETE_FOUND_FILE] = "DELETE FROM FoundFiles WHERE id = ?;",
+    [STMT_SAVE_SCAN_STATE]   = "INSERT OR REPLACE INTO ScanState (dev, ino, size, mtime, ctime, generation) "
+                               "VALUES (?, ?, ?, ?, ?, ?);",
+    [STMT_DELETE_SCAN_STATE] = "DELETE FROM ScanState WHERE dev = ? AND ino = ?;",
+    [STMT_INSERT_QUAR]       = "INSERT OR REPLACE INTO QuarTable (path, hash, content_hash, cipher, iv, tag) "
+                               "VALUES (?, ?, ?, ?, ?, ?);",
+    [STMT_INSERT_HIT]        = "INSERT INTO Hits (file_id, signature_id, offset, length) VALUES (?, ?, ?, ?);",
+    [STMT_DELETE_HITS]       = "DELETE FROM Hits WHERE file_id = ?;",
+    [STMT_SAVE_CONTENT_VERDICT] = "INSERT OR REPLACE INTO ContentVerdicts (sha256, size, generation, hits) "
+                                  "VALUES (?, ?, ?, ?);",
+    [STMT_SAVE_PROGRESS]     = "INSERT OR REPLACE INTO ScanProgress (id, root, generation, files, bytes, hits, updated) "
+                               "VALUES (1, ?, ?, ?, ?, ?, strftime('%s', 'now'));",
+    // Вложенные каталоги: путь начинается с "каталог/" ('0' - следующий за '/' символ)
+    [STMT_DELETE_PROGRESS_DIRS] = "DELETE FROM ScanProgressDirs WHERE path > ?1 || '/' AND path < ?1 || '0';",
+    [STMT_INSERT_PROGRESS_DIR]  = "INSERT OR IGNORE INTO ScanProgressDirs (path) VALUES (?);",
+};
 
-    // Подготавливаем запрос
-    if (sqlite3_prepare_v2(db, insert_sql, -1, &stmt, 0) != SQLITE_OK) {
+static sqlite3_stmt *stmt_cache[STMT_COUNT];
+
+// Подготовленный запрос из кэша. После использования - db_stmt_release.
+sqlite3_stmt *db_stmt(enum stmt_id id) {
+    if (!stmt_cache[id] && sqlite3_prepare_v3(db, stmt_sql[id], -1, SQLITE_PREPARE_PERSISTENT,
+                                              &stmt_cache[id], NULL) != SQLITE_OK) {
         fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
-        return;
+        stmt_cache[id] = NULL;
+    }
+    return stmt_cache[id];
+}
+
+void db_stmt_release(sqlite3_stmt *stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+void db_stmt_cache_free() {
+    for (int i = 0; i < STMT_COUNT; i++) {
+        sqlite3_finalize(stmt_cache[i]);
+        stmt_cache[i] = NULL;
+    }
+}
+
+// ----- Пакетная запись -----
+// Пока пакетный режим включён (check, start), записи группируются в транзакции,
+// которые фиксируются каждые DB_BATCH_ROWS записей или DB_BATCH_MS миллисекунд.
+// Вне пакетного режима каждая запись фиксируется сразу, как раньше.
+#define DB_BATCH_ROWS 1000
+#define DB_BATCH_MS   250
+
+struct db_batch {
+    int active;         // пакетный режим включён
+    int open;           // открыта транзакция
+    int pending;        // записей в открытой транзакции
+    int hold;           // не фиксировать до db_batch_release
+    struct timespec started;
+};
+
+struct db_batch db_batch;
+
+static int64_t elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+void db_batch_commit() {
+    if (!db_batch.open) return;
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка фиксации транзакции: %s\n", sqlite3_errmsg(db));
+    }
+    db_batch.open = 0;
+    db_batch.pending = 0;
+}
+
+// Вызывается перед каждой записью в БД
+void db_write() {
+    if (!db_batch.active && !db_batch.hold) return;
+
+    if (db_batch.open && !db_batch.hold && (db_batch.pending >= DB_BATCH_ROWS || elapsed_ms(&db_batch.started) >= DB_BATCH_MS)) {
+        db_batch_commit();
+    }
+    if (!db_batch.open) {
+        if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) {
+            fprintf(stderr, "Ошибка начала транзакции: %s\n", sqlite3_errmsg(db));
+            return;
+        }
+        db_batch.open = 1;
+        clock_gettime(CLOCK_MONOTONIC, &db_batch.started);
+    }
+    db_batch.pending++;
+}
+
+void db_batch_start() {
+    db_batch.active = 1;
+}
+
+// Все записи до db_batch_release попадают в одну транзакцию
+void db_batch_hold() {
+    db_batch.hold++;
+}
+
+void db_batch_release() {
+    if (--db_batch.hold == 0 && !db_batch.active) db_batch_commit();
+}
+
+// Отмена записей открытой транзакции (вместе с db_batch_hold - всех с начала удержания)
+void db_batch_rollback() {
+    if (!db_batch.open) return;
+    if (sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка отмены транзакции: %s\n", sqlite3_errmsg(db));
     }
+    db_batch.open = 0;
+    db_batch.pending = 0;
+}
+
+void db_batch_end() {
+    PHASE_START(t);
+    db_batch_commit();
+    db_batch.active = 0;
+    PHASE_STOP(PHASE_DB, t);
+}
+
+// Значение счётчика из таблицы Meta (-1, если его нет)
+int64_t get_meta(const char *key) {
+    sqlite3_stmt *stmt = db_stmt(STMT_GET_META);
+    int64_t value = -1;
+    if (!stmt) return -1;
+
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+
+    db_stmt_release(stmt);
+    return value;
+}
+
+// Запись счётчика в таблицу Meta
+void set_meta(const char *key, int64_t value) {
+    sqlite3_stmt *stmt = db_stmt(STMT_SET_META);
+    if (!stmt) return;
+
+    sqlite3_bind_int64(stmt, 1, value);
+    sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+    db_write();
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Ошибка записи %s: %s\n", key, sqlite3_errmsg(db));
+    }
+    db_stmt_release(stmt);
+}
+
+// Текущее поколение набора сигнатур (меняется при любом изменении)
+int64_t get_sig_generation() {
+    return get_meta("sig_generation");
+}
+
+// Поколение, которое меняется только при добавлении сигнатур
+int64_t get_sig_added_generation() {
+    return get_meta("sig_added_generation");
+}
+
+// Поколение, которое меняется при удалении и изменении сигнатур
+int64_t get_sig_removed_generation() {
+    return get_meta("sig_removed_generation");
+}
+
+// Функция для добавления сигнатуры в таблицу
+// kind: 0 - байты сигнатуры, 1 - текстовая маска (см. parse_masked)
+void insert_signature_kind(const unsigned char *signature, int sig_length, int kind) {
+    sqlite3_stmt *stmt = db_stmt(STMT_INSERT_SIGNATURE);
+    if (!stmt) return;
 
     // Привязываем сигнатуру как BLOB
     sqlite3_bind_blob(stmt, 1, signature, sig_length, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, kind);
 
     // Выполняем запрос
+    db_write();
     if (sqlite3_step(stmt) != SQLITE_DONE) {
         fprintf(stderr, "Ошибка вставки сигнатуры в таблицу: %s\n", sqlite3_errmsg(db));
     } else {
         printf("Сигнатура добавлена.\n");
     }
 
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
 }
 
-// Функция для добавления записи в таблицу FoundFiles
-void insert_found_file(const char *path, size_t offset, const unsigned char *signature, int sig_length) {
-    const char *insert_sql = 
-        "INSERT INTO FoundFiles (path, offset, signature, status) VALUES (?, ?, ?, 0);";
-    sqlite3_stmt *stmt;
+void insert_signature(const unsigned char *signature, int sig_length) {
+    insert_signature_kind(signature, sig_length, 0);
+}
 
-    // Подготавливаем запрос
-    if (sqlite3_prepare_v2(db, insert_sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
-        return;
-    }
+// Функция для добавления записи в таблицу FoundFiles.
+// Повторная находка в том же файле обновляет запись, сохраняя выбранный статус. Возвращает id или -1.
+int64_t insert_found_file(const char *path, uint64_t offset, const unsigned char *signature, int sig_length) {
+    sqlite3_stmt *stmt = db_stmt(STMT_INSERT_FOUND_FILE);
+    int64_t id = -1;
+    if (!stmt) return -1;
 
     // Привязываем параметры
     sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);              // Путь к файлу
@@ -94,26 +999,56 @@ void insert_found_file(const char *path, size_t offset, const unsigned char *sig
     sqlite3_bind_blob(stmt, 3, signature, sig_length, SQLITE_STATIC); // Сигнатура
 
     // Выполняем запрос
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
+    db_write();
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
         fprintf(stderr, "Failed to insert found file: %s\n", sqlite3_errmsg(db));
     } else {
-        printf("Found file inserted successfully: %s at offset %zu\n", path, offset);
+        id = sqlite3_column_int64(stmt, 0);
+        printf("Found file inserted successfully: %s at offset %llu\n", path, (unsigned long long)offset);
     }
 
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
+    return id;
+}
+
+// Добавление одного совпадения к записи FoundFiles
+void insert_hit(int64_t file_id, int64_t signature_id, uint64_t offset, uint32_t length) {
+    sqlite3_stmt *stmt = db_stmt(STMT_INSERT_HIT);
+    if (!stmt) return;
+
+    sqlite3_bind_int64(stmt, 1, file_id);
+    sqlite3_bind_int64(stmt, 2, signature_id);
+    sqlite3_bind_int64(stmt, 3, offset);
+    sqlite3_bind_int64(stmt, 4, length);
+
+    db_write();
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Ошибка записи совпадения: %s\n", sqlite3_errmsg(db));
+    }
+
+    db_stmt_release(stmt);
+}
+
+// Удаление совпадений прошлой проверки файла
+void delete_hits(int64_t file_id) {
+    sqlite3_stmt *stmt = db_stmt(STMT_DELETE_HITS);
+    if (!stmt) return;
+
+    sqlite3_bind_int64(stmt, 1, file_id);
+    db_write();
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Ошибка удаления совпадений: %s\n", sqlite3_errmsg(db));
+    }
+
+    db_stmt_release(stmt);
 }
 
 // Функция для получения статистики по статусам
 void get_info() {
-    const char *query = 
-        "SELECT "
-        "    (SELECT COUNT(*) FROM FoundFiles WHERE status = 0) AS status_0, "
-        "    (SELECT COUNT(*) FROM FoundFiles WHERE status = 1) AS status_1, "
-        "    (SELECT COUNT(*) FROM FoundFiles WHERE status = 2) AS status_2, "
-        "    (SELECT COUNT(*) FROM FoundFiles WHERE status = 3) AS status_3, "
-        "    (SELECT COUNT(*) FROM FoundFiles WHERE status = 4) AS status_4;";
-
+    // Один проход по индексу FoundFiles_status вместо подзапроса на каждый статус
+    const char *query = "SELECT status, COUNT(*) FROM FoundFiles GROUP BY status;";
     sqlite3_stmt *stmt;
+    int counts[5] = { 0 };
 
     // Подготавливаем SQL-запрос
     if (sqlite3_prepare_v2(db, query, -1, &stmt, 0) != SQLITE_OK) {
@@ -122,19 +1057,19 @@ void get_info() {
     }
 
     // Выполняем запрос
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        int status_0 = sqlite3_column_int(stmt, 0);
-        int status_1 = sqlite3_column_int(stmt, 1);
-        int status_2 = sqlite3_column_int(stmt, 2);
-        int status_3 = sqlite3_column_int(stmt, 3);
-        int status_4 = sqlite3_column_int(stmt, 4);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int status = sqlite3_column_int(stmt, 0);
+        if (status >= 0 && status < 5) counts[status] = sqlite3_column_int(stmt, 1);
+    }
 
+    if (rc == SQLITE_DONE) {
         printf("Статистика по статусам:\n");
-        printf("Файлы со статусом 0 'неопределен': %d\n", status_0);
-        printf("Файлы со статусом 1 'удалить': %d\n", status_1);
-        printf("Файлы со статусом 2 'лечить': %d\n", status_2);
-        printf("Файлы со статусом 3 'карантин': %d\n", status_3);
-        printf("Файлы со статусом 4 'разрешить': %d\n", status_4);
+        printf("Файлы со статусом 0 'неопределен': %d\n", counts[0]);
+        printf("Файлы со статусом 1 'удалить': %d\n", counts[1]);
+        printf("Файлы со статусом 2 'лечить': %d\n", counts[2]);
+        printf("Файлы со статусом 3 'карантин': %d\n", counts[3]);
+        printf("Файлы со статусом 4 'разрешить': %d\n", counts[4]);
     } else {
         fprintf(stderr, "Failed to retrieve data: %s\n", sqlite3_errmsg(db));
     }
@@ -177,32 +1112,51 @@ void display_files_with_status(int status) {
     sqlite3_finalize(stmt);
 }
 
-// Функция для изменения статуса записи по ID
-void update_status_by_id(int id, int new_status) {
-    const char *query = "UPDATE FoundFiles SET status = ? WHERE id = ?;";
+// Вывод всех совпадений записи FoundFiles
+void display_hits(int id) {
+    const char *query =
+        "SELECT signature_id, offset, length FROM Hits WHERE file_id = ? ORDER BY offset;";
     sqlite3_stmt *stmt;
 
-    // Подготовка SQL-запроса
     if (sqlite3_prepare_v2(db, query, -1, &stmt, 0) != SQLITE_OK) {
         fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
         return;
     }
+    sqlite3_bind_int(stmt, 1, id);
+
+    printf("Совпадения в записи %d:\n", id);
+    printf("Сигнатура | Смещение | Длина\n");
+    printf("--------------------------\n");
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        printf("%lld | %lld | %d\n", (long long)sqlite3_column_int64(stmt, 0),
+               (long long)sqlite3_column_int64(stmt, 1), sqlite3_column_int(stmt, 2));
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+// Функция для изменения статуса записи по ID
+void update_status_by_id(int id, int new_status) {
+    sqlite3_stmt *stmt = db_stmt(STMT_UPDATE_STATUS);
+    if (!stmt) return;
 
     // Привязываем новый статус к запросу
     if (sqlite3_bind_int(stmt, 1, new_status) != SQLITE_OK) {
         fprintf(stderr, "Ошибка привязки нового статуса: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
+        db_stmt_release(stmt);
         return;
     }
 
     // Привязываем ID записи к запросу
     if (sqlite3_bind_int(stmt, 2, id) != SQLITE_OK) {
         fprintf(stderr, "Ошибка привязки ID: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
+        db_stmt_release(stmt);
         return;
     }
 
     // Выполнение запроса
+    db_write();
     if (sqlite3_step(stmt) != SQLITE_DONE) {
         fprintf(stderr, "Ошибка выполнения запроса: %s\n", sqlite3_errmsg(db));
     } else {
@@ -210,156 +1164,242 @@ void update_status_by_id(int id, int new_status) {
     }
 
     // Освобождение ресурсов
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
 }
 
 // ====================================== Обработка таблицы FoundFiles ======================================
 // Удаление записи по id
 void del_by_id(int id) {
-    const char *sql_delete = "DELETE FROM FoundFiles WHERE id = ?"; // SQL запрос для удаления записи по id
-
-    // Подготовка запроса для удаления записи из базы данных
-    sqlite3_stmt *delete_stmt;
-    if (sqlite3_prepare_v2(db, sql_delete, -1, &delete_stmt, NULL) != SQLITE_OK) {
-        fprintf(stderr, "Ошибка подготовки запроса на удаление записи: %s\n", sqlite3_errmsg(db));
-    }
+    // Запрос для удаления записи из базы данных (подготовлен один раз)
+    sqlite3_stmt *delete_stmt = db_stmt(STMT_DELETE_FOUND_FILE);
+    if (!delete_stmt) return;
 
     // Привязываем id к запросу на удаление
     sqlite3_bind_int(delete_stmt, 1, id);
     
     // Выполняем запрос на удаление записи
+    db_write();
     if (sqlite3_step(delete_stmt) != SQLITE_DONE) {
         fprintf(stderr, "Ошибка удаления записи с id %d: %s\n", id, sqlite3_errmsg(db));
-    } else {
-        printf("Запись с id %d удалена из базы данных.\n", id);
     }
     
-    // Освобождаем ресурсы для запроса на удаление
-    sqlite3_finalize(delete_stmt);
+    // Сбрасываем запрос для следующего использования
+    db_stmt_release(delete_stmt);
 
     return;
 }
 
-// ----- удаление -----
-// Удаление файла
-void del_files_with_status_1() {
-    printf("===== Удаление =====\n");
+// ----- Лечение -----
+// Из файла вырезаются все участки с совпадениями за один проход. Если участки выровнены
+// по блокам файловой системы, они убираются на месте через FALLOC_FL_COLLAPSE_RANGE без
+// копирования данных. Иначе оставшиеся части копируются во временный файл рядом
+// (copy_file_range, при отказе - через буфер ограниченного размера), который затем
+// атомарно заменяет исходный: после сбоя на диске остаётся либо старый файл, либо новый.
+#define HEAL_BUFFER_SIZE (1 << 20)
+
+// Участок файла, который нужно вырезать
+struct byte_range {
+    uint64_t offset;
+    uint64_t length;
+};
 
-    sqlite3_stmt *stmt;
-    const char *sql_select = "SELECT id, path FROM FoundFiles WHERE status = 1"; // SQL запрос для выборки файлов со статусом 1
-    
-    // Подготовка SQL запроса для выборки
-    if (sqlite3_prepare_v2(db, sql_select, -1, &stmt, NULL) != SQLITE_OK) {
-        fprintf(stderr, "Ошибка подготовки SQL запроса: %s\n", sqlite3_errmsg(db));
-        return;
+static int byte_range_cmp(const void *a, const void *b) {
+    const struct byte_range *x = a, *y = b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Переиспользуемый буфер копирования, выделяется при первой необходимости
+struct heal_buffer {
+    unsigned char *data;
+};
+
+// Запись len байт по смещению (pwrite может записать меньше)
+static int write_at(int fd, const void *data, uint64_t len, uint64_t offset) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
     }
+    return 0;
+}
 
-    // Выполнение выборки и удаление файлов
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        // Получаем id и путь из результата выборки
-        int id = sqlite3_column_int(stmt, 0);
-        const char *path = (const char *)sqlite3_column_text(stmt, 1);
-        
-        // Удаляем файл с диска
-        if (unlink(path) == 0) {
-            printf("Файл %s удален успешно.\n", path);
-            del_by_id(id);  
+// Вырезание участков на месте. 1 - участки не выровнены или ФС не умеет, 0 - готово, -1 - ошибка.
+static int heal_collapse(int fd, const struct stat *st, const struct byte_range *ranges, long n) {
+    uint64_t block = st->st_blksize > 0 ? st->st_blksize : 4096;
+    for (long i = 0; i < n; i++) {
+        if (ranges[i].offset % block || ranges[i].length % block) return 1;
+    }
 
+    // С конца файла, чтобы смещения ещё не обработанных участков не сдвигались.
+    // Участок, доходящий до конца файла, просто отрезается.
+    uint64_t size = st->st_size;
+    for (long i = n - 1; i >= 0; i--) {
+        int rc;
+        if (ranges[i].offset + ranges[i].length >= size) {
+            rc = ftruncate(fd, ranges[i].offset);
+            size = ranges[i].offset;
         } else {
-            fprintf(stderr, "Ошибка удаления файла %s: %s\n", path, strerror(errno));
+            rc = fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, ranges[i].offset, ranges[i].length);
+            size -= ranges[i].length;
+        }
+        if (rc != 0) {
+            // Отказ на первом участке: ФС не поддерживает, файл ещё не тронут
+            if (i == n - 1 && (errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS)) return 1;
+            perror("Ошибка вырезания участка");
+            return -1;
         }
     }
+    return fsync(fd) == 0 ? 0 : -1;
+}
 
-    // Освобождаем ресурсы для запроса на выборку
-    sqlite3_finalize(stmt);
+// Копирование len байт из in (начиная с from) в out (начиная с to)
+static int heal_copy(int in, uint64_t from, int out, uint64_t to, uint64_t len, struct heal_buffer *hb) {
+    static int no_copy_range = 0;   // ядро или ФС не поддерживают copy_file_range
+
+    while (len > 0 && !no_copy_range) {
+        loff_t off_in = from, off_out = to;
+        ssize_t n = copy_file_range(in, &off_in, out, &off_out, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) return -1;
+        if (n <= 0) {
+            no_copy_range = n < 0;
+            break;
+        }
+        from += n;
+        to += n;
+        len -= n;
+    }
+
+    size_t capacity;
+    if (len > 0 && !hb->data && !(hb->data = pool_get(HEAL_BUFFER_SIZE, &capacity))) return -1;
+    while (len > 0) {
+        ssize_t n = pread(in, hb->data, len < HEAL_BUFFER_SIZE ? len : HEAL_BUFFER_SIZE, from);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_at(out, hb->data, n, to) != 0) return -1;
+        from += n;
+        to += n;
+        len -= n;
+    }
+    return 0;
 }
 
-// ----- Лечение -----
-// Функция для удаления сигнатуры из файла
-int remove_signature(const char *file_path, long offset, size_t sig_len) {
-    FILE *file = fopen(file_path, "rb+");
-    if (!file) {
-        perror("Ошибка открытия файла");
+// Копия файла без участков во временном файле и атомарная замена исходного
+static int heal_rewrite(const char *path, int fd, const struct stat *st, const struct byte_range *ranges, long n,
+                        struct heal_buffer *hb) {
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.healXXXXXX", path);
+
+    int out = mkstemp(tmp_path);
+    if (out < 0) {
+        perror("Ошибка создания временного файла");
         return -1;
     }
 
-    // Переходим к смещению
-    if (fseek(file, offset + sig_len, SEEK_SET) != 0) {
-        perror("Ошибка перехода к смещению");
-        fclose(file);
-        return -1;
+    // Права и владелец как у исходного; сменить владельца может только root
+    fchmod(out, st->st_mode & 07777);
+    if (fchown(out, st->st_uid, st->st_gid) != 0 && errno != EPERM) {
+        perror("Ошибка смены владельца");
     }
 
-    // Получаем размер файла
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    if (file_size < 0) {
-        perror("Ошибка получения размера файла");
-        fclose(file);
-        return -1;
+    uint64_t from = 0, to = 0;
+    int rc = 0;
+    for (long i = 0; i <= n && rc == 0; i++) {
+        uint64_t end = i < n ? ranges[i].offset : (uint64_t)st->st_size;
+        if (end > from) {
+            rc = heal_copy(fd, from, out, to, end - from, hb);
+            to += end - from;
+        }
+        if (i < n) from = ranges[i].offset + ranges[i].length;
     }
 
-    // Читаем данные после сигнатуры
-    size_t remaining_size = file_size - (offset + sig_len);
-    char *buffer = (char *)malloc(remaining_size);
-    if (!buffer) {
-        perror("Ошибка выделения памяти");
-        fclose(file);
+    if (rc != 0 || fsync(out) != 0) {
+        perror("Ошибка записи вылеченного файла");
+        close(out);
+        unlink(tmp_path);
         return -1;
     }
-    fseek(file, offset + sig_len, SEEK_SET);
-    fread(buffer, 1, remaining_size, file);
-
-    // Перезаписываем файл, пропуская сигнатуру
-    fseek(file, offset, SEEK_SET);
-    fwrite(buffer, 1, remaining_size, file);
+    close(out);
 
-    // Укорачиваем файл
-    if (ftruncate(fileno(file), file_size - sig_len) != 0) {
-        perror("Ошибка укорачивания файла");
-        free(buffer);
-        fclose(file);
+    if (rename(tmp_path, path) != 0) {
+        perror("Ошибка замены файла");
+        unlink(tmp_path);
         return -1;
     }
 
-    free(buffer);
-    fclose(file);
+    // Новое имя переживёт сбой только после fsync каталога
+    char dir_path[1024];
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    int dir = open(dirname(dir_path), O_RDONLY | O_DIRECTORY);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
     return 0;
 }
 
-// Лечение файлов
-void heal_files_with_status_2() {
-    printf("===== Лечение =====\n");
-
-    sqlite3_stmt *stmt;
-    const char *sql_select = "SELECT id, path, offset, LENGTH(signature) FROM FoundFiles WHERE status = 2";
-
-    if (sqlite3_prepare_v2(db, sql_select, -1, &stmt, NULL) != SQLITE_OK) {
-        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
-        return;
+// Удаление из файла участков ranges (отсортированы и не пересекаются)
+int heal_file(const char *path, const struct byte_range *ranges, long n, struct heal_buffer *hb) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror("Ошибка открытия файла");
+        return -1;
     }
 
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        int id = sqlite3_column_int(stmt, 0);
-        const char *path = (const char *)sqlite3_column_text(stmt, 1);
-        long offset = sqlite3_column_int64(stmt, 2);
-        size_t sig_len = sqlite3_column_int(stmt, 3);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Ошибка получения размера файла");
+        close(fd);
+        return -1;
+    }
+    for (long i = 0; i < n; i++) {
+        if (ranges[i].offset + ranges[i].length > (uint64_t)st.st_size) {
+            fprintf(stderr, "Участок %llu+%llu за концом файла %s\n", (unsigned long long)ranges[i].offset,
+                    (unsigned long long)ranges[i].length, path);
+            close(fd);
+            return -1;
+        }
+    }
 
-        printf("Обрабатывается файл: %s, ID: %d, смещение: %ld, длина сигнатуры: %zu\n", path, id, offset, sig_len);
+    int rc = heal_collapse(fd, &st, ranges, n);
+    if (rc == 1) rc = heal_rewrite(path, fd, &st, ranges, n, hb);
 
-        if (remove_signature(path, offset, sig_len) == 0) {
-            // Успешно удалили сигнатуру, обновляем статус
-            del_by_id(id);
+    close(fd);
+    return rc;
+}
 
+// Сортировка участков и слияние пересекающихся и соседних. Возвращает число участков.
+long merge_ranges(struct byte_range *ranges, size_t count) {
+    qsort(ranges, count, sizeof(*ranges), byte_range_cmp);
+    size_t merged = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct byte_range *last = merged ? &ranges[merged - 1] : NULL;
+        if (last && ranges[i].offset <= last->offset + last->length) {
+            uint64_t end = ranges[i].offset + ranges[i].length;
+            if (end > last->offset + last->length) last->length = end - last->offset;
         } else {
-            fprintf(stderr, "Ошибка обработки файла: %s\n", path);
+            ranges[merged++] = ranges[i];
         }
     }
-
-    sqlite3_finalize(stmt);
+    return merged;
 }
 
 // ----- карантин -----
+// Файл читается блоками, шифруется AES-256-GCM (EVP, с AES-NI там, где оно есть) во временный
+// файл в Quarantine и за тот же проход хэшируется SHA-256. Исходный файл не меняется и
+// удаляется только после того, как зашифрованная копия записана на диск и переименована.
+// Старые записи QuarTable без cipher зашифрованы XOR с ключом 0x39.
+#define QUAR_CHUNK_SIZE (1 << 20)
+#define QUAR_CIPHER     "aes-256-gcm"
+#define QUAR_KEY_LEN    32
+#define QUAR_IV_LEN     12
+#define QUAR_TAG_LEN    16
+
 // Вычисление SHA256-хэша от пути
 void calculate_hash(const char *path, char *hash_out) {
     unsigned char hash[SHA256_DIGEST_LENGTH];
@@ -372,256 +1412,6971 @@ void calculate_hash(const char *path, char *hash_out) {
     hash_out[SHA256_DIGEST_LENGTH * 2] = '\0'; // Завершающий символ
 }
 
-// Шифрование файла с использованием XOR
-int xor_encrypt_file(const char *file_path, unsigned char xor_key) {
-    FILE *file = fopen(file_path, "rb+");
-    if (!file) {
-        perror("Ошибка при открытии файла для шифрования");
+// Ключ карантина: случайные байты в файле рядом с БД, создаётся при первом карантине
+int quar_load_key(unsigned char *key) {
+    int fd = open(QUAR_KEY_PATH, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, key, QUAR_KEY_LEN);
+        close(fd);
+        if (n == QUAR_KEY_LEN) return 0;
+        fprintf(stderr, "Повреждён ключ карантина: %s\n", QUAR_KEY_PATH);
         return -1;
     }
+    if (errno != ENOENT) {
+        perror("Ошибка открытия ключа карантина");
+        return -1;
+    }
+
+    if (RAND_bytes(key, QUAR_KEY_LEN) != 1) {
+        fprintf(stderr, "Ошибка генерации ключа карантина\n");
+        return -1;
+    }
+    fd = open(QUAR_KEY_PATH, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || write_at(fd, key, QUAR_KEY_LEN, 0) != 0 || fsync(fd) != 0) {
+        perror("Ошибка записи ключа карантина");
+        if (fd >= 0) close(fd);
+        unlink(QUAR_KEY_PATH);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
 
-    // Чтение и шифрование содержимого файла
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
+struct quar_result {
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];          // имя в Quarantine (хэш пути)
+    char content_hash[SHA256_DIGEST_LENGTH * 2 + 1];  // SHA-256 содержимого
+    unsigned char iv[QUAR_IV_LEN];
+    unsigned char tag[QUAR_TAG_LEN];
+};
 
-    unsigned char *buffer = malloc(file_size);
-    if (!buffer) {
-        perror("Ошибка выделения памяти");
-        fclose(file);
+// Шифрование файла path в Quarantine/<хэш пути>; in и out - буферы по QUAR_CHUNK_SIZE
+int quar_encrypt_file(const char *path, const unsigned char *key, unsigned char *in, unsigned char *out,
+                      struct quar_result *res) {
+    char dst[512], tmp[512];
+    calculate_hash(path, res->hash);
+    snprintf(dst, sizeof(dst), "Quarantine/%s", res->hash);
+    snprintf(tmp, sizeof(tmp), "Quarantine/%s.XXXXXX", res->hash);
+
+    int src = open(path, O_RDONLY);
+    if (src < 0) {
+        fprintf(stderr, "Ошибка открытия файла %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        perror("Ошибка создания файла в карантине");
+        close(src);
         return -1;
     }
 
-    fread(buffer, 1, file_size, file);
-    rewind(file);
+    EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int ok = cipher && md && RAND_bytes(res->iv, QUAR_IV_LEN) == 1 &&
+             EVP_EncryptInit_ex(cipher, EVP_aes_256_gcm(), NULL, key, res->iv) == 1 &&
+             EVP_DigestInit_ex(md, EVP_sha256(), NULL) == 1;
+
+    uint64_t pos = 0;
+    while (ok) {
+        ssize_t n = pread(src, in, QUAR_CHUNK_SIZE, pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+
+        int out_len;
+        ok = EVP_DigestUpdate(md, in, n) == 1 &&
+             EVP_EncryptUpdate(cipher, out, &out_len, in, n) == 1 &&
+             write_at(fd, out, out_len, pos) == 0;
+        pos += n;
+    }
+
+    int final_len;
+    ok = ok && EVP_EncryptFinal_ex(cipher, out, &final_len) == 1 &&
+         EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_GET_TAG, QUAR_TAG_LEN, res->tag) == 1 &&
+         EVP_DigestFinal_ex(md, digest, NULL) == 1 &&
+         fsync(fd) == 0;
+
+    EVP_CIPHER_CTX_free(cipher);
+    EVP_MD_CTX_free(md);
+    close(fd);
+    close(src);
+
+    if (!ok || rename(tmp, dst) != 0) {
+        fprintf(stderr, "Ошибка шифрования файла: %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
 
-    for (long i = 0; i < file_size; i++) {
-        buffer[i] ^= xor_key;
+    // Копия в карантине готова - только теперь убираем исходный файл
+    if (unlink(path) != 0) {
+        fprintf(stderr, "Ошибка удаления файла %s: %s\n", path, strerror(errno));
+        unlink(dst);
+        return -1;
     }
 
-    fwrite(buffer, 1, file_size, file);
-    free(buffer);
-    fclose(file);
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) sprintf(res->content_hash + i * 2, "%02x", digest[i]);
     return 0;
 }
 
-// Основная функция обработки
-void quar_files_with_status_3() {
-    printf("===== Карантин =====\n");
+// Новые имена в Quarantine переживут сбой только после fsync каталога
+void quar_sync_dir() {
+    int dir = open("Quarantine", O_RDONLY | O_DIRECTORY);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+}
 
+// Запись о файле в QuarTable
+void quar_record(const char *path, const struct quar_result *res) {
+    sqlite3_stmt *insert_stmt = db_stmt(STMT_INSERT_QUAR);
+    if (!insert_stmt) return;
 
-    sqlite3_stmt *stmt;
-    const char *select_query = "SELECT id, path FROM FoundFiles WHERE status = 3;";
-    const char *insert_query = "INSERT INTO QuarTable (id, path, hash) VALUES (?, ?, ?);";
+    sqlite3_bind_text(insert_stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(insert_stmt, 2, res->hash, -1, SQLITE_STATIC);
+    sqlite3_bind_text(insert_stmt, 3, res->content_hash, -1, SQLITE_STATIC);
+    sqlite3_bind_text(insert_stmt, 4, QUAR_CIPHER, -1, SQLITE_STATIC);
+    sqlite3_bind_blob(insert_stmt, 5, res->iv, QUAR_IV_LEN, SQLITE_STATIC);
+    sqlite3_bind_blob(insert_stmt, 6, res->tag, QUAR_TAG_LEN, SQLITE_STATIC);
 
-    // Создание директории Quarantine, если она не существует
-    if (mkdir("Quarantine", 0777) && errno != EEXIST) {
-        perror("Ошибка создания директории Quarantine");
-        return;
+    db_write();
+    if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Ошибка выполнения запроса вставки: %s\n", sqlite3_errmsg(db));
     }
+    db_stmt_release(insert_stmt);
+}
 
-    // Подготовка запроса для выборки файлов со статусом 3
-    if (sqlite3_prepare_v2(db, select_query, -1, &stmt, NULL) != SQLITE_OK) {
-        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
-        return;
-    }
+// ----- Исполнитель действий -----
+// Команда start: сначала снимок всех строк FoundFiles со статусами 1-3 (курсор закрывается
+// до любых изменений таблицы), затем действия выполняются пулом потоков группами - удаление,
+// лечение, карантин. Файловые операции идут параллельно, а результаты записывает текущий
+// поток пакетными транзакциями.
+enum action { ACTION_DELETE = 1, ACTION_HEAL = 2, ACTION_QUAR = 3 };
 
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        int id = sqlite3_column_int(stmt, 0);
-        const char *path = (const char *)sqlite3_column_text(stmt, 1);
+extern int scan_threads;
+int default_scan_threads();
 
-        // Вычисление хэша
-        char hash[SHA256_DIGEST_LENGTH * 2 + 1];
-        calculate_hash(path, hash);
+struct action_job {
+    int id;
+    int status;
+    char *path;
+    struct byte_range *ranges;  // участки для лечения
+    long n_ranges;
+    struct quar_result quar;
+    int ok;
+};
 
-        // Шифрование файла
-        if (xor_encrypt_file(path, 0x39) != 0) {
-            fprintf(stderr, "Ошибка шифрования файла: %s\n", path);
-            continue;
+// Буферы потока исполнителя, выделяются при первой необходимости
+struct action_local {
+    struct heal_buffer heal;
+    unsigned char *quar_in;
+    unsigned char *quar_out;
+};
+
+struct action_pool;
+typedef int (*action_fn)(struct action_pool *ap, struct action_job *job, struct action_local *local);
+
+struct action_pool {
+    struct action_job *jobs;    // текущая группа
+    size_t n_jobs;
+    size_t next;                // следующее задание, берётся атомарно
+    action_fn run;
+    unsigned char key[QUAR_KEY_LEN];
+};
+
+static int run_delete(struct action_pool *ap, struct action_job *job, struct action_local *local) {
+    if (unlink(job->path) == 0) return 0;
+    fprintf(stderr, "Ошибка удаления файла %s: %s\n", job->path, strerror(errno));
+    return -1;
+}
+
+static int run_heal(struct action_pool *ap, struct action_job *job, struct action_local *local) {
+    if (heal_file(job->path, job->ranges, job->n_ranges, &local->heal) == 0) return 0;
+    fprintf(stderr, "Ошибка обработки файла: %s\n", job->path);
+    return -1;
+}
+
+static int run_quar(struct action_pool *ap, struct action_job *job, struct action_local *local) {
+    if (!local->quar_in) {
+        size_t capacity;
+        local->quar_in = pool_get(QUAR_CHUNK_SIZE, &capacity);
+        local->quar_out = pool_get(QUAR_CHUNK_SIZE, &capacity);
+        if (!local->quar_in || !local->quar_out) {
+            perror("Ошибка выделения памяти");
+            return -1;
         }
+    }
+    return quar_encrypt_file(job->path, ap->key, local->quar_in, local->quar_out, &job->quar);
+}
 
-        // Перемещение файла в папку Quarantine с новым именем
-        char new_path[512];
-        snprintf(new_path, sizeof(new_path), "Quarantine/%s", hash);
-        if (rename(path, new_path) != 0) {
-            perror("Ошибка перемещения файла");
-            continue;
+static void *action_worker(void *arg) {
+    struct action_pool *ap = arg;
+    struct action_local local = { { NULL }, NULL, NULL };
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&ap->next, 1, __ATOMIC_RELAXED)) < ap->n_jobs) {
+        ap->jobs[i].ok = ap->run(ap, &ap->jobs[i], &local) == 0;
+    }
+
+    pool_put(local.heal.data, HEAL_BUFFER_SIZE);
+    pool_put(local.quar_in, QUAR_CHUNK_SIZE);
+    pool_put(local.quar_out, QUAR_CHUNK_SIZE);
+    return NULL;
+}
+
+// Выполнение run над группой заданий; текущий поток работает наравне с остальными
+static void action_run_group(struct action_pool *ap, struct action_job *jobs, size_t n, action_fn run) {
+    ap->jobs = jobs;
+    ap->n_jobs = n;
+    ap->next = 0;
+    ap->run = run;
+
+    int n_threads = scan_threads > 0 ? scan_threads : default_scan_threads();
+    if ((size_t)n_threads > n) n_threads = n;
+    pthread_t *workers = n_threads > 1 ? calloc(n_threads - 1, sizeof(pthread_t)) : NULL;
+    int started = 0;
+    while (workers && started < n_threads - 1 && pthread_create(&workers[started], NULL, action_worker, ap) == 0) {
+        started++;
+    }
+    action_worker(ap);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+}
+
+// Снимок строк FoundFiles с назначенными действиями, по статусу и id.
+// Участки для лечения всех файлов читаются одним запросом.
+static struct action_job *action_snapshot(size_t *n_jobs) {
+    const char *sql_rows = "SELECT id, path, status, offset, LENGTH(signature) FROM FoundFiles "
+                           "WHERE status IN (1, 2, 3) ORDER BY status, id;";
+    const char *sql_hits = "SELECT h.file_id, h.offset, h.length FROM Hits h "
+                           "JOIN FoundFiles f ON f.id = h.file_id WHERE f.status = 2 ORDER BY h.file_id;";
+    sqlite3_stmt *stmt;
+    struct action_job *jobs = NULL;
+    size_t count = 0, capacity = 0;
+
+    if (sqlite3_prepare_v2(db, sql_rows, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
+        return NULL;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            struct action_job *p = realloc(jobs, capacity * sizeof(*p));
+            if (!p) break;
+            jobs = p;
         }
+        struct action_job *job = &jobs[count];
+        memset(job, 0, sizeof(*job));
+        job->id = sqlite3_column_int(stmt, 0);
+        job->path = strdup((const char *)sqlite3_column_text(stmt, 1));
+        job->status = sqlite3_column_int(stmt, 2);
+        if (!job->path) break;
 
-        // Добавление записи в таблицу quar_table
-        sqlite3_stmt *insert_stmt;
-        if (sqlite3_prepare_v2(db, insert_query, -1, &insert_stmt, NULL) != SQLITE_OK) {
-            fprintf(stderr, "Ошибка подготовки запроса вставки: %s\n", sqlite3_errmsg(db));
-            continue;
+        // Старые записи без Hits лечатся по единственному совпадению из FoundFiles
+        if (job->status == ACTION_HEAL && (job->ranges = malloc(sizeof(*job->ranges)))) {
+            job->ranges[0].offset = sqlite3_column_int64(stmt, 3);
+            job->ranges[0].length = sqlite3_column_int64(stmt, 4);
         }
+        count++;
+    }
+    sqlite3_finalize(stmt);
 
-        sqlite3_bind_text(insert_stmt, 2, path, -1, SQLITE_STATIC);
-        sqlite3_bind_text(insert_stmt, 3, hash, -1, SQLITE_STATIC);
+    // Задания на лечение идут подряд и отсортированы по id, как и совпадения
+    size_t heal = 0;
+    while (heal < count && jobs[heal].status != ACTION_HEAL) heal++;
+    if (heal < count && sqlite3_prepare_v2(db, sql_hits, -1, &stmt, NULL) == SQLITE_OK) {
+        size_t *cap = calloc(count, sizeof(size_t));
+        size_t j = heal;
+        while (cap && sqlite3_step(stmt) == SQLITE_ROW) {
+            int file_id = sqlite3_column_int(stmt, 0);
+            while (j < count && jobs[j].status == ACTION_HEAL && jobs[j].id < file_id) j++;
+            if (j == count || jobs[j].status != ACTION_HEAL) break;
+            if (jobs[j].id != file_id) continue;
 
-        if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
-            fprintf(stderr, "Ошибка выполнения запроса вставки: %s\n", sqlite3_errmsg(db));
+            struct action_job *job = &jobs[j];
+            if ((size_t)job->n_ranges == cap[j]) {
+                cap[j] = cap[j] ? cap[j] * 2 : 4;
+                struct byte_range *p = realloc(job->ranges, cap[j] * sizeof(*p));
+                if (!p) continue;
+                job->ranges = p;
+            }
+            job->ranges[job->n_ranges].offset = sqlite3_column_int64(stmt, 1);
+            job->ranges[job->n_ranges].length = sqlite3_column_int64(stmt, 2);
+            job->n_ranges++;
         }
+        sqlite3_finalize(stmt);
+        free(cap);
+    }
+
+    for (size_t i = heal; i < count && jobs[i].status == ACTION_HEAL; i++) {
+        if (jobs[i].ranges) jobs[i].n_ranges = jobs[i].n_ranges ? merge_ranges(jobs[i].ranges, jobs[i].n_ranges) : 1;
+    }
+
+    *n_jobs = count;
+    return jobs;
+}
 
-        sqlite3_finalize(insert_stmt);
+// Запись результатов группы: карантин - в QuarTable, удачные строки удаляются из FoundFiles
+static void action_record(struct action_job *jobs, size_t n, const char *title) {
+    size_t done = 0;
 
-        del_by_id(id);
+    // Записи о карантине группы - одной транзакцией
+    db_batch_hold();
+    for (size_t i = 0; i < n; i++) {
+        struct action_job *job = &jobs[i];
+        if (!job->ok) continue;
+        if (job->status == ACTION_QUAR) quar_record(job->path, &job->quar);
+        del_by_id(job->id);
+        done++;
     }
+    db_batch_release();
 
-    sqlite3_finalize(stmt);
+    printf("%s: %zu, ошибок: %zu\n", title, done, n - done);
 }
 
 // Обработка установленной информации в таблице FoundFiles
 void process_table_info() {
-    del_files_with_status_1();
-    heal_files_with_status_2();
-    quar_files_with_status_3();
+    static const struct {
+        enum action action;
+        enum phase phase;
+        action_fn run;
+        const char *header;
+        const char *title;
+    } groups[] = {
+        { ACTION_DELETE, PHASE_DELETE, run_delete, "===== Удаление =====", "Удалено файлов" },
+        { ACTION_HEAL,   PHASE_HEAL,   run_heal,   "===== Лечение =====",  "Вылечено файлов" },
+        { ACTION_QUAR,   PHASE_QUAR,   run_quar,   "===== Карантин =====", "Помещено в карантин" },
+    };
 
-    return;
+    size_t n_jobs = 0;
+    struct action_job *jobs = action_snapshot(&n_jobs);
+    struct action_pool ap;
+    memset(&ap, 0, sizeof(ap));
+
+    db_batch_start();
+    size_t from = 0;
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        size_t to = from;
+        while (to < n_jobs && jobs[to].status == (int)groups[g].action) to++;
+        printf("%s\n", groups[g].header);
+
+        PHASE_START(t);
+        int ready = 1;
+        if (groups[g].action == ACTION_QUAR && to > from) {
+            // Каталог и ключ нужны, только если есть что помещать в карантин
+            ready = (mkdir("Quarantine", 0777) == 0 || errno == EEXIST) && quar_load_key(ap.key) == 0;
+            if (!ready) perror("Ошибка подготовки карантина");
+        }
+        if (ready && to > from) {
+            action_run_group(&ap, jobs + from, to - from, groups[g].run);
+            if (groups[g].action == ACTION_QUAR) quar_sync_dir();
+            action_record(jobs + from, to - from, groups[g].title);
+        }
+        PHASE_STOP(groups[g].phase, t);
+        from = to;
+    }
+    db_batch_end();
+    OPENSSL_cleanse(ap.key, sizeof(ap.key));
+
+    for (size_t i = 0; i < n_jobs; i++) {
+        free(jobs[i].path);
+        free(jobs[i].ranges);
+    }
+    free(jobs);
+    stats_export();
 }
 
-// ====================================== Поиск сигнатур в файлe ======================================
-// Функция для поиска сигнатур из БД в файле
-void search_signatures_in_file(const char *filename) {
-    const char *sig_query_sql = "SELECT signature FROM Signatures;";
-    sqlite3_stmt *stmt;
-    FILE *file;
-    size_t file_size;
+// ====================================== Мультипаттерн-поиск (Aho-Corasick) ======================================
+// Все сигнатуры компилируются в один автомат, который находит их за один линейный проход по файлу.
+// Состояния пронумерованы в порядке обхода в ширину, переходы каждого состояния лежат подряд
+// и отсортированы по байту. Корень и состояния с большим числом переходов хранятся плотной
+// строкой на 256 элементов, остальные - разреженным списком.
+#define AC_NONE      0xFFFFFFFFu
+#define AC_DENSE_MIN 16   // с какого числа переходов состояние хранится плотной строкой
 
-// ---------- Читаем файл в память ----------
-    // Открываем файл для чтения
-    file = fopen(filename, "rb");
-    if (!file) {
-        perror("Ошибка открытия файла");
-        return;
+struct ac_state {
+    uint32_t fail;      // суффиксная ссылка
+    uint32_t dict;      // ближайшее по суффиксным ссылкам состояние, где заканчивается сигнатура
+    uint32_t pattern;   // сигнатура, заканчивающаяся в этом состоянии (AC_NONE, если нет)
+    uint32_t edges;     // начало переходов в edge_bytes/edge_next либо номер плотной строки
+    uint16_t n_edges;   // число переходов
+    uint16_t dense;     // 1 - переходы лежат в dense[edges * 256]
+};
+
+struct ac_pattern {
+    int64_t  id;        // id сигнатуры в таблице Signatures
+    uint32_t offset;    // смещение байтов сигнатуры в bytes[]
+    uint32_t length;    // длина сигнатуры
+    uint32_t owner;     // маскированная сигнатура, якорем которой служит строка (AC_NONE - обычная)
+    uint32_t anchor;    // смещение якоря в опорном фрагменте маскированной сигнатуры
+    uint32_t next;      // следующая строка с теми же байтами (AC_NONE - нет)
+    uint32_t reserved;
+};
+
+// ----- Маскированные сигнатуры -----
+// Текстовая запись (Signatures.kind = 1): байты в hex, "??" - любой байт, "4?" / "?A" - маска
+// по полубайту, "[n]" или "[n-m]" - пропуск от n до m произвольных байт. Пропуски делят
+// сигнатуру на фрагменты. Один фрагмент выбирается опорным: его самая длинная точная подстрока
+// ищется основным автоматом, а если такой нет - фрагмент целиком ищется движком Shift-And.
+// Остальные фрагменты проверяются вокруг опорного с учётом допустимых пропусков.
+#define MASK_KIND_EXACT  0
+#define MASK_KIND_MASKED 1
+#define SHIFT_AND_MAX    64   // длина фрагмента для движка Shift-And
+
+struct mask_elem {
+    unsigned char value;    // байт b подходит, если (b & mask) == value
+    unsigned char mask;
+};
+
+struct mask_frag {
+    uint32_t elem;          // первый элемент в elems[]
+    uint32_t length;
+    uint32_t gap_min;       // пропуск перед фрагментом
+    uint32_t gap_max;
+};
+
+struct masked_sig {
+    int64_t  id;            // id в таблице Signatures
+    uint32_t text;          // исходная запись в bytes[]
+    uint32_t text_length;
+    uint32_t frag;          // первый фрагмент в frags[]
+    uint32_t n_frags;
+    uint32_t anchor_frag;   // опорный фрагмент
+    uint32_t shift_and;     // 1 - опорный фрагмент ищет Shift-And, 0 - автомат по якорю
+    uint32_t max_span;      // наибольшая длина совпадения
+    uint32_t reserved;
+};
+
+struct matcher {
+    uint32_t n_states;
+    uint32_t n_edges;
+    uint32_t n_dense;
+    uint32_t n_patterns;
+    uint32_t max_len;             // длина самого длинного возможного совпадения
+    uint32_t n_masked;
+    uint32_t n_frags;
+    uint32_t n_elems;
+    uint64_t n_bytes;
+    struct ac_state   *states;
+    unsigned char     *edge_bytes;
+    uint32_t          *edge_next;
+    uint32_t          *dense;
+    struct ac_pattern *patterns;
+    unsigned char     *bytes;     // байты всех сигнатур подряд
+    struct masked_sig *masked;
+    struct mask_frag  *frags;
+    struct mask_elem  *elems;
+    int64_t generation;           // поколение набора сигнатур, из которого собран автомат
+    int64_t removed;              // поколение удалений на момент сборки
+    int64_t max_id;               // наибольший id сигнатуры в автомате
+    struct matcher *delta;        // сигнатуры, добавленные после сборки (NULL - нет)
+    void  *map;                   // отображённый файл кэша (NULL, если таблицы в куче)
+    size_t map_len;
+    struct prefilter *pf;         // векторный предфильтр (NULL - поиск только автоматом)
+    struct shift_and *sa;         // движок Shift-And для маскированных фрагментов
+    struct rk_index *rk;          // поиск по хэшу окна (NULL - автомат или предфильтр)
+};
+
+// Обработчик найденной сигнатуры: p - сигнатура, offset и length - найденный участок файла.
+// Ненулевой результат останавливает поиск.
+typedef int (*hit_fn)(void *ctx, const struct matcher *m, const struct ac_pattern *p,
+                      uint64_t offset, uint32_t length);
+
+int masked_verify(const struct matcher *m, uint32_t ms, const unsigned char *buf, size_t len,
+                  size_t frag_start, uint64_t base, hit_fn fn, void *ctx);
+
+// Найдена строка автомата, начинающаяся в позиции pos буфера
+static inline int report_literal(const struct matcher *m, const struct ac_pattern *p, const unsigned char *buf,
+                                 size_t len, size_t pos, uint64_t base, hit_fn fn, void *ctx) {
+    if (p->owner == AC_NONE) return fn(ctx, m, p, base + pos, p->length);
+
+    // Якорь маскированной сигнатуры: проверяем её целиком вокруг опорного фрагмента
+    if (pos < p->anchor) return 0;
+    return masked_verify(m, p->owner, buf, len, pos - p->anchor, base, fn, ctx);
+}
+
+struct matcher *matcher = NULL; // автомат, собранный в начале check
+
+// Переход автомата по байту c с учётом суффиксных ссылок
+static inline uint32_t ac_step(const struct matcher *m, uint32_t s, unsigned char c) {
+    for (;;) {
+        const struct ac_state *st = &m->states[s];
+        uint32_t next = AC_NONE;
+
+        if (st->dense) {
+            next = m->dense[(size_t)st->edges * 256 + c];
+        } else {
+            const unsigned char *b = m->edge_bytes + st->edges;
+            for (uint32_t i = 0; i < st->n_edges && b[i] <= c; i++) {
+                if (b[i] == c) {
+                    next = m->edge_next[st->edges + i];
+                    break;
+                }
+            }
+        }
+
+        // Строка корня заполнена полностью, поэтому цикл всегда завершается
+        if (next != AC_NONE) return next;
+        s = st->fail;
     }
+}
 
-    fseek(file, 0, SEEK_END);
-    file_size = ftell(file);
-    rewind(file);
+// Прогон буфера через автомат. base - смещение buf[0] от начала файла.
+// Возвращает 1, если обработчик остановил поиск.
+int ac_scan(const struct matcher *m, uint32_t *state, const unsigned char *buf, size_t len,
+            uint64_t base, hit_fn fn, void *ctx) {
+    uint32_t s = *state;
 
-    unsigned char *buffer = malloc(file_size);
-    if (!buffer) {
-        perror("Ошибка выделения памяти");
-        fclose(file);
-        return;
+    for (size_t i = 0; i < len; i++) {
+        s = ac_step(m, s, buf[i]);
+
+        // Перебираем все сигнатуры, заканчивающиеся в этой позиции
+        uint32_t o = m->states[s].pattern != AC_NONE ? s : m->states[s].dict;
+        while (o != AC_NONE) {
+            const struct ac_pattern *p = &m->patterns[m->states[o].pattern];
+            for (; p; p = p->next != AC_NONE ? &m->patterns[p->next] : NULL) {
+                if (report_literal(m, p, buf, len, i + 1 - p->length, base, fn, ctx)) {
+                    *state = s;
+                    return 1;
+                }
+            }
+            o = m->states[o].dict;
+        }
     }
 
-    fread(buffer, 1, file_size, file);
-    fclose(file);
-// ------------------------------------------
+    *state = s;
+    return 0;
+}
+
+void prefilter_free(struct prefilter *pf);
+void shift_and_free(struct shift_and *sa);
+void rk_free(struct rk_index *rk);
 
-    // Подготавливаем запрос для получения сигнатур из БД
-    if (sqlite3_prepare_v2(db, sig_query_sql, -1, &stmt, 0) != SQLITE_OK) {
-        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
-        free(buffer);
+void matcher_free(struct matcher *m) {
+    if (!m) return;
+    matcher_free(m->delta);
+    prefilter_free(m->pf);
+    shift_and_free(m->sa);
+    rk_free(m->rk);
+    if (m->map) {
+        // Таблицы лежат внутри отображённого кэша
+        munmap(m->map, m->map_len);
+        free(m);
         return;
     }
+    free(m->states);
+    free(m->edge_bytes);
+    free(m->edge_next);
+    free(m->dense);
+    free(m->patterns);
+    free(m->bytes);
+    free(m->masked);
+    free(m->frags);
+    free(m->elems);
+    free(m);
+}
 
+// Построение автомата по набору сигнатур (patterns ссылаются на bytes)
+struct matcher *matcher_build(struct ac_pattern *patterns, uint32_t n_patterns,
+                              unsigned char *bytes, uint64_t n_bytes) {
+    struct matcher *m = calloc(1, sizeof(*m));
+    if (!m) return NULL;
+    m->patterns = patterns;
+    m->n_patterns = n_patterns;
+    m->bytes = bytes;
+    m->n_bytes = n_bytes;
 
-    int found = 0;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const unsigned char *signature = sqlite3_column_blob(stmt, 0);
-        int sig_size = sqlite3_column_bytes(stmt, 0);
+    // ---------- Бор на списках детей ----------
+    size_t cap = n_bytes + 1;
+    uint32_t *child   = malloc(cap * sizeof(uint32_t)); // первый ребёнок
+    uint32_t *sibling = malloc(cap * sizeof(uint32_t)); // следующий брат (по возрастанию байта)
+    uint32_t *term    = malloc(cap * sizeof(uint32_t)); // сигнатура, заканчивающаяся в узле
+    uint16_t *deg     = calloc(cap, sizeof(uint16_t));
+    unsigned char *label = malloc(cap);
+    uint32_t *order   = malloc(cap * sizeof(uint32_t)); // узлы в порядке обхода в ширину
+    uint32_t *remap   = malloc(cap * sizeof(uint32_t)); // узел -> номер состояния
+    if (!child || !sibling || !term || !deg || !label || !order || !remap) goto fail;
 
-        // Поиск сигнатуры в файле
-        for (int i = 0; i <= (int)file_size - (int)sig_size; i++) {
-            if (memcmp(buffer + i, signature, sig_size) == 0) {
-                printf("Сигнатура найдена в файле %s по смещению %zu\n", filename, i);
+    uint32_t n_nodes = 1;
+    child[0] = sibling[0] = term[0] = AC_NONE;
 
-                // Добавляем запись о найденной сигнатуре в таблицу FoundFiles
-                insert_found_file(filename, i, signature, sig_size);
+    for (uint32_t p = 0; p < n_patterns; p++) {
+        const unsigned char *sig = bytes + patterns[p].offset;
+        uint32_t node = 0;
+        if (patterns[p].length > m->max_len) m->max_len = patterns[p].length;
 
-                found = 1;
-                break;
+        for (uint32_t i = 0; i < patterns[p].length; i++) {
+            uint32_t *link = &child[node];
+            while (*link != AC_NONE && label[*link] < sig[i]) link = &sibling[*link];
+
+            if (*link == AC_NONE || label[*link] != sig[i]) {
+                uint32_t fresh = n_nodes++;
+                label[fresh] = sig[i];
+                child[fresh] = term[fresh] = AC_NONE;
+                sibling[fresh] = *link;
+                *link = fresh;
+                deg[node]++;
             }
+            node = *link;
         }
-        if (found) break;
+
+        // Одинаковые строки (сигнатура и якорь маскированной) делят одно состояние
+        patterns[p].next = term[node];
+        term[node] = p;
     }
 
-    free(buffer);
-    sqlite3_finalize(stmt);
-    return;
-}
-// ====================================== Поиск файлов в директории ======================================
-void listFilesRecursive(const char *basePath) {
-    struct dirent *dp;
-    DIR *dir = opendir(basePath);
+    // ---------- Порядок обхода в ширину ----------
+    uint32_t head = 0, tail = 0;
+    order[tail++] = 0;
+    while (head < tail) {
+        uint32_t node = order[head++];
+        remap[node] = head - 1;
+        for (uint32_t c = child[node]; c != AC_NONE; c = sibling[c]) order[tail++] = c;
+    }
 
-    // Проверяем, удалось ли открыть каталог
-    if (dir == NULL) {
-        perror("opendir");
-        return;
+    // ---------- Плоские таблицы ----------
+    m->n_states = n_nodes;
+    m->n_edges = 0;
+    m->n_dense = 0;
+    for (uint32_t i = 0; i < n_nodes; i++) {
+        if (i == 0 || deg[i] >= AC_DENSE_MIN) m->n_dense++;
+        else m->n_edges += deg[i];
     }
 
-    while ((dp = readdir(dir)) != NULL) {
-        char path[1024];
-        struct stat statbuf;
+    m->states     = calloc(n_nodes, sizeof(struct ac_state));
+    m->edge_bytes = malloc(m->n_edges ? m->n_edges : 1);
+    m->edge_next  = malloc((m->n_edges ? m->n_edges : 1) * sizeof(uint32_t));
+    m->dense      = malloc((size_t)m->n_dense * 256 * sizeof(uint32_t));
+    if (!m->states || !m->edge_bytes || !m->edge_next || !m->dense) goto fail;
 
-        // Пропускаем текущий и родительский каталоги
-        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
-            continue;
+    uint32_t next_edge = 0, next_dense = 0;
+    for (uint32_t s = 0; s < n_nodes; s++) {
+        uint32_t node = order[s];
+        struct ac_state *st = &m->states[s];
+        st->pattern = term[node];
+        st->n_edges = deg[node];
+        st->fail = 0;
+        st->dict = AC_NONE;
+
+        if (s == 0 || deg[node] >= AC_DENSE_MIN) {
+            uint32_t *row = m->dense + (size_t)next_dense * 256;
+            for (int c = 0; c < 256; c++) row[c] = s == 0 ? 0 : AC_NONE;
+            for (uint32_t c = child[node]; c != AC_NONE; c = sibling[c]) row[label[c]] = remap[c];
+            st->dense = 1;
+            st->edges = next_dense++;
+        } else {
+            st->edges = next_edge;
+            for (uint32_t c = child[node]; c != AC_NONE; c = sibling[c]) {
+                m->edge_bytes[next_edge] = label[c];
+                m->edge_next[next_edge] = remap[c];
+                next_edge++;
+            }
+        }
+    }
+
+    // ---------- Суффиксные ссылки (в порядке обхода в ширину) ----------
+    for (uint32_t s = 0; s < n_nodes; s++) {
+        uint32_t node = order[s];
+        for (uint32_t c = child[node]; c != AC_NONE; c = sibling[c]) {
+            struct ac_state *ch = &m->states[remap[c]];
+            ch->fail = s == 0 ? 0 : ac_step(m, m->states[s].fail, label[c]);
+            const struct ac_state *f = &m->states[ch->fail];
+            ch->dict = ch->fail != 0 && f->pattern != AC_NONE ? ch->fail : f->dict;
         }
+    }
+
+    free(child); free(sibling); free(term); free(deg); free(label); free(order); free(remap);
+    return m;
+
+fail:
+    free(child); free(sibling); free(term); free(deg); free(label); free(order); free(remap);
+    m->patterns = NULL;
+    m->bytes = NULL;
+    matcher_free(m);
+    return NULL;
+}
+
+// ----- Разбор и проверка маскированных сигнатур -----
+static int hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
 
-        // Формируем полный путь к элементу
-        snprintf(path, sizeof(path), "%s/%s", basePath, dp->d_name);
+// Разбор текстовой записи. Возвращает число фрагментов или -1 при синтаксической ошибке.
+// Элементы и фрагменты дописываются в конец переданных массивов.
+long parse_masked(const char *text, size_t len, struct mask_elem **elems, uint32_t *n_elems,
+                  struct mask_frag **frags, uint32_t *n_frags) {
+    uint32_t first_frag = *n_frags;
+    uint32_t gap_min = 0, gap_max = 0;
+    int in_frag = 0;
+    size_t i = 0;
 
-        // Получаем информацию об элементе
-        if (stat(path, &statbuf) == -1) {
-            perror("stat");
+    while (i < len) {
+        char c = text[i];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            i++;
             continue;
         }
 
-        // Если это файл, выводим его
-        if (S_ISREG(statbuf.st_mode)) {
-            // printf("File: %s\n", path);
-            search_signatures_in_file(path);
+        if (c == '[') {
+            // Пропуск: [n] или [n-m], допустим только между фрагментами
+            char *end;
+            unsigned long lo = strtoul(text + i + 1, &end, 10), hi = lo;
+            if (end == text + i + 1) return -1;
+            if (*end == '-') {
+                const char *from = end + 1;
+                hi = strtoul(from, &end, 10);
+                if (end == from) return -1;
+            }
+            if (*end != ']' || hi < lo || hi > 0xFFFF || !in_frag) return -1;
+            gap_min += lo;
+            gap_max += hi;
+            in_frag = 0;
+            i = end - text + 1;
+            continue;
         }
 
-        // Если это директория, рекурсивно обрабатываем её
-        if (S_ISDIR(statbuf.st_mode)) {
-            // printf("Directory: %s\n", path);
-            listFilesRecursive(path);
+        // Байт: две hex-цифры, '?' на месте любой из них снимает маску полубайта
+        if (i + 1 >= len) return -1;
+        int hi = text[i] == '?' ? -2 : hex_nibble(text[i]);
+        int lo = text[i + 1] == '?' ? -2 : hex_nibble(text[i + 1]);
+        if (hi == -1 || lo == -1) return -1;
+
+        struct mask_elem e = { 0, 0 };
+        if (hi >= 0) { e.value |= hi << 4; e.mask |= 0xF0; }
+        if (lo >= 0) { e.value |= lo;      e.mask |= 0x0F; }
+
+        if (!in_frag) {
+            struct mask_frag *f = realloc(*frags, (*n_frags + 1) * sizeof(**frags));
+            if (!f) return -1;
+            *frags = f;
+            f[*n_frags] = (struct mask_frag){ *n_elems, 0, gap_min, gap_max };
+            (*n_frags)++;
+            gap_min = gap_max = 0;
+            in_frag = 1;
         }
+
+        struct mask_elem *el = realloc(*elems, (*n_elems + 1) * sizeof(**elems));
+        if (!el) return -1;
+        *elems = el;
+        el[(*n_elems)++] = e;
+        (*frags)[*n_frags - 1].length++;
+        i += 2;
     }
 
-    // Закрываем каталог
-    closedir(dir);
+    // Пустая запись или пропуск в конце
+    if (*n_frags == first_frag || !in_frag) return -1;
+    return *n_frags - first_frag;
 }
 
+// Маскированная сигнатура хранится текстом, например "4D 5A ?? ?? 5? [4-16] E8 ?? ?? ?? ??"
+void insert_masked_signature(const char *pattern) {
+    struct mask_elem *elems = NULL;
+    struct mask_frag *frags = NULL;
+    uint32_t n_elems = 0, n_frags = 0;
 
-void main(int argc, char *argv[]) {
-    initialize_db(&db);
-    char command[100];
-    const char *startPath = "../ForAntivirus"; // Директория по умолчанию
-    int number = 0;  // Переменная для хранения числа
+    long n = parse_masked(pattern, strlen(pattern), &elems, &n_elems, &frags, &n_frags);
+    free(elems);
+    free(frags);
+    if (n < 0) {
+        fprintf(stderr, "Ошибка разбора маскированной сигнатуры: %s\n", pattern);
+        return;
+    }
+    insert_signature_kind((const unsigned char *)pattern, strlen(pattern), MASK_KIND_MASKED);
+}
 
-    while (1) {
-        printf("> ");
-        if (fgets(command, 100, stdin) == NULL) {
-            perror("Ошибка ввода");
-            continue;
-        }
+static inline int frag_matches(const struct matcher *m, const struct mask_frag *f, const unsigned char *p) {
+    const struct mask_elem *e = m->elems + f->elem;
+    for (uint32_t i = 0; i < f->length; i++) {
+        if ((p[i] & e[i].mask) != e[i].value) return 0;
+    }
+    return 1;
+}
 
-        // Удаляем символ новой строки в конце команды
-        command[strcspn(command, "\n")] = '\0';
+// Подбор пропусков влево от фрагмента f, начинающегося в pos. В *start - начало совпадения.
+static int extend_left(const struct matcher *m, const struct mask_frag *fr, uint32_t f,
+                       const unsigned char *buf, size_t pos, size_t *start) {
+    if (f == 0) {
+        *start = pos;
+        return 1;
+    }
+    for (uint32_t g = fr[f].gap_min; g <= fr[f].gap_max; g++) {
+        if (pos < g + fr[f - 1].length) break;
+        size_t prev = pos - g - fr[f - 1].length;
+        if (frag_matches(m, &fr[f - 1], buf + prev) && extend_left(m, fr, f - 1, buf, prev, start)) return 1;
+    }
+    return 0;
+}
 
-        if (strcmp(command, "check") == 0) {
-            listFilesRecursive(startPath);          // запускаем поиск вирусов
+// Подбор пропусков вправо от фрагмента f, заканчивающегося в end. В *stop - конец совпадения.
+static int extend_right(const struct matcher *m, const struct mask_frag *fr, uint32_t f, uint32_t n,
+                        const unsigned char *buf, size_t len, size_t end, size_t *stop) {
+    if (f + 1 == n) {
+        *stop = end;
+        return 1;
+    }
+    for (uint32_t g = fr[f + 1].gap_min; g <= fr[f + 1].gap_max; g++) {
+        size_t next = end + g;
+        if (next + fr[f + 1].length > len) break;
+        if (frag_matches(m, &fr[f + 1], buf + next) &&
+            extend_right(m, fr, f + 1, n, buf, len, next + fr[f + 1].length, stop)) return 1;
+    }
+    return 0;
+}
 
-        } else if (strcmp(command, "start") == 0) {
-            process_table_info();                                  // запускаем выполнение установленных работ
+// Проверка маскированной сигнатуры ms, опорный фрагмент которой начинается в frag_start
+int masked_verify(const struct matcher *m, uint32_t ms, const unsigned char *buf, size_t len,
+                  size_t frag_start, uint64_t base, hit_fn fn, void *ctx) {
+    const struct masked_sig *sig = &m->masked[ms];
+    const struct mask_frag *fr = m->frags + sig->frag;
+    uint32_t a = sig->anchor_frag;
+    size_t start, stop;
 
-        } else if (strcmp(command, "exit") == 0) {
-            break;                                  // выход из программы
+    if (frag_start + fr[a].length > len || !frag_matches(m, &fr[a], buf + frag_start)) return 0;
+    if (!extend_left(m, fr, a, buf, frag_start, &start)) return 0;
+    if (!extend_right(m, fr, a, sig->n_frags, buf, len, frag_start + fr[a].length, &stop)) return 0;
 
-        } else if (strcmp(command, "info") == 0) {
-            get_info();
+    // Для обработчика сигнатура - её текстовая запись
+    struct ac_pattern p = { sig->id, sig->text, sig->text_length, AC_NONE, 0, AC_NONE, 0 };
+    return fn(ctx, m, &p, base + start, stop - start);
+}
 
-        } else if (strcmp(command, "info0") == 0) {
-            display_files_with_status(0);
+// ----- Движок Shift-And -----
+// Опорные фрагменты без точных подстрок упаковываются в 64-битные слова. Бит j слова
+// соответствует позиции фрагмента, table[c] - позициям, которым подходит байт c.
+struct sa_word {
+    uint64_t table[256];
+    uint64_t starts;        // первые позиции фрагментов
+    uint64_t ends;          // последние позиции фрагментов
+    uint32_t owner[64];     // маскированная сигнатура по последней позиции
+};
 
-        } else if (sscanf(command, "info %d", &number) == 1) {
-            display_files_with_status(number);
+struct shift_and {
+    struct sa_word *words;
+    uint32_t n_words;
+};
+
+void shift_and_free(struct shift_and *sa) {
+    if (!sa) return;
+    free(sa->words);
+    free(sa);
+}
+
+struct shift_and *shift_and_build(const struct matcher *m) {
+    struct shift_and *sa = NULL;
+    uint32_t used = 64;     // занято бит в последнем слове
+
+    for (uint32_t i = 0; i < m->n_masked; i++) {
+        const struct masked_sig *sig = &m->masked[i];
+        if (!sig->shift_and) continue;
+
+        const struct mask_frag *f = &m->frags[sig->frag + sig->anchor_frag];
+        if (!sa && !(sa = calloc(1, sizeof(*sa)))) return NULL;
+        if (used + f->length > 64) {
+            struct sa_word *w = realloc(sa->words, (sa->n_words + 1) * sizeof(*w));
+            if (!w) {
+                shift_and_free(sa);
+                return NULL;
+            }
+            sa->words = w;
+            memset(&w[sa->n_words++], 0, sizeof(*w));
+            used = 0;
+        }
+
+        struct sa_word *w = &sa->words[sa->n_words - 1];
+        const struct mask_elem *e = m->elems + f->elem;
+        for (uint32_t j = 0; j < f->length; j++) {
+            for (int c = 0; c < 256; c++) {
+                if ((c & e[j].mask) == e[j].value) w->table[c] |= 1ull << (used + j);
+            }
+        }
+        w->starts |= 1ull << used;
+        w->ends |= 1ull << (used + f->length - 1);
+        w->owner[used + f->length - 1] = i;
+        used += f->length;
+    }
+    return sa;
+}
+
+int shift_and_scan(const struct matcher *m, const unsigned char *buf, size_t len,
+                   uint64_t base, hit_fn fn, void *ctx) {
+    for (uint32_t k = 0; k < m->sa->n_words; k++) {
+        const struct sa_word *w = &m->sa->words[k];
+        uint64_t d = 0;
+
+        for (size_t i = 0; i < len; i++) {
+            d = ((d << 1) | w->starts) & w->table[buf[i]];
+            uint64_t hit = d & w->ends;
+            while (hit) {
+                uint32_t ms = w->owner[__builtin_ctzll(hit)];
+                const struct masked_sig *sig = &m->masked[ms];
+                size_t flen = m->frags[sig->frag + sig->anchor_frag].length;
+                if (masked_verify(m, ms, buf, len, i + 1 - flen, base, fn, ctx)) return 1;
+                hit &= hit - 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// ----- Сборка набора сигнатур -----
+struct sig_set {
+    struct ac_pattern *patterns;
+    uint32_t n_patterns, cap_patterns;
+    unsigned char *bytes;
+    uint64_t n_bytes, cap_bytes;
+    struct masked_sig *masked;
+    uint32_t n_masked;
+    struct mask_frag *frags;
+    uint32_t n_frags;
+    struct mask_elem *elems;
+    uint32_t n_elems;
+    uint32_t max_span;      // наибольшая длина маскированного совпадения
+};
+
+void sig_set_free(struct sig_set *set) {
+    free(set->patterns);
+    free(set->bytes);
+    free(set->masked);
+    free(set->frags);
+    free(set->elems);
+    memset(set, 0, sizeof(*set));
+}
+
+// Дописать байты в bytes[], вернуть их смещение или -1
+static int64_t sig_set_append_bytes(struct sig_set *set, const void *data, size_t len) {
+    if (set->n_bytes + len > set->cap_bytes) {
+        uint64_t cap = set->cap_bytes ? set->cap_bytes : 4096;
+        while (set->n_bytes + len > cap) cap *= 2;
+        void *p = realloc(set->bytes, cap);
+        if (!p) return -1;
+        set->bytes = p;
+        set->cap_bytes = cap;
+    }
+    memcpy(set->bytes + set->n_bytes, data, len);
+    set->n_bytes += len;
+    return set->n_bytes - len;
+}
+
+// Строка для автомата: сигнатура целиком либо якорь маскированной сигнатуры owner
+static int sig_set_add_literal(struct sig_set *set, int64_t id, const unsigned char *data, uint32_t len,
+                               uint32_t owner, uint32_t anchor) {
+    if (set->n_patterns == set->cap_patterns) {
+        uint32_t cap = set->cap_patterns ? set->cap_patterns * 2 : 64;
+        void *p = realloc(set->patterns, cap * sizeof(*set->patterns));
+        if (!p) return -1;
+        set->patterns = p;
+        set->cap_patterns = cap;
+    }
+
+    int64_t offset = sig_set_append_bytes(set, data, len);
+    if (offset < 0) return -1;
+    set->patterns[set->n_patterns++] = (struct ac_pattern){ id, offset, len, owner, anchor, AC_NONE, 0 };
+    return 0;
+}
+
+// Добавление маскированной сигнатуры. -1 - запись не разобрана или её нечем искать.
+static int sig_set_add_masked(struct sig_set *set, int64_t id, const char *text, size_t len) {
+    uint32_t frag0 = set->n_frags, elem0 = set->n_elems;
+    long n = parse_masked(text, len, &set->elems, &set->n_elems, &set->frags, &set->n_frags);
+    if (n < 0) goto reject;
+
+    struct masked_sig sig = { .id = id, .frag = frag0, .n_frags = n };
+    const struct mask_frag *fr = set->frags + frag0;
+
+    // Самая длинная точная подстрока среди всех фрагментов
+    uint32_t best_frag = 0, best_at = 0, best_len = 0;
+    for (uint32_t f = 0; f < n; f++) {
+        sig.max_span += fr[f].length + fr[f].gap_max;
+        uint32_t run = 0;
+        for (uint32_t j = 0; j < fr[f].length; j++) {
+            run = set->elems[fr[f].elem + j].mask == 0xFF ? run + 1 : 0;
+            if (run > best_len) {
+                best_len = run;
+                best_frag = f;
+                best_at = j + 1 - run;
+            }
+        }
+    }
+
+    uint32_t ms = set->n_masked;
+    if (best_len >= 2) {
+        // Якорь для основного автомата
+        unsigned char literal[best_len];
+        for (uint32_t j = 0; j < best_len; j++) literal[j] = set->elems[fr[best_frag].elem + best_at + j].value;
+        sig.anchor_frag = best_frag;
+        if (sig_set_add_literal(set, id, literal, best_len, ms, best_at) != 0) goto reject;
+    } else {
+        // Точных подстрок нет: самый длинный фрагмент, который помещается в слово Shift-And
+        uint32_t pick = AC_NONE;
+        for (uint32_t f = 0; f < n; f++) {
+            if (fr[f].length <= SHIFT_AND_MAX && (pick == AC_NONE || fr[f].length > fr[pick].length)) pick = f;
+        }
+        if (pick == AC_NONE) goto reject;
+        sig.anchor_frag = pick;
+        sig.shift_and = 1;
+    }
+
+    int64_t text_offset = sig_set_append_bytes(set, text, len);
+    struct masked_sig *grown = realloc(set->masked, (set->n_masked + 1) * sizeof(*grown));
+    if (text_offset < 0 || !grown) goto reject;
+    sig.text = text_offset;
+    sig.text_length = len;
+    set->masked = grown;
+    set->masked[set->n_masked++] = sig;
+    if (sig.max_span > set->max_span) set->max_span = sig.max_span;
+    return 0;
+
+reject:
+    set->n_frags = frag0;
+    set->n_elems = elem0;
+    fprintf(stderr, "Маскированная сигнатура %lld пропущена: %.*s\n", (long long)id, (int)len, text);
+    return -1;
+}
+
+// Число сигнатур: строки автомата без якорей плюс маскированные, вместе с добавочным автоматом
+uint32_t matcher_signature_count(const struct matcher *m) {
+    uint32_t n = m->n_masked;
+    for (uint32_t i = 0; i < m->n_patterns; i++) {
+        if (m->patterns[i].owner == AC_NONE) n++;
+    }
+    return m->delta ? n + matcher_signature_count(m->delta) : n;
+}
+
+// Сборка автомата по набору; таблицы набора переходят автомату, при ошибке набор освобождается
+struct matcher *matcher_from_set(struct sig_set *set) {
+    struct matcher *m = matcher_build(set->patterns, set->n_patterns, set->bytes, set->n_bytes);
+    if (!m) {
+        perror("Ошибка построения автомата сигнатур");
+        sig_set_free(set);
+        return NULL;
+    }
+
+    m->masked = set->masked;
+    m->n_masked = set->n_masked;
+    m->frags = set->frags;
+    m->n_frags = set->n_frags;
+    m->elems = set->elems;
+    m->n_elems = set->n_elems;
+    if (set->max_span > m->max_len) m->max_len = set->max_span;
+    memset(set, 0, sizeof(*set));
+    return m;
+}
+
+// Сборка автомата по сигнатурам с id больше after_id. В *loaded - число принятых сигнатур.
+struct matcher *matcher_query(sqlite3 *db, int64_t after_id, uint32_t *loaded) {
+    const char *sig_query_sql = "SELECT id, signature, kind FROM Signatures WHERE id > ?;";
+    sqlite3_stmt *stmt;
+    struct sig_set set = { 0 };
+    int64_t max_id = after_id;
+
+    *loaded = 0;
+    if (sqlite3_prepare_v2(db, sig_query_sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
+        return NULL;
+    }
+    sqlite3_bind_int64(stmt, 1, after_id);
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int64_t id = sqlite3_column_int64(stmt, 0);
+        if (id > max_id) max_id = id;
+        const unsigned char *signature = sqlite3_column_blob(stmt, 1);
+        int sig_size = sqlite3_column_bytes(stmt, 1);
+        if (sig_size <= 0) continue;
+
+        if (sqlite3_column_int(stmt, 2) == MASK_KIND_MASKED) {
+            if (sig_set_add_masked(&set, id, (const char *)signature, sig_size) == 0) (*loaded)++;
+            continue;
+        }
+        if (sig_set_add_literal(&set, id, signature, sig_size, AC_NONE, 0) != 0) {
+            perror("Ошибка выделения памяти");
+            sqlite3_finalize(stmt);
+            sig_set_free(&set);
+            return NULL;
+        }
+        (*loaded)++;
+    }
+    sqlite3_finalize(stmt);
+
+    struct matcher *m = matcher_from_set(&set);
+    if (m) m->max_id = max_id;
+    return m;
+}
+
+// Загрузка сигнатур из таблицы Signatures и сборка автомата
+struct matcher *matcher_load(sqlite3 *db) {
+    uint32_t loaded;
+    struct matcher *m = matcher_query(db, 0, &loaded);
+    if (!m) return NULL;
+
+    printf("Загружено сигнатур: %u, из них маскированных: %u (состояний автомата: %u)\n",
+           loaded, m->n_masked, m->n_states);
+    return m;
+}
+
+// ----- Кэш скомпилированного автомата -----
+// Файл рядом с antivir.db: заголовок и таблицы автомата, выровненные на 8 байт.
+// Таблицы используются прямо из отображённой памяти, без копирования и пересборки.
+#define SIG_CACHE_MAGIC   "AVSIGAC"
+#define SIG_CACHE_VERSION 3
+
+int sig_cache_enabled = 1;  // сохранять и использовать файл кэша
+
+struct sig_cache_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int64_t  generation;
+    int64_t  removed;
+    int64_t  max_id;
+    uint32_t n_states;
+    uint32_t n_edges;
+    uint32_t n_dense;
+    uint32_t n_patterns;
+    uint32_t max_len;
+    uint32_t n_masked;
+    uint32_t n_frags;
+    uint32_t n_elems;
+    uint64_t n_bytes;
+    uint64_t off_states;
+    uint64_t off_edge_bytes;
+    uint64_t off_edge_next;
+    uint64_t off_dense;
+    uint64_t off_patterns;
+    uint64_t off_bytes;
+    uint64_t off_masked;
+    uint64_t off_frags;
+    uint64_t off_elems;
+    uint64_t file_size;
+};
+
+static uint64_t align8(uint64_t x) {
+    return (x + 7) & ~(uint64_t)7;
+}
+
+// Раскладка секций кэша для автомата m
+static void sig_cache_layout(const struct matcher *m, struct sig_cache_header *h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SIG_CACHE_MAGIC, sizeof(SIG_CACHE_MAGIC));
+    h->version = SIG_CACHE_VERSION;
+    h->header_size = sizeof(*h);
+    h->generation = m->generation;
+    h->removed = m->removed;
+    h->max_id = m->max_id;
+    h->n_states = m->n_states;
+    h->n_edges = m->n_edges;
+    h->n_dense = m->n_dense;
+    h->n_patterns = m->n_patterns;
+    h->max_len = m->max_len;
+    h->n_masked = m->n_masked;
+    h->n_frags = m->n_frags;
+    h->n_elems = m->n_elems;
+    h->n_bytes = m->n_bytes;
+
+    h->off_states     = align8(sizeof(*h));
+    h->off_edge_bytes = align8(h->off_states + (uint64_t)m->n_states * sizeof(struct ac_state));
+    h->off_edge_next  = align8(h->off_edge_bytes + m->n_edges);
+    h->off_dense      = align8(h->off_edge_next + (uint64_t)m->n_edges * sizeof(uint32_t));
+    h->off_patterns   = align8(h->off_dense + (uint64_t)m->n_dense * 256 * sizeof(uint32_t));
+    h->off_bytes      = align8(h->off_patterns + (uint64_t)m->n_patterns * sizeof(struct ac_pattern));
+    h->off_masked     = align8(h->off_bytes + m->n_bytes);
+    h->off_frags      = align8(h->off_masked + (uint64_t)m->n_masked * sizeof(struct masked_sig));
+    h->off_elems      = align8(h->off_frags + (uint64_t)m->n_frags * sizeof(struct mask_frag));
+    h->file_size      = h->off_elems + (uint64_t)m->n_elems * sizeof(struct mask_elem);
+}
+
+// Сохранение автомата в файл кэша (через временный файл и rename)
+int matcher_save(const struct matcher *m, const char *path) {
+    struct sig_cache_header h;
+    char tmp_path[1024];
+
+    sig_cache_layout(m, &h);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Ошибка создания кэша сигнатур");
+        return -1;
+    }
+
+    if (ftruncate(fd, h.file_size) != 0 ||
+        write_at(fd, &h, sizeof(h), 0) != 0 ||
+        write_at(fd, m->states, (uint64_t)m->n_states * sizeof(struct ac_state), h.off_states) != 0 ||
+        write_at(fd, m->edge_bytes, m->n_edges, h.off_edge_bytes) != 0 ||
+        write_at(fd, m->edge_next, (uint64_t)m->n_edges * sizeof(uint32_t), h.off_edge_next) != 0 ||
+        write_at(fd, m->dense, (uint64_t)m->n_dense * 256 * sizeof(uint32_t), h.off_dense) != 0 ||
+        write_at(fd, m->patterns, (uint64_t)m->n_patterns * sizeof(struct ac_pattern), h.off_patterns) != 0 ||
+        write_at(fd, m->bytes, m->n_bytes, h.off_bytes) != 0 ||
+        write_at(fd, m->masked, (uint64_t)m->n_masked * sizeof(struct masked_sig), h.off_masked) != 0 ||
+        write_at(fd, m->frags, (uint64_t)m->n_frags * sizeof(struct mask_frag), h.off_frags) != 0 ||
+        write_at(fd, m->elems, (uint64_t)m->n_elems * sizeof(struct mask_elem), h.off_elems) != 0 ||
+        fsync(fd) != 0) {
+        perror("Ошибка записи кэша сигнатур");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path) != 0) {
+        perror("Ошибка сохранения кэша сигнатур");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Отображение файла кэша в память. NULL, если кэша нет, он повреждён или устарел.
+struct matcher *matcher_map(const char *path, int64_t generation) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(struct sig_cache_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    // Заголовок должен совпадать с раскладкой, которую дал бы сам автомат
+    const struct sig_cache_header *h = map;
+    struct matcher probe = {
+        .n_states = h->n_states, .n_edges = h->n_edges, .n_dense = h->n_dense,
+        .n_patterns = h->n_patterns, .max_len = h->max_len, .n_bytes = h->n_bytes,
+        .n_masked = h->n_masked, .n_frags = h->n_frags, .n_elems = h->n_elems,
+        .generation = h->generation, .removed = h->removed, .max_id = h->max_id,
+    };
+    struct sig_cache_header expect;
+    sig_cache_layout(&probe, &expect);
+
+    if (h->version != SIG_CACHE_VERSION || h->generation != generation || h->n_states == 0 ||
+        memcmp(h, &expect, sizeof(expect)) != 0 || expect.file_size != (uint64_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    struct matcher *m = malloc(sizeof(*m));
+    if (!m) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *m = probe;
+    m->states     = (struct ac_state *)((char *)map + h->off_states);
+    m->edge_bytes = (unsigned char *)map + h->off_edge_bytes;
+    m->edge_next  = (uint32_t *)((char *)map + h->off_edge_next);
+    m->dense      = (uint32_t *)((char *)map + h->off_dense);
+    m->patterns   = (struct ac_pattern *)((char *)map + h->off_patterns);
+    m->bytes      = (unsigned char *)map + h->off_bytes;
+    m->masked     = (struct masked_sig *)((char *)map + h->off_masked);
+    m->frags      = (struct mask_frag *)((char *)map + h->off_frags);
+    m->elems      = (struct mask_elem *)((char *)map + h->off_elems);
+    m->map = map;
+    m->map_len = st.st_size;
+    return m;
+}
+
+// Автомат для текущего набора сигнатур: уже загруженный, из кэша или собранный заново
+struct matcher *matcher_open(sqlite3 *db, struct matcher *current) {
+    int64_t generation = get_sig_generation(), removed = get_sig_removed_generation();
+
+    if (current && current->generation == generation) return current;
+    matcher_free(current);
+
+    if (sig_cache_enabled) {
+        struct matcher *m = matcher_map(SIG_CACHE_PATH, generation);
+        if (m) {
+            printf("Сигнатуры загружены из кэша: %u (поколение %lld)\n", matcher_signature_count(m),
+                   (long long)generation);
+            return m;
+        }
+    }
+
+    struct matcher *m = matcher_load(db);
+    if (!m) return NULL;
+    m->generation = generation;
+    m->removed = removed;
+
+    if (sig_cache_enabled && matcher_save(m, SIG_CACHE_PATH) == 0) {
+        printf("Кэш сигнатур сохранён: %s\n", SIG_CACHE_PATH);
+    }
+    return m;
+}
+
+// ====================================== Векторный предфильтр ======================================
+// Для каждой сигнатуры выбирается якорь - пара соседних байт, которая редко встречается в
+// обычных данных. Векторное ядро за одну итерацию проверяет 16/32/64 позиций: первый байт
+// должен входить в множество первых байт якорей, второй - в множество вторых. Кандидаты
+// проверяются по битовой карте всех пар и только затем сравниваются с сигнатурами целиком.
+// Ядро выбирается по cpuid при запуске; если якоря не укладываются в ограничения
+// (короткие сигнатуры, слишком много разных байт), поиск идёт одним автоматом.
+#define PF_MAX_BYTES 8      // размер множеств первых и вторых байт якорей
+
+struct pf_anchor {
+    uint16_t pair;          // (первый байт << 8) | второй
+    uint32_t offset;        // смещение якоря в сигнатуре
+    uint32_t pattern;       // номер сигнатуры в автомате
+};
+
+struct prefilter {
+    unsigned char first[PF_MAX_BYTES];
+    unsigned char second[PF_MAX_BYTES];
+    int n_first;
+    int n_second;
+    uint64_t pair_bits[65536 / 64];
+    struct pf_anchor *anchors;  // отсортированы по pair
+    uint32_t n_anchors;
+};
+
+enum pf_isa { PF_ISA_SCALAR, PF_ISA_SSE2, PF_ISA_AVX2, PF_ISA_AVX512, PF_ISA_COUNT };
+static const char *pf_isa_names[PF_ISA_COUNT] = { "scalar", "sse2", "avx2", "avx512" };
+
+int prefilter_enabled = 1;          // искать через предфильтр, если он построен
+enum pf_isa pf_isa = PF_ISA_SCALAR; // выбранное ядро
+
+void prefilter_free(struct prefilter *pf) {
+    if (!pf) return;
+    free(pf->anchors);
+    free(pf);
+}
+
+// Грубая оценка частоты байта в файлах: нули, 0xff, пробелы и строчные буквы встречаются чаще всего
+static int byte_weight(unsigned char b) {
+    if (b == 0x00) return 100;
+    if (b == 0xff) return 40;
+    if (b == ' ' || b == 'e' || b == 't' || b == 'a' || b == 'o' || b == '\n') return 30;
+    if (b >= 'a' && b <= 'z') return 20;
+    if ((b >= 'A' && b <= 'Z') || (b >= '0' && b <= '9')) return 10;
+    if (b >= 0x20 && b < 0x7f) return 8;
+    return 3;
+}
+
+static int byte_set_index(const unsigned char *set, int n, unsigned char b) {
+    for (int i = 0; i < n; i++) {
+        if (set[i] == b) return i;
+    }
+    return -1;
+}
+
+static int pf_anchor_cmp(const void *a, const void *b) {
+    const struct pf_anchor *x = a, *y = b;
+    return x->pair != y->pair ? (x->pair < y->pair ? -1 : 1) : (x->pattern < y->pattern ? -1 : x->pattern > y->pattern);
+}
+
+// Выбор якорей. NULL, если предфильтр неприменим к набору сигнатур.
+struct prefilter *prefilter_build(const struct matcher *m) {
+    if (m->n_patterns == 0) return NULL;
+
+    struct prefilter *pf = calloc(1, sizeof(*pf));
+    if (!pf) return NULL;
+    pf->anchors = malloc(m->n_patterns * sizeof(struct pf_anchor));
+    if (!pf->anchors) {
+        prefilter_free(pf);
+        return NULL;
+    }
+
+    for (uint32_t p = 0; p < m->n_patterns; p++) {
+        const struct ac_pattern *pat = &m->patterns[p];
+        const unsigned char *sig = m->bytes + pat->offset;
+        if (pat->length < 2) {
+            prefilter_free(pf);
+            return NULL;
+        }
+
+        // Самая редкая пара; байты, уже попавшие в множества, обходятся дешевле новых
+        uint32_t best = 0;
+        long best_score = -1;
+        for (uint32_t i = 0; i + 1 < pat->length; i++) {
+            long score = (long)byte_weight(sig[i]) * byte_weight(sig[i + 1]);
+            if (byte_set_index(pf->first, pf->n_first, sig[i]) < 0) score += 50;
+            if (byte_set_index(pf->second, pf->n_second, sig[i + 1]) < 0) score += 50;
+            if (best_score < 0 || score < best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+
+        unsigned char b0 = sig[best], b1 = sig[best + 1];
+        if (byte_set_index(pf->first, pf->n_first, b0) < 0) {
+            if (pf->n_first == PF_MAX_BYTES) goto unsuitable;
+            pf->first[pf->n_first++] = b0;
+        }
+        if (byte_set_index(pf->second, pf->n_second, b1) < 0) {
+            if (pf->n_second == PF_MAX_BYTES) goto unsuitable;
+            pf->second[pf->n_second++] = b1;
+        }
+
+        uint16_t pair = (uint16_t)(b0 << 8 | b1);
+        pf->pair_bits[pair >> 6] |= 1ull << (pair & 63);
+        pf->anchors[pf->n_anchors++] = (struct pf_anchor){ pair, best, p };
+    }
+
+    qsort(pf->anchors, pf->n_anchors, sizeof(struct pf_anchor), pf_anchor_cmp);
+    return pf;
+
+unsuitable:
+    prefilter_free(pf);
+    return NULL;
+}
+
+// Точная проверка кандидата: в позиции pos буфера стоит пара из битовой карты
+static inline int pf_verify(const struct matcher *m, const unsigned char *buf, size_t len, size_t pos,
+                            uint64_t base, hit_fn fn, void *ctx) {
+    const struct prefilter *pf = m->pf;
+    uint16_t pair = (uint16_t)(buf[pos] << 8 | buf[pos + 1]);
+    if (!(pf->pair_bits[pair >> 6] & (1ull << (pair & 63)))) return 0;
+
+    // Первый якорь с этой парой
+    uint32_t lo = 0, hi = pf->n_anchors;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (pf->anchors[mid].pair < pair) lo = mid + 1;
+        else hi = mid;
+    }
+
+    for (; lo < pf->n_anchors && pf->anchors[lo].pair == pair; lo++) {
+        const struct pf_anchor *a = &pf->anchors[lo];
+        const struct ac_pattern *p = &m->patterns[a->pattern];
+        if (pos < a->offset || pos - a->offset + p->length > len) continue;
+
+        size_t start = pos - a->offset;
+        if (memcmp(buf + start, m->bytes + p->offset, p->length) == 0 &&
+            report_literal(m, p, buf, len, start, base, fn, ctx)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int pf_scan_scalar(const struct matcher *m, const unsigned char *buf, size_t len,
+                          uint64_t base, hit_fn fn, void *ctx) {
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (pf_verify(m, buf, len, i, base, fn, ctx)) return 1;
+    }
+    return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int pf_scan_sse2(const struct matcher *m, const unsigned char *buf, size_t len,
+                        uint64_t base, hit_fn fn, void *ctx) {
+    const struct prefilter *pf = m->pf;
+    __m128i first[PF_MAX_BYTES], second[PF_MAX_BYTES];
+    for (int k = 0; k < pf->n_first; k++) first[k] = _mm_set1_epi8((char)pf->first[k]);
+    for (int k = 0; k < pf->n_second; k++) second[k] = _mm_set1_epi8((char)pf->second[k]);
+
+    size_t i = 0;
+    for (; i + 17 <= len; i += 16) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+        __m128i a = _mm_setzero_si128(), b = _mm_setzero_si128();
+        for (int k = 0; k < pf->n_first; k++) a = _mm_or_si128(a, _mm_cmpeq_epi8(v0, first[k]));
+        for (int k = 0; k < pf->n_second; k++) b = _mm_or_si128(b, _mm_cmpeq_epi8(v1, second[k]));
+
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+        while (mask) {
+            if (pf_verify(m, buf, len, i + __builtin_ctz(mask), base, fn, ctx)) return 1;
+            mask &= mask - 1;
+        }
+    }
+    for (; i + 1 < len; i++) {
+        if (pf_verify(m, buf, len, i, base, fn, ctx)) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx2")))
+static int pf_scan_avx2(const struct matcher *m, const unsigned char *buf, size_t len,
+                        uint64_t base, hit_fn fn, void *ctx) {
+    const struct prefilter *pf = m->pf;
+    __m256i first[PF_MAX_BYTES], second[PF_MAX_BYTES];
+    for (int k = 0; k < pf->n_first; k++) first[k] = _mm256_set1_epi8((char)pf->first[k]);
+    for (int k = 0; k < pf->n_second; k++) second[k] = _mm256_set1_epi8((char)pf->second[k]);
+
+    size_t i = 0;
+    for (; i + 33 <= len; i += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+        __m256i a = _mm256_setzero_si256(), b = _mm256_setzero_si256();
+        for (int k = 0; k < pf->n_first; k++) a = _mm256_or_si256(a, _mm256_cmpeq_epi8(v0, first[k]));
+        for (int k = 0; k < pf->n_second; k++) b = _mm256_or_si256(b, _mm256_cmpeq_epi8(v1, second[k]));
+
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(a, b));
+        while (mask) {
+            if (pf_verify(m, buf, len, i + __builtin_ctz(mask), base, fn, ctx)) return 1;
+            mask &= mask - 1;
+        }
+    }
+    for (; i + 1 < len; i++) {
+        if (pf_verify(m, buf, len, i, base, fn, ctx)) return 1;
+    }
+    return 0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int pf_scan_avx512(const struct matcher *m, const unsigned char *buf, size_t len,
+                          uint64_t base, hit_fn fn, void *ctx) {
+    const struct prefilter *pf = m->pf;
+    __m512i first[PF_MAX_BYTES], second[PF_MAX_BYTES];
+    for (int k = 0; k < pf->n_first; k++) first[k] = _mm512_set1_epi8((char)pf->first[k]);
+    for (int k = 0; k < pf->n_second; k++) second[k] = _mm512_set1_epi8((char)pf->second[k]);
+
+    size_t i = 0;
+    for (; i + 65 <= len; i += 64) {
+        __m512i v0 = _mm512_loadu_si512((const void *)(buf + i));
+        __m512i v1 = _mm512_loadu_si512((const void *)(buf + i + 1));
+        __mmask64 a = 0, b = 0;
+        for (int k = 0; k < pf->n_first; k++) a |= _mm512_cmpeq_epi8_mask(v0, first[k]);
+        for (int k = 0; k < pf->n_second; k++) b |= _mm512_cmpeq_epi8_mask(v1, second[k]);
+
+        uint64_t mask = a & b;
+        while (mask) {
+            if (pf_verify(m, buf, len, i + __builtin_ctzll(mask), base, fn, ctx)) return 1;
+            mask &= mask - 1;
+        }
+    }
+    for (; i + 1 < len; i++) {
+        if (pf_verify(m, buf, len, i, base, fn, ctx)) return 1;
+    }
+    return 0;
+}
+#endif
+
+typedef int (*pf_kernel)(const struct matcher *m, const unsigned char *buf, size_t len,
+                         uint64_t base, hit_fn fn, void *ctx);
+
+static pf_kernel pf_kernels[PF_ISA_COUNT] = {
+    [PF_ISA_SCALAR] = pf_scan_scalar,
+#if defined(__x86_64__) || defined(__i386__)
+    [PF_ISA_SSE2]   = pf_scan_sse2,
+    [PF_ISA_AVX2]   = pf_scan_avx2,
+    [PF_ISA_AVX512] = pf_scan_avx512,
+#endif
+};
+
+// Поддерживает ли процессор данное ядро
+int pf_isa_supported(enum pf_isa isa) {
+    if (!pf_kernels[isa]) return 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    switch (isa) {
+    case PF_ISA_SSE2:   return __builtin_cpu_supports("sse2");
+    case PF_ISA_AVX2:   return __builtin_cpu_supports("avx2");
+    case PF_ISA_AVX512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    default:            return 1;
+    }
+#else
+    return isa == PF_ISA_SCALAR;
+#endif
+}
+
+// Самое широкое из доступных ядер
+enum pf_isa pf_detect_isa() {
+    for (int isa = PF_ISA_COUNT - 1; isa > PF_ISA_SCALAR; isa--) {
+        if (pf_isa_supported(isa)) return isa;
+    }
+    return PF_ISA_SCALAR;
+}
+
+// ====================================== Поиск по хэшу окна ======================================
+// Для наборов в сотни тысяч сигнатур автомат перестаёт помещаться в кэш: почти каждый байт
+// файла - промах по памяти. Здесь у каждой строки автомата выбирается окно фиксированной
+// длины, хэш окна (Рабин-Карп) заносится в фильтр Блума из 64-битных слов: все биты ключа
+// лежат в одном слове, проверка - одна загрузка и сравнение. По данным катится хэш окна
+// той же длины; только позиции, пропущенные фильтром, ищутся в таблице хэшей и сравниваются
+// со строкой целиком. Строки короче основного окна попадают на уровни с окнами 4 и 2 байта.
+// Окно внутри строки выбирается самое редкое по byte_weight.
+#define RK_LEVELS     3
+#define RK_BASE       0x100000001B3ull  // основание многочлена
+#define RK_BLOOM_BITS 16                // бит фильтра на строку
+#define RK_AUTO_MIN   1000              // с какого числа строк поиск по хэшу включается сам (bench engines)
+
+static const uint32_t rk_windows[RK_LEVELS] = { 8, 4, 2 };
+
+struct rk_entry {
+    uint64_t hash;          // хэш окна
+    uint32_t pattern;       // номер строки в автомате
+    uint32_t offset;        // смещение окна в строке
+};
+
+struct rk_level {
+    uint32_t window;
+    uint32_t n_entries;
+    uint64_t *bloom;        // слова фильтра
+    uint64_t bloom_mask;    // число слов - 1
+    uint32_t *buckets;      // начало корзины в entries, n_buckets + 1 элементов
+    uint32_t bucket_shift;
+    struct rk_entry *entries;   // отсортированы по корзинам
+    uint64_t out[256];      // вклад байта, уходящего из окна: b * RK_BASE^window
+};
+
+struct rk_index {
+    struct rk_level levels[RK_LEVELS];
+    size_t bloom_bytes;
+};
+
+enum scan_engine { ENGINE_AUTO, ENGINE_AC, ENGINE_HASH };
+enum scan_engine scan_engine = ENGINE_AUTO;
+
+void rk_free(struct rk_index *rk) {
+    if (!rk) return;
+    for (int lv = 0; lv < RK_LEVELS; lv++) {
+        free(rk->levels[lv].bloom);
+        free(rk->levels[lv].buckets);
+        free(rk->levels[lv].entries);
+    }
+    free(rk);
+}
+
+static inline uint64_t rk_mix(uint64_t h) {
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ull;
+    return h ^ (h >> 32);
+}
+
+static inline uint32_t rk_bucket(const struct rk_level *l, uint64_t h) {
+    return (h * 0x9E3779B97F4A7C15ull) >> l->bucket_shift;
+}
+
+// Слово выбирается младшими битами перемешанного хэша, четыре бита в слове - старшими
+static inline uint64_t rk_bloom_bits(uint64_t x) {
+    return (1ull << ((x >> 40) & 63)) | (1ull << ((x >> 46) & 63)) |
+           (1ull << ((x >> 52) & 63)) | (1ull << (x >> 58));
+}
+
+static uint64_t rk_hash(const unsigned char *p, uint32_t w) {
+    uint64_t h = 0;
+    for (uint32_t i = 0; i < w; i++) h = h * RK_BASE + p[i];
+    return h;
+}
+
+// Уровень для строки длины len: самое длинное окно, которое в неё помещается
+static int rk_level_of(uint32_t len) {
+    for (int lv = 0; lv < RK_LEVELS; lv++) {
+        if (len >= rk_windows[lv]) return lv;
+    }
+    return -1;
+}
+
+// Таблица хэшей и фильтр одного уровня по уже заполненным entries
+static int rk_level_build(struct rk_level *l) {
+    uint32_t n_buckets = 2, bits = 1;
+    while (n_buckets < l->n_entries) {
+        n_buckets *= 2;
+        bits++;
+    }
+    l->bucket_shift = 64 - bits;
+
+    uint64_t words = 1;
+    while (words * 64 < (uint64_t)l->n_entries * RK_BLOOM_BITS) words *= 2;
+    l->bloom_mask = words - 1;
+    l->bloom = calloc(words, sizeof(uint64_t));
+    l->buckets = calloc(n_buckets + 1, sizeof(uint32_t));
+    struct rk_entry *sorted = malloc(l->n_entries * sizeof(*sorted));
+    if (!l->bloom || !l->buckets || !sorted) {
+        free(sorted);
+        return -1;
+    }
+
+    // Сортировка подсчётом по корзинам
+    for (uint32_t e = 0; e < l->n_entries; e++) l->buckets[rk_bucket(l, l->entries[e].hash) + 1]++;
+    for (uint32_t b = 0; b < n_buckets; b++) l->buckets[b + 1] += l->buckets[b];
+    uint32_t *fill = malloc(n_buckets * sizeof(*fill));
+    if (!fill) {
+        free(sorted);
+        return -1;
+    }
+    memcpy(fill, l->buckets, n_buckets * sizeof(*fill));
+    for (uint32_t e = 0; e < l->n_entries; e++) {
+        sorted[fill[rk_bucket(l, l->entries[e].hash)]++] = l->entries[e];
+        uint64_t x = rk_mix(l->entries[e].hash);
+        l->bloom[x & l->bloom_mask] |= rk_bloom_bits(x);
+    }
+    free(fill);
+    free(l->entries);
+    l->entries = sorted;
+
+    uint64_t pow = 1;
+    for (uint32_t i = 0; i < l->window; i++) pow *= RK_BASE;
+    for (int b = 0; b < 256; b++) l->out[b] = b * pow;
+    return 0;
+}
+
+// Окна и фильтры для всех строк автомата. NULL, если есть строки короче двух байт.
+struct rk_index *rk_build(const struct matcher *m) {
+    if (m->n_patterns == 0) return NULL;
+    struct rk_index *rk = calloc(1, sizeof(*rk));
+    if (!rk) return NULL;
+
+    uint32_t counts[RK_LEVELS] = { 0 };
+    for (uint32_t i = 0; i < m->n_patterns; i++) {
+        int lv = rk_level_of(m->patterns[i].length);
+        if (lv < 0) {
+            free(rk);
+            return NULL;
+        }
+        counts[lv]++;
+    }
+    for (int lv = 0; lv < RK_LEVELS; lv++) {
+        rk->levels[lv].window = rk_windows[lv];
+        if (!counts[lv]) continue;
+        rk->levels[lv].entries = malloc(counts[lv] * sizeof(struct rk_entry));
+        if (!rk->levels[lv].entries) goto fail;
+    }
+
+    for (uint32_t i = 0; i < m->n_patterns; i++) {
+        const struct ac_pattern *p = &m->patterns[i];
+        const unsigned char *sig = m->bytes + p->offset;
+        struct rk_level *l = &rk->levels[rk_level_of(p->length)];
+
+        // Самое редкое окно: наименьшая сумма весов байт, сумма скользит вместе с окном
+        int weight = 0, best = 0;
+        uint32_t best_at = 0;
+        for (uint32_t j = 0; j < p->length; j++) {
+            weight += byte_weight(sig[j]);
+            if (j >= l->window) weight -= byte_weight(sig[j - l->window]);
+            if (j + 1 < l->window) continue;
+            if (j + 1 == l->window || weight < best) {
+                best = weight;
+                best_at = j + 1 - l->window;
+            }
+        }
+        l->entries[l->n_entries++] = (struct rk_entry){ rk_hash(sig + best_at, l->window), i, best_at };
+    }
+
+    for (int lv = 0; lv < RK_LEVELS; lv++) {
+        struct rk_level *l = &rk->levels[lv];
+        if (!l->n_entries) continue;
+        if (rk_level_build(l) != 0) goto fail;
+        rk->bloom_bytes += (l->bloom_mask + 1) * 8;
+    }
+    return rk;
+
+fail:
+    rk_free(rk);
+    return NULL;
+}
+
+// Фильтр пропустил окно, начинающееся в ws: сверяем строки с тем же хэшем
+static __attribute__((noinline)) int rk_verify(const struct matcher *m, const struct rk_level *l, uint64_t h,
+                     const unsigned char *buf, size_t len, size_t ws, uint64_t base, hit_fn fn, void *ctx) {
+    uint32_t b = rk_bucket(l, h);
+    for (uint32_t e = l->buckets[b]; e < l->buckets[b + 1]; e++) {
+        const struct rk_entry *en = &l->entries[e];
+        if (en->hash != h || ws < en->offset) continue;
+
+        const struct ac_pattern *p = &m->patterns[en->pattern];
+        size_t start = ws - en->offset;
+        if (start + p->length <= len && memcmp(buf + start, m->bytes + p->offset, p->length) == 0 &&
+            report_literal(m, p, buf, len, start, base, fn, ctx)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Проход по буферу для одного уровня. Уходящий байт вычитается вне цепочки зависимостей
+// умножения, поэтому на байт приходится одно умножение и одно сложение в цепочке.
+static int rk_scan_level(const struct matcher *m, const struct rk_level *l, const unsigned char *buf,
+                         size_t len, uint64_t base, hit_fn fn, void *ctx) {
+    uint32_t w = l->window;
+    if (len < w) return 0;
+
+    const uint64_t *bloom = l->bloom, *out = l->out;
+    uint64_t mask = l->bloom_mask;
+    uint64_t h = rk_hash(buf, w);
+    for (size_t i = w;; i++) {
+        uint64_t x = rk_mix(h), bits = rk_bloom_bits(x);
+        if ((bloom[x & mask] & bits) == bits && rk_verify(m, l, h, buf, len, i - w, base, fn, ctx)) return 1;
+        if (i == len) return 0;
+        h = h * RK_BASE + (buf[i] - out[buf[i - w]]);
+    }
+}
+
+int rk_scan(const struct matcher *m, const unsigned char *buf, size_t len,
+            uint64_t base, hit_fn fn, void *ctx) {
+    for (int lv = 0; lv < RK_LEVELS; lv++) {
+        const struct rk_level *l = &m->rk->levels[lv];
+        if (l->n_entries && rk_scan_level(m, l, buf, len, base, fn, ctx)) return 1;
+    }
+    return 0;
+}
+
+// ----- Выбор движка -----
+// Поиск в буфере: хэш окна, предфильтр с точной проверкой либо автомат
+int matcher_scan(const struct matcher *m, const unsigned char *buf, size_t len,
+                 uint64_t base, hit_fn fn, void *ctx) {
+    if (m->rk) {
+        if (rk_scan(m, buf, len, base, fn, ctx)) return 1;
+    } else if (m->pf && prefilter_enabled) {
+        if (pf_kernels[pf_isa](m, buf, len, base, fn, ctx)) return 1;
+    } else {
+        uint32_t state = 0;
+        if (ac_scan(m, &state, buf, len, base, fn, ctx)) return 1;
+    }
+    if (m->sa && shift_and_scan(m, buf, len, base, fn, ctx)) return 1;
+    return m->delta ? matcher_scan(m->delta, buf, len, base, fn, ctx) : 0;
+}
+
+// Поиск по хэшу: явно выбран либо набор велик, а предфильтр неприменим
+static void rk_select(struct matcher *m) {
+    int want = scan_engine == ENGINE_HASH ||
+               (scan_engine == ENGINE_AUTO && !m->pf && m->n_patterns >= RK_AUTO_MIN);
+    if (!want) {
+        rk_free(m->rk);
+        m->rk = NULL;
+        return;
+    }
+    if (m->rk) return;
+
+    m->rk = rk_build(m);
+    if (m->rk) {
+        printf("Поиск по хэшу окна: строк %u, фильтр %zu КБ\n", m->n_patterns, (m->rk->bloom_bytes + 1023) >> 10);
+    } else if (scan_engine == ENGINE_HASH) {
+        printf("Поиск по хэшу окна неприменим к набору сигнатур, ищем автоматом\n");
+    }
+}
+
+// ----- Добавочный автомат -----
+// Сигнатуры, добавленные после сборки автомата (import, sync), собираются в небольшой
+// добавочный автомат m->delta, который просматривает те же буферы следом за основным.
+// Основной автомат, его предфильтр, хэш окна и кэш на диске остаются как есть; при каждом
+// изменении пересобирается только добавочный - из всех сигнатур с id больше основного.
+// Если сигнатуры удалялись или менялись либо добавочный вырос больше DELTA_SHARE-й доли
+// основного, набор собирается целиком. Кэш на диске по-прежнему соответствует основному
+// автомату, поэтому следующий запуск соберёт (и сохранит) весь набор.
+#define DELTA_MIN   1024    // столько добавленных сигнатур допустимо при любом основном наборе
+#define DELTA_SHARE 8
+
+// Дописать в m сигнатуры, добавленные после его сборки. 0 - автомат соответствует таблице,
+// -1 - нужна полная сборка.
+static int matcher_extend(sqlite3 *db, struct matcher *m) {
+    int64_t generation = get_sig_generation();
+    if (m->generation == generation) return 0;
+    if (m->removed != get_sig_removed_generation()) return -1;
+
+    sqlite3_stmt *stmt;
+    int64_t added = -1;
+    if (sqlite3_prepare_v2(db, "SELECT count(*) FROM Signatures WHERE id > ?;", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, m->max_id);
+        if (sqlite3_step(stmt) == SQLITE_ROW) added = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (added < 0 || added > DELTA_MIN + m->n_patterns / DELTA_SHARE) return -1;
+
+    struct matcher *delta = NULL;
+    uint32_t loaded = 0;
+    if (added > 0) {
+        delta = matcher_query(db, m->max_id, &loaded);
+        if (!delta) return -1;
+        delta->sa = shift_and_build(delta);
+        delta->pf = prefilter_build(delta);
+        if (delta->max_len > m->max_len) m->max_len = delta->max_len;
+    }
+    matcher_free(m->delta);
+    m->delta = delta;
+    m->generation = generation;
+    printf("Сигнатур добавлено без пересборки автомата: %u (всего %u)\n", loaded, matcher_signature_count(m));
+    return 0;
+}
+
+// Автомат вместе с предфильтром для текущего набора сигнатур
+struct matcher *matcher_prepare(sqlite3 *db, struct matcher *current) {
+    struct matcher *m = current && matcher_extend(db, current) == 0 ? current : matcher_open(db, current);
+    if (!m) return m;
+
+    if (m != current) {
+        static int isa_detected = 0;
+        if (!isa_detected) {
+            pf_isa = pf_detect_isa();
+            isa_detected = 1;
+        }
+
+        m->sa = shift_and_build(m);
+        m->pf = prefilter_build(m);
+        if (m->pf) printf("Предфильтр: %s, якорей %u\n", pf_isa_names[pf_isa], m->pf->n_anchors);
+    }
+    rk_select(m);
+    return m;
+}
+
+// ====================================== Обновление сигнатур ======================================
+// Файл обновлений - текст, по изменению на строку:
+//   # комментарий
+//   add <hex> или просто <hex>  - точная сигнатура, байты в hex (пробелы между байтами допустимы)
+//   mask <маска>                - маскированная сигнатура (см. parse_masked)
+//   del <hex> | del-mask <маска> - удаление
+// import <файл> загружает файл одной транзакцией. Повторы в файле и в таблице пропускает
+// уникальный индекс Signatures.signature; ошибка в любой строке отменяет файл целиком.
+// sync <источник> забирает только изменения после последнего применённого номера (Meta.feed_seq).
+// Источник публикует каждое изменение набора отдельным файлом <номер>.feed, и клиент
+// запрашивает <источник>/<feed_seq + 1>.feed, пока такой есть. Источник - каталог, куда
+// подкладываются файлы, или http://узел[:порт]/путь (HTTP/1.0, без TLS). Каждый файл
+// применяется своей транзакцией вместе с новым feed_seq: прерванная синхронизация
+// продолжится со следующего номера. Новые сигнатуры попадают в добавочный автомат.
+#define FEED_DIR        "../Updates"    // источник sync по умолчанию
+#define FEED_TIMEOUT_MS 30000           // ожидание ответа сервера обновлений
+
+struct feed_stats {
+    uint64_t lines;
+    uint64_t added, duplicates;     // новые и уже известные сигнатуры
+    uint64_t removed, missing;      // удалённые и не найденные для удаления
+    uint64_t bytes;                 // прочитано байт файла
+};
+
+// Байты сигнатуры из hex-записи (пробелы между байтами допустимы). Длина или -1.
+static ssize_t feed_hex(const char *text, unsigned char *out) {
+    ssize_t n = 0;
+    for (const char *p = text; *p; ) {
+        if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        int hi = hex_nibble(p[0]), lo = hi < 0 ? -1 : hex_nibble(p[1]);
+        if (lo < 0) return -1;
+        out[n++] = hi << 4 | lo;
+        p += 2;
+    }
+    return n > 0 ? n : -1;
+}
+
+// Добавление (remove = 0) или удаление сигнатуры внутри транзакции импорта
+static int feed_change(const void *data, size_t len, int kind, int remove, struct feed_stats *st) {
+    sqlite3_stmt *stmt = db_stmt(remove ? STMT_DELETE_SIGNATURE : STMT_IMPORT_SIGNATURE);
+    if (!stmt) return -1;
+
+    sqlite3_bind_blob(stmt, 1, data, len, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, kind);
+    db_write();
+    int rc = sqlite3_step(stmt);
+    db_stmt_release(stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Ошибка изменения сигнатуры: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    int changed = sqlite3_changes(db) > 0;
+    if (remove) {
+        if (changed) st->removed++;
+        else st->missing++;
+    } else {
+        if (changed) st->added++;
+        else st->duplicates++;
+    }
+    return 0;
+}
+
+// Применение файла обновлений построчно (вызывающий держит транзакцию). -1 - ошибка.
+int feed_apply(FILE *in, const char *name, struct feed_stats *st) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    int rc = 0;
+
+    while (rc == 0 && (n = getline(&line, &cap, in)) > 0) {
+        st->bytes += n;
+        st->lines++;
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r' || line[n - 1] == ' ')) line[--n] = '\0';
+        char *text = line + strspn(line, " \t");
+        if (*text == '\0' || *text == '#') continue;
+
+        // Ключевое слово и запись через пробел; строка без ключевого слова - добавление hex
+        size_t word = strcspn(text, " \t");
+        const char *arg = text[word] ? text + word + strspn(text + word, " \t") : text + word;
+        int remove = (word == 3 && strncmp(text, "del", 3) == 0) || (word == 8 && strncmp(text, "del-mask", 8) == 0);
+        int masked = (word == 4 && strncmp(text, "mask", 4) == 0) || (remove && word == 8);
+        if (!remove && !masked && !(word == 3 && strncmp(text, "add", 3) == 0)) arg = text;
+
+        if (masked) {
+            // Маска хранится текстом, как в insert_masked_signature
+            struct mask_elem *elems = NULL;
+            struct mask_frag *frags = NULL;
+            uint32_t n_elems = 0, n_frags = 0;
+            long frags_n = parse_masked(arg, strlen(arg), &elems, &n_elems, &frags, &n_frags);
+            free(elems);
+            free(frags);
+            if (frags_n < 0 && !remove) {
+                fprintf(stderr, "%s:%llu: ошибка разбора маски: %s\n", name, (unsigned long long)st->lines, arg);
+                rc = -1;
+                break;
+            }
+            rc = feed_change(arg, strlen(arg), MASK_KIND_MASKED, remove, st);
+            continue;
+        }
+
+        unsigned char *sig = malloc(strlen(arg) / 2 + 1);
+        ssize_t len = sig ? feed_hex(arg, sig) : -1;
+        if (len < 0) {
+            fprintf(stderr, "%s:%llu: ошибка разбора сигнатуры: %s\n", name, (unsigned long long)st->lines, arg);
+            rc = -1;
+        } else {
+            rc = feed_change(sig, len, MASK_KIND_EXACT, remove, st);
+        }
+        free(sig);
+    }
+    if (rc == 0 && ferror(in)) {
+        perror(name);
+        rc = -1;
+    }
+    free(line);
+    return rc;
+}
+
+// Файл обновлений целиком в одной транзакции. seq >= 0 записывается в Meta.feed_seq той же
+// транзакцией. expect_bytes >= 0 - ожидаемая длина (Content-Length): недокачанный файл
+// не применяется.
+static int feed_commit(FILE *in, const char *name, int64_t seq, int64_t expect_bytes, struct feed_stats *st) {
+    struct feed_stats local = { 0 };
+    db_batch_hold();
+    int rc = feed_apply(in, name, &local);
+    if (rc == 0 && expect_bytes >= 0 && local.bytes != (uint64_t)expect_bytes) {
+        fprintf(stderr, "%s: получено %llu байт из %lld\n", name, (unsigned long long)local.bytes,
+                (long long)expect_bytes);
+        rc = -1;
+    }
+    if (rc == 0 && seq >= 0) set_meta("feed_seq", seq);
+    if (rc != 0) db_batch_rollback();
+    db_batch_release();
+    if (rc != 0) return -1;
+
+    st->lines += local.lines;
+    st->added += local.added;
+    st->duplicates += local.duplicates;
+    st->removed += local.removed;
+    st->missing += local.missing;
+    st->bytes += local.bytes;
+    return 0;
+}
+
+static void feed_print(const struct feed_stats *st) {
+    printf("Сигнатур добавлено: %llu, уже были: %llu, удалено: %llu, не найдено для удаления: %llu\n",
+           (unsigned long long)st->added, (unsigned long long)st->duplicates, (unsigned long long)st->removed,
+           (unsigned long long)st->missing);
+}
+
+// Команда import: загрузка файла обновлений
+int import_signatures(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return -1;
+    }
+
+    struct feed_stats st = { 0 };
+    int rc = feed_commit(in, path, -1, -1, &st);
+    fclose(in);
+    if (rc != 0) {
+        fprintf(stderr, "Файл %s не загружен\n", path);
+        return -1;
+    }
+    feed_print(&st);
+    return 0;
+}
+
+// ----- Источники обновлений -----
+// Файл <номер>.feed из каталога. NULL и *missing = 1, если такого ещё нет.
+static FILE *feed_open_dir(const char *dir, int64_t seq, int *missing) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%lld.feed", dir, (long long)seq);
+    FILE *in = fopen(path, "r");
+    *missing = !in && errno == ENOENT;
+    if (!in && !*missing) perror(path);
+    return in;
+}
+
+// GET <url>/<номер>.feed. Поток стоит на начале тела ответа, в *length - Content-Length
+// (-1, если сервер его не указал). NULL и *missing = 1 на ответ 404.
+static FILE *feed_open_http(const char *url, int64_t seq, int *missing, int64_t *length) {
+    char host[256], port[16] = "80";
+    const char *rest = url + strlen("http://");
+    size_t host_len = strcspn(rest, ":/");
+    const char *path = rest + host_len;
+
+    *missing = 0;
+    *length = -1;
+    if (host_len == 0 || host_len >= sizeof(host)) {
+        fprintf(stderr, "Неверный адрес сервера обновлений: %s\n", url);
+        return NULL;
+    }
+    memcpy(host, rest, host_len);
+    host[host_len] = '\0';
+    if (*path == ':') {
+        size_t port_len = strcspn(path + 1, "/");
+        snprintf(port, sizeof(port), "%.*s", (int)port_len, path + 1);
+        path += 1 + port_len;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai, *a;
+    int err = getaddrinfo(host, port, &hints, &ai);
+    if (err != 0) {
+        fprintf(stderr, "Сервер обновлений %s: %s\n", host, gai_strerror(err));
+        return NULL;
+    }
+    int fd = -1;
+    for (a = ai; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    if (fd < 0) {
+        perror("Ошибка подключения к серверу обновлений");
+        return NULL;
+    }
+
+    // Зависший сервер не должен держать синхронизацию вечно
+    struct timeval tv = { FEED_TIMEOUT_MS / 1000, FEED_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    FILE *in = fdopen(fd, "r+");
+    if (!in) {
+        perror("fdopen");
+        close(fd);
+        return NULL;
+    }
+    size_t path_len = strlen(path);
+    fprintf(in, "GET %.*s/%lld.feed HTTP/1.0\r\nHost: %s\r\nUser-Agent: antivirus\r\nConnection: close\r\n\r\n",
+            (int)(path_len && path[path_len - 1] == '/' ? path_len - 1 : path_len), path, (long long)seq, host);
+    if (fflush(in) != 0) {
+        perror("Ошибка запроса к серверу обновлений");
+        fclose(in);
+        return NULL;
+    }
+
+    // Строка статуса и заголовки
+    char *line = NULL;
+    size_t cap = 0;
+    int status = 0;
+    if (getline(&line, &cap, in) <= 0 || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+        fprintf(stderr, "Сервер обновлений не ответил на запрос %lld.feed\n", (long long)seq);
+        status = -1;
+    }
+    while (status > 0 && getline(&line, &cap, in) > 0 && line[0] != '\r' && line[0] != '\n') {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) *length = strtoll(line + 15, NULL, 10);
+    }
+    free(line);
+
+    if (status == 200) return in;
+    *missing = status == 404;
+    if (status > 0 && !*missing) fprintf(stderr, "Сервер обновлений: %lld.feed - ответ %d\n", (long long)seq, status);
+    fclose(in);
+    return NULL;
+}
+
+// Команда sync: применение всех изменений после Meta.feed_seq. Возвращает число применённых
+// файлов или -1, если ни один не применён из-за ошибки.
+int sync_signatures(const char *source) {
+    int http = strncmp(source, "http://", 7) == 0;
+    int64_t seq = get_meta("feed_seq");
+    struct feed_stats st = { 0 };
+    int applied = 0, failed = 0;
+
+    if (seq < 0) seq = 0;
+    for (;;) {
+        int missing;
+        int64_t length = -1;
+        FILE *in = http ? feed_open_http(source, seq + 1, &missing, &length)
+                        : feed_open_dir(source, seq + 1, &missing);
+        if (!in) {
+            failed = !missing;
+            break;
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "%lld.feed", (long long)(seq + 1));
+        int rc = feed_commit(in, name, seq + 1, length, &st);
+        fclose(in);
+        if (rc != 0) {
+            failed = 1;
+            break;
+        }
+        seq++;
+        applied++;
+    }
+
+    if (applied == 0) {
+        printf(failed ? "Синхронизация не выполнена, номер изменений %lld\n" : "Новых изменений нет (номер %lld)\n",
+               (long long)seq);
+        return failed ? -1 : 0;
+    }
+    printf("Применено изменений: %d, номер %lld%s\n", applied, (long long)seq,
+           failed ? " (остальные - при следующей синхронизации)" : "");
+    feed_print(&st);
+
+    // Загруженный автомат дополняется новыми сигнатурами сразу
+    if (matcher) matcher = matcher_prepare(db, matcher);
+    return applied;
+}
+
+// ====================================== Поиск сигнатур в файлe ======================================
+// ----- Совпадения в файле -----
+// За один проход собираются все пары (сигнатура, смещение). Файл, состоящий из одних
+// совпадений, не должен съесть всю память, поэтому после MAX_HITS_PER_FILE поиск прекращается.
+#define MAX_HITS_PER_FILE 65536
+
+struct file_hit {
+    int64_t  signature_id;
+    uint64_t offset;
+    uint32_t length;                 // длина найденного участка
+    const unsigned char *signature;  // байты в автомате, живут до конца проверки
+    uint32_t sig_length;             // длина записи сигнатуры
+};
+
+struct hit_list {
+    struct file_hit *items;
+    size_t count;
+    size_t capacity;
+    int truncated;                   // достигнут MAX_HITS_PER_FILE
+};
+
+void hit_list_free(struct hit_list *h) {
+    free(h->items);
+    memset(h, 0, sizeof(*h));
+}
+
+// Обработчик совпадения: добавляем его в список файла и продолжаем поиск
+static int collect_hit(void *ctx, const struct matcher *m, const struct ac_pattern *p,
+                       uint64_t offset, uint32_t length) {
+    struct hit_list *h = ctx;
+
+    if (h->count == MAX_HITS_PER_FILE) {
+        h->truncated = 1;
+        return 1;
+    }
+    if (h->count == h->capacity) {
+        size_t capacity = h->capacity ? h->capacity * 2 : 16;
+        struct file_hit *items = realloc(h->items, capacity * sizeof(*items));
+        if (!items) {
+            h->truncated = 1;
+            return 1;
+        }
+        h->items = items;
+        h->capacity = capacity;
+    }
+
+    h->items[h->count++] = (struct file_hit){ p->id, offset, length, m->bytes + p->offset, p->length };
+    return 0;
+}
+
+// Запись всех совпадений файла: строка FoundFiles (первое совпадение) и строки Hits.
+// Вызывается только владельцем соединения с БД.
+void record_file_hits(const char *path, const struct hit_list *h) {
+    if (h->count == 0) return;
+
+    // FoundFiles хранит самое раннее совпадение, как и раньше
+    const struct file_hit *first = &h->items[0];
+    for (size_t i = 1; i < h->count; i++) {
+        if (h->items[i].offset < first->offset) first = &h->items[i];
+    }
+
+    printf("В файле %s найдено совпадений: %zu%s, первое по смещению %llu\n", path, h->count,
+           h->truncated ? " (список обрезан)" : "", (unsigned long long)first->offset);
+
+    stat_add(CTR_FILES_INFECTED, 1);
+    stat_add(CTR_HITS, h->count);
+
+    PHASE_START(t);
+    int64_t file_id = insert_found_file(path, first->offset, first->signature, first->sig_length);
+    if (file_id >= 0) {
+        delete_hits(file_id);
+        for (size_t i = 0; i < h->count; i++) {
+            insert_hit(file_id, h->items[i].signature_id, h->items[i].offset, h->items[i].length);
+        }
+    }
+    PHASE_STOP(PHASE_DB, t);
+}
+
+// ----- Потоковое чтение файла -----
+// Файл читается блоками фиксированного размера в переиспользуемый буфер. Последние
+// (max_len - 1) байт блока переносятся в начало буфера перед следующим чтением, поэтому
+// сигнатура на границе блоков целиком попадает в буфер. Чтобы не сообщать о ней дважды,
+// учитываются только совпадения, заканчивающиеся в новых данных.
+#define SCAN_CHUNK_SIZE (1 << 20)
+#define SMALL_FILE_MAX  4096        // файлы меньше - одним чтением (scan_fd_sized)
+
+struct scanner {
+    unsigned char *buffer;  // перекрытие + блок
+    size_t capacity;
+    EVP_MD_CTX *md;         // SHA-256 содержимого для поиска повторов
+};
+
+struct scanner default_scanner; // буфер однопоточного поиска
+
+// Фильтр совпадений, уже найденных в предыдущем блоке, и начинающихся за концом участка
+struct chunk_filter {
+    hit_fn fn;
+    void *ctx;
+    uint64_t fresh_from;    // смещение первого нового байта в файле
+    uint64_t end;           // конец участка файла (UINT64_MAX - до конца файла)
+};
+
+static int chunk_filter_hit(void *ctx, const struct matcher *m, const struct ac_pattern *p,
+                            uint64_t offset, uint32_t length) {
+    struct chunk_filter *f = ctx;
+    if (offset + length <= f->fresh_from || offset >= f->end) return 0;
+    return f->fn(f->ctx, m, p, offset, length);
+}
+
+// Буфер под блок и перекрытие для автомата m
+static int scanner_reserve(struct scanner *sc, const struct matcher *m) {
+    size_t need = SCAN_CHUNK_SIZE + (m->max_len ? m->max_len - 1 : 0), capacity;
+    if (sc->capacity >= need) return 0;
+
+    // Содержимое не переносится: буфер заполняется заново в начале каждого поиска
+    unsigned char *p = pool_get(need, &capacity);
+    if (!p) return -1;
+    pool_put(sc->buffer, sc->capacity);
+    sc->buffer = p;
+    sc->capacity = capacity;
+    return 0;
+}
+
+void scanner_free(struct scanner *sc) {
+    pool_put(sc->buffer, sc->capacity);
+    EVP_MD_CTX_free(sc->md);
+    sc->buffer = NULL;
+    sc->capacity = 0;
+    sc->md = NULL;
+}
+
+// Поиск сигнатур, начинающихся в участке [begin, end) открытого файла. Чтение идёт до
+// end + max_len - 1, чтобы совпадение на правой границе попало в буфер целиком.
+// Возвращает 1, если обработчик остановил поиск, 0 - участок просмотрен целиком, -1 - ошибка.
+int scan_range(struct scanner *sc, const struct matcher *m, int fd, uint64_t begin, uint64_t end,
+               hit_fn fn, void *ctx) {
+    if (scanner_reserve(sc, m) != 0) {
+        perror("Ошибка выделения памяти");
+        return -1;
+    }
+
+    size_t overlap = m->max_len ? m->max_len - 1 : 0;
+    uint64_t limit = end > UINT64_MAX - overlap ? UINT64_MAX : end + overlap;
+    size_t kept = 0;       // байт перекрытия в начале буфера
+    off_t pos = begin;     // смещение конца прочитанных данных
+    struct chunk_filter filter = { fn, ctx, 0, end };
+
+    while ((uint64_t)pos < limit) {
+        size_t want = limit - pos < SCAN_CHUNK_SIZE ? limit - pos : SCAN_CHUNK_SIZE;
+        PHASE_START(rt);
+        ssize_t n = pread(fd, sc->buffer + kept, want, pos);
+        PHASE_STOP(PHASE_READ, rt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            stat_add(CTR_READ_ERRORS, 1);
+            return -1;
+        }
+        if (n == 0) break;
+        stat_add(CTR_BYTES_READ, n);
+        gov_read(n);
+
+        // Поиск идёт с начала буфера, перекрытие отсекает фильтр
+        uint64_t base = (uint64_t)pos - kept;
+        filter.fresh_from = pos;
+        PHASE_START(mt);
+        int stop = matcher_scan(m, sc->buffer, kept + n, base, chunk_filter_hit, &filter);
+        PHASE_STOP(PHASE_MATCH, mt);
+        if (stop) return 1;
+
+        pos += n;
+        size_t total = kept + n;
+        kept = total < overlap ? total : overlap;
+        memmove(sc->buffer, sc->buffer + total - kept, kept);
+    }
+
+    return 0;
+}
+
+// Поиск сигнатур в открытом файле.
+// Возвращает 1, если обработчик остановил поиск, 0 - файл просмотрен целиком, -1 - ошибка.
+int scan_fd(struct scanner *sc, const struct matcher *m, int fd, hit_fn fn, void *ctx) {
+    return scan_range(sc, m, fd, 0, UINT64_MAX, fn, ctx);
+}
+
+// Поиск в файле, размер которого известен по stat. Файл меньше SMALL_FILE_MAX читается одним
+// pread в буфер потока, без второго чтения, подтверждающего конец файла. Если прочитано не
+// столько, сколько ожидалось (файл изменился после stat), - обычный поиск.
+int scan_fd_sized(struct scanner *sc, const struct matcher *m, int fd, uint64_t size, hit_fn fn, void *ctx) {
+    if (size >= SMALL_FILE_MAX) return scan_fd(sc, m, fd, fn, ctx);
+    if (scanner_reserve(sc, m) != 0) {
+        perror("Ошибка выделения памяти");
+        return -1;
+    }
+
+    ssize_t n;
+    PHASE_START(rt);
+    do n = pread(fd, sc->buffer, SMALL_FILE_MAX, 0);
+    while (n < 0 && errno == EINTR);
+    PHASE_STOP(PHASE_READ, rt);
+    if (n < 0) {
+        stat_add(CTR_READ_ERRORS, 1);
+        return -1;
+    }
+    if ((uint64_t)n != size) return scan_fd(sc, m, fd, fn, ctx);
+    stat_add(CTR_BYTES_READ, n);
+    gov_read(n);
+
+    PHASE_START(mt);
+    int stop = matcher_scan(m, sc->buffer, n, 0, fn, ctx);
+    PHASE_STOP(PHASE_MATCH, mt);
+    return stop ? 1 : 0;
+}
+
+// ----- Разбиение больших файлов -----
+// Файл от shard_min_size байт делится на участки, которые просматриваются параллельно.
+// Каждый участок дочитывается на max_len - 1 байт за свой конец и сообщает только совпадения,
+// начинающиеся в нём, поэтому совпадение на стыке найдёт ровно один участок. Списки участков
+// сливаются и упорядочиваются по смещению.
+#define SHARD_MIN_LEN   (32ull << 20)
+#define SHARD_PER_THREAD 4              // участков на поток: выравнивает неравные по скорости участки
+
+uint64_t shard_min_size = 256ull << 20; // 0 - не делить
+
+// Длина участка файла size при n потоках (кратна блоку чтения)
+uint64_t shard_length(uint64_t size, int n) {
+    uint64_t len = size / ((uint64_t)n * SHARD_PER_THREAD);
+    if (len < SHARD_MIN_LEN) len = SHARD_MIN_LEN;
+    return (len + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE * SCAN_CHUNK_SIZE;
+}
+
+static int file_hit_cmp(const void *a, const void *b) {
+    const struct file_hit *x = a, *y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return (x->signature_id > y->signature_id) - (x->signature_id < y->signature_id);
+}
+
+// Добавление совпадений участка к списку файла (не больше MAX_HITS_PER_FILE)
+int hit_list_append(struct hit_list *dst, const struct hit_list *src) {
+    size_t n = src->count;
+    if (dst->count + n > MAX_HITS_PER_FILE) {
+        n = MAX_HITS_PER_FILE - dst->count;
+        dst->truncated = 1;
+    }
+    dst->truncated |= src->truncated;
+    if (dst->count + n > dst->capacity) {
+        size_t capacity = dst->count + n;
+        struct file_hit *items = realloc(dst->items, capacity * sizeof(*items));
+        if (!items) {
+            dst->truncated = 1;
+            return -1;
+        }
+        dst->items = items;
+        dst->capacity = capacity;
+    }
+    if (n) memcpy(dst->items + dst->count, src->items, n * sizeof(*src->items));
+    dst->count += n;
+    return 0;
+}
+
+// Упорядочивание по смещению и удаление повторов (то же смещение и сигнатура)
+void hit_list_unique(struct hit_list *h) {
+    if (h->count < 2) return;
+    qsort(h->items, h->count, sizeof(*h->items), file_hit_cmp);
+
+    size_t out = 1;
+    for (size_t i = 1; i < h->count; i++) {
+        if (file_hit_cmp(&h->items[out - 1], &h->items[i]) != 0) h->items[out++] = h->items[i];
+    }
+    h->count = out;
+}
+
+// Участки одного открытого файла для потоков search_signatures_in_file
+struct shard_scan {
+    const struct matcher *m;
+    int fd;
+    uint64_t size, length;
+    uint64_t next;              // начало следующего свободного участка
+    int failed;
+    struct hit_list hits;       // под lock
+    pthread_mutex_t lock;
+};
+
+static void *shard_thread(void *arg) {
+    struct shard_scan *s = arg;
+    struct scanner sc = { 0 };
+    struct hit_list hits = { 0 };
+    uint64_t begin;
+    int rc = 0;
+
+    gov_thread();
+    while (rc == 0 && (begin = __atomic_fetch_add(&s->next, s->length, __ATOMIC_RELAXED)) < s->size) {
+        uint64_t end = s->size - begin > s->length ? begin + s->length : UINT64_MAX;  // последний - до конца
+        rc = scan_range(&sc, s->m, s->fd, begin, end, collect_hit, &hits);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (rc < 0) s->failed = 1;
+    hit_list_append(&s->hits, &hits);
+    pthread_mutex_unlock(&s->lock);
+
+    hit_list_free(&hits);
+    scanner_free(&sc);
+    return NULL;
+}
+
+// Поиск в большом файле n потоками. Возвращает 0 или -1, совпадения - в hits.
+static int scan_fd_sharded(const struct matcher *m, int fd, uint64_t size, int n, struct hit_list *hits) {
+    struct shard_scan s = { .m = m, .fd = fd, .size = size, .length = shard_length(size, n) };
+    pthread_t threads[n];
+    int started = 0;
+
+    pthread_mutex_init(&s.lock, NULL);
+    while (started < n && (uint64_t)started * s.length < size &&
+           pthread_create(&threads[started], NULL, shard_thread, &s) == 0) {
+        started++;
+    }
+    if (started == 0) shard_thread(&s);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&s.lock);
+
+    hit_list_unique(&s.hits);
+    *hits = s.hits;
+    return s.failed ? -1 : 0;
+}
+
+// Функция для поиска сигнатур из БД в файле.
+// Возвращает 1 - найдена сигнатура, 0 - файл чист, -1 - ошибка.
+int search_signatures_in_file(const char *filename) {
+    if (!matcher || (matcher->n_patterns == 0 && matcher->n_masked == 0)) return 0;
+
+    gov_file();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Ошибка открытия файла");
+        stat_add(CTR_OPEN_ERRORS, 1);
+        return -1;
+    }
+
+    // Большой файл просматривается участками в нескольких потоках
+    struct hit_list hits = { 0 };
+    struct stat st;
+    int n_threads = scan_threads > 0 ? scan_threads : default_scan_threads();
+    int rc;
+    if (fstat(fd, &st) != 0) {
+        rc = scan_fd(&default_scanner, matcher, fd, collect_hit, &hits);
+    } else if (shard_min_size && n_threads > 1 && (uint64_t)st.st_size >= shard_min_size) {
+        rc = scan_fd_sharded(matcher, fd, st.st_size, n_threads, &hits);
+    } else {
+        rc = scan_fd_sized(&default_scanner, matcher, fd, st.st_size, collect_hit, &hits);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Ошибка чтения файла %s: %s\n", filename, strerror(errno));
+    }
+
+    // Найденное записываем, даже если файл не удалось дочитать
+    record_file_hits(filename, &hits);
+    if (rc >= 0) rc = hits.count > 0;
+
+    hit_list_free(&hits);
+    gov_drop(fd, 0, UINT64_MAX);
+    close(fd);
+    return rc;
+}
+// ====================================== Поиск файлов в директории ======================================
+// Обход без рекурсии: стек открытых каталогов, записи читаются getdents64 большими блоками,
+// вложенные файлы и каталоги открываются относительно дескриптора каталога (openat/fstatat),
+// так что длина пути ограничена только PATH_MAX при открытии файла потоком поиска.
+// Тип записи берётся из d_type; fstatat нужен только обычным файлам (размер, inode и время
+// для ScanState) и записям с DT_UNKNOWN.
+// - walk_symlinks: ссылки не разыменовываются, разыменовываются только ссылки на файлы
+//   (по умолчанию) или все; в последнем случае каталог, уже открытый выше по стеку, пропускается.
+// - walk_xdev: не переходить в каталоги другой файловой системы (как find -xdev).
+#define WALK_BUF_SIZE (64 << 10)
+
+enum walk_symlinks { WALK_SYMLINKS_SKIP, WALK_SYMLINKS_FILES, WALK_SYMLINKS_ALL };
+enum walk_symlinks walk_symlinks = WALK_SYMLINKS_FILES;
+int walk_xdev = 0;
+
+static const char *walk_symlinks_names[] = { "skip", "files", "all" };
+
+// Обработчик найденного обычного файла
+typedef void (*file_fn)(const char *path, const struct stat *st, void *ctx);
+// Обработчик каталога перед входом в него: 0 - обходить, иначе пропустить.
+// Он же - после выхода из обойденного каталога (результат не используется).
+typedef int (*dir_fn)(const char *path, void *ctx);
+
+struct walk_frame {
+    int fd;
+    char *buf;                  // блок записей getdents64
+    size_t pos, len;
+    size_t path_len;            // длина пути каталога в общем буфере
+    dev_t dev;                  // известны при walk_xdev или WALK_SYMLINKS_ALL
+    ino_t ino;
+};
+
+struct walker {
+    struct walk_frame *frames;
+    size_t depth, capacity;
+    char *path;                 // путь текущей записи
+    size_t path_cap;
+};
+
+static int walk_path_reserve(struct walker *w, size_t need) {
+    if (need <= w->path_cap) return 0;
+    size_t cap = w->path_cap ? w->path_cap : 1024;
+    while (cap < need) cap *= 2;
+    char *p = realloc(w->path, cap);
+    if (!p) return -1;
+    w->path = p;
+    w->path_cap = cap;
+    return 0;
+}
+
+// Каталог fd с путём длины path_len становится вершиной стека (при ошибке закрывается)
+static int walk_push(struct walker *w, int fd, size_t path_len, const struct stat *st) {
+    if (w->depth == w->capacity) {
+        size_t cap = w->capacity ? w->capacity * 2 : 32;
+        struct walk_frame *f = realloc(w->frames, cap * sizeof(*f));
+        if (!f) {
+            close(fd);
+            return -1;
+        }
+        memset(f + w->capacity, 0, (cap - w->capacity) * sizeof(*f));
+        w->frames = f;
+        w->capacity = cap;
+    }
+
+    // Блок записей остаётся у уровня стека и переходит к следующему каталогу той же глубины
+    struct walk_frame *f = &w->frames[w->depth];
+    char *buf = f->buf ? f->buf : malloc(WALK_BUF_SIZE);
+    *f = (struct walk_frame){ .fd = fd, .buf = buf, .path_len = path_len };
+    if (!f->buf) {
+        close(fd);
+        return -1;
+    }
+    if (st) {
+        f->dev = st->st_dev;
+        f->ino = st->st_ino;
+    }
+    w->depth++;
+    return 0;
+}
+
+static void walk_pop(struct walker *w) {
+    close(w->frames[--w->depth].fd);
+}
+
+// Каталог st уже открыт выше по стеку (цикл через символическую ссылку)
+static int walk_on_stack(const struct walker *w, const struct stat *st) {
+    for (size_t i = 0; i < w->depth; i++) {
+        if (w->frames[i].dev == st->st_dev && w->frames[i].ino == st->st_ino) return 1;
+    }
+    return 0;
+}
+
+// Обход каталога basePath: on_file для обычных файлов (может быть NULL), on_dir перед входом
+// в каждый вложенный каталог, on_leave после выхода из каждого каталога, включая basePath
+// (могут быть NULL). Возвращает -1, если basePath не открылся.
+int walk_tree(const char *basePath, file_fn on_file, dir_fn on_dir, dir_fn on_leave, void *ctx,
+              enum walk_symlinks symlinks, int xdev) {
+    struct walker w = { 0 };
+    int need_id = xdev || symlinks == WALK_SYMLINKS_ALL;    // dev и inode каждого каталога
+    struct stat st;
+
+    PHASE_START(t);
+    int fd = open(basePath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int rc = fd >= 0 && need_id ? fstat(fd, &st) : 0;
+    PHASE_STOP(PHASE_WALK, t);
+    size_t base_len = strlen(basePath);
+    while (base_len > 1 && basePath[base_len - 1] == '/') base_len--;
+    if (fd < 0 || rc != 0 || walk_path_reserve(&w, base_len + 1) != 0) {
+        fprintf(stderr, "Ошибка открытия каталога %s: %s\n", basePath, strerror(errno));
+        stat_add(CTR_OPEN_ERRORS, 1);
+        if (fd >= 0) close(fd);
+        free(w.path);
+        return -1;
+    }
+    memcpy(w.path, basePath, base_len);
+    w.path[base_len] = '\0';
+    dev_t root_dev = need_id ? st.st_dev : 0;
+    if (walk_push(&w, fd, base_len, need_id ? &st : NULL) != 0) perror("Ошибка выделения памяти");
+
+    while (w.depth > 0) {
+        struct walk_frame *f = &w.frames[w.depth - 1];
+        if (f->pos >= f->len) {
+            PHASE_START(rt);
+            ssize_t n = getdents64(f->fd, f->buf, WALK_BUF_SIZE);
+            PHASE_STOP(PHASE_WALK, rt);
+            if (n < 0) {
+                w.path[f->path_len] = '\0';
+                fprintf(stderr, "Ошибка чтения каталога %s: %s\n", w.path, strerror(errno));
+                stat_add(CTR_OPEN_ERRORS, 1);
+            }
+            if (n <= 0) {
+                w.path[f->path_len] = '\0';
+                walk_pop(&w);
+                if (on_leave) on_leave(w.path, ctx);
+                continue;
+            }
+            f->len = n;
+            f->pos = 0;
+        }
+
+        struct dirent64 *d = (struct dirent64 *)(f->buf + f->pos);
+        f->pos += d->d_reclen;
+        const char *name = d->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+        size_t name_len = strlen(name), len = f->path_len + 1 + name_len;
+        if (walk_path_reserve(&w, len + 1) != 0) {
+            perror("Ошибка выделения памяти");
+            continue;
+        }
+        f = &w.frames[w.depth - 1];
+        w.path[f->path_len] = '/';
+        memcpy(w.path + f->path_len + 1, name, name_len + 1);
+
+        // Тип из d_type; stat - только когда он нужен
+        unsigned char type = d->d_type;
+        int have_st = 0, via_link = 0;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            if (type == DT_LNK && symlinks == WALK_SYMLINKS_SKIP) continue;
+            via_link = type == DT_LNK;
+            PHASE_START(st_t);
+            rc = fstatat(f->fd, name, &st, via_link ? 0 : AT_SYMLINK_NOFOLLOW);
+            PHASE_STOP(PHASE_WALK, st_t);
+            if (rc != 0) {
+                fprintf(stderr, "Ошибка stat %s: %s\n", w.path, strerror(errno));
+                stat_add(CTR_STAT_ERRORS, 1);
+                continue;
+            }
+            have_st = 1;
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+            if (via_link && type == DT_DIR && symlinks != WALK_SYMLINKS_ALL) continue;
+        }
+
+        if (type == DT_REG) {
+            if (!on_file) continue;
+            if (!have_st) {
+                PHASE_START(st_t);
+                rc = fstatat(f->fd, name, &st, AT_SYMLINK_NOFOLLOW);
+                PHASE_STOP(PHASE_WALK, st_t);
+                if (rc != 0) {
+                    fprintf(stderr, "Ошибка stat %s: %s\n", w.path, strerror(errno));
+                    stat_add(CTR_STAT_ERRORS, 1);
+                    continue;
+                }
+                if (!S_ISREG(st.st_mode)) continue;     // заменён после чтения каталога
+            }
+            stat_add(CTR_FILES_VISITED, 1);
+            on_file(w.path, &st, ctx);
+        } else if (type == DT_DIR) {
+            if (on_dir && on_dir(w.path, ctx) != 0) continue;
+
+            PHASE_START(ot);
+            fd = openat(f->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (via_link ? 0 : O_NOFOLLOW));
+            rc = fd >= 0 && need_id && !have_st ? fstat(fd, &st) : 0;
+            PHASE_STOP(PHASE_WALK, ot);
+            if (fd < 0 || rc != 0) {
+                fprintf(stderr, "Ошибка открытия каталога %s: %s\n", w.path, strerror(errno));
+                stat_add(CTR_OPEN_ERRORS, 1);
+                if (fd >= 0) close(fd);
+                continue;
+            }
+            if ((xdev && st.st_dev != root_dev) || (symlinks == WALK_SYMLINKS_ALL && walk_on_stack(&w, &st))) {
+                close(fd);
+                continue;
+            }
+            if (walk_push(&w, fd, len, need_id ? &st : NULL) != 0) perror("Ошибка выделения памяти");
+        }
+    }
+
+    for (size_t i = 0; i < w.capacity; i++) free(w.frames[i].buf);
+    free(w.frames);
+    free(w.path);
+    return 0;
+}
+
+// Обход каталога для проверки: политики ссылок и файловых систем из настроек
+void listFilesRecursive(const char *basePath, file_fn on_file, void *ctx) {
+    walk_tree(basePath, on_file, NULL, NULL, ctx, walk_symlinks, walk_xdev);
+}
+
+// ====================================== Инкрементальная проверка ======================================
+// Для каждого чистого файла в ScanState запоминается (dev, inode), размер, mtime, ctime и
+// поколение добавленных сигнатур. Если при следующей проверке ничего из этого не изменилось,
+// файл пропускается. Таблица целиком читается в память в начале check: обход сверяется с ней
+// без обращений к БД, а новые записи делает поток, владеющий соединением.
+struct file_stamp {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;      // наносекунды
+    int64_t ctime;
+};
+
+struct scan_state {
+    struct file_stamp stamp;
+    int64_t generation;
+    int used;
+    int seen;           // файл встретился при текущем обходе
+};
+
+struct scan_state_table {
+    struct scan_state *slots;
+    size_t capacity;    // степень двойки
+    size_t count;
+    int64_t generation; // текущее поколение добавленных сигнатур
+    uint64_t skipped;   // пропущено файлов при текущем обходе
+};
+
+struct scan_state_table scan_states;
+
+void stamp_from_stat(struct file_stamp *fs, const struct stat *st) {
+    fs->dev = st->st_dev;
+    fs->ino = st->st_ino;
+    fs->size = st->st_size;
+    fs->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    fs->ctime = (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+static size_t stamp_slot(const struct scan_state_table *t, uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev * 0x9E3779B97F4A7C15ull)) * 0xBF58476D1CE4E5B9ull;
+    size_t i = (h ^ (h >> 31)) & (t->capacity - 1);
+    while (t->slots[i].used && (t->slots[i].stamp.dev != dev || t->slots[i].stamp.ino != ino)) {
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return i;
+}
+
+static int scan_states_grow(struct scan_state_table *t) {
+    struct scan_state_table bigger = *t;
+    bigger.capacity = t->capacity ? t->capacity * 2 : 1024;
+    bigger.slots = calloc(bigger.capacity, sizeof(struct scan_state));
+    if (!bigger.slots) return -1;
+
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (t->slots[i].used) {
+            bigger.slots[stamp_slot(&bigger, t->slots[i].stamp.dev, t->slots[i].stamp.ino)] = t->slots[i];
+        }
+    }
+    free(t->slots);
+    *t = bigger;
+    return 0;
+}
+
+void scan_states_free(struct scan_state_table *t) {
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+// Чтение таблицы ScanState в память
+int scan_states_load(struct scan_state_table *t) {
+    const char *query = "SELECT dev, ino, size, mtime, ctime, generation FROM ScanState;";
+    sqlite3_stmt *stmt;
+
+    scan_states_free(t);
+    t->generation = get_sig_added_generation();
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if ((t->count + 1) * 2 > t->capacity && scan_states_grow(t) != 0) {
+            perror("Ошибка выделения памяти");
+            sqlite3_finalize(stmt);
+            return -1;
+        }
+
+        struct scan_state s = { .used = 1 };
+        s.stamp.dev = sqlite3_column_int64(stmt, 0);
+        s.stamp.ino = sqlite3_column_int64(stmt, 1);
+        s.stamp.size = sqlite3_column_int64(stmt, 2);
+        s.stamp.mtime = sqlite3_column_int64(stmt, 3);
+        s.stamp.ctime = sqlite3_column_int64(stmt, 4);
+        s.generation = sqlite3_column_int64(stmt, 5);
+
+        t->slots[stamp_slot(t, s.stamp.dev, s.stamp.ino)] = s;
+        t->count++;
+    }
+
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+// Файл не менялся с последней чистой проверки и новых сигнатур не добавлялось
+int scan_state_unchanged(struct scan_state_table *t, const struct stat *st) {
+    if (t->capacity == 0) return 0;
+
+    struct file_stamp fs;
+    stamp_from_stat(&fs, st);
+
+    struct scan_state *s = &t->slots[stamp_slot(t, fs.dev, fs.ino)];
+    if (!s->used) return 0;
+    s->seen = 1;
+
+    if (s->generation != t->generation || memcmp(&s->stamp, &fs, sizeof(fs)) != 0) return 0;
+    t->skipped++;
+    stat_add(CTR_FILES_SKIPPED, 1);
+    return 1;
+}
+
+// Запись состояния чистого файла (вызывается только владельцем соединения с БД)
+void save_scan_state(const struct file_stamp *fs, int64_t generation) {
+    PHASE_START(t);
+    sqlite3_stmt *stmt = db_stmt(STMT_SAVE_SCAN_STATE);
+    if (!stmt) return;
+
+    sqlite3_bind_int64(stmt, 1, fs->dev);
+    sqlite3_bind_int64(stmt, 2, fs->ino);
+    sqlite3_bind_int64(stmt, 3, fs->size);
+    sqlite3_bind_int64(stmt, 4, fs->mtime);
+    sqlite3_bind_int64(stmt, 5, fs->ctime);
+    sqlite3_bind_int64(stmt, 6, generation);
+
+    db_write();
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Ошибка записи состояния файла: %s\n", sqlite3_errmsg(db));
+    }
+
+    db_stmt_release(stmt);
+    PHASE_STOP(PHASE_DB, t);
+}
+
+// Удаление записей о файлах, которые не встретились при обходе
+void purge_unseen_scan_states(struct scan_state_table *t) {
+    PHASE_START(t0);
+    sqlite3_stmt *stmt = db_stmt(STMT_DELETE_SCAN_STATE);
+    if (!stmt) return;
+
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (!t->slots[i].used || t->slots[i].seen) continue;
+        sqlite3_bind_int64(stmt, 1, t->slots[i].stamp.dev);
+        sqlite3_bind_int64(stmt, 2, t->slots[i].stamp.ino);
+        db_write();
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "Ошибка удаления состояния файла: %s\n", sqlite3_errmsg(db));
+        }
+        sqlite3_reset(stmt);
+    }
+
+    db_stmt_release(stmt);
+    PHASE_STOP(PHASE_DB, t0);
+}
+
+// ----- Контрольные точки -----
+// Долгая проверка раз в checkpoint_interval секунд записывает, докуда дошла: в ScanProgress -
+// корень, поколение сигнатур и счётчики, в ScanProgressDirs - каталоги, обойденные целиком
+// вместе с вердиктами по всем их файлам (каталоги внутри уже записанных не хранятся).
+// check resume обходит тот же корень, не заходя в эти каталоги. Файлы недообойденных каталогов
+// проверяются снова: чистые отсеет ScanState, найденное раньше обновит ту же строку FoundFiles.
+// Обход уходит вперёд потоков поиска, поэтому каталог, из которого он вышел, ещё не проверен.
+// Пути нумеруются по порядку отправки в проверку; каталог готов, когда вердикт получили все
+// пути с номерами меньше числа отправленных к выходу из него. Вердикт по пути отмечается после
+// его записи в БД, а точку пишет тот же владелец соединения - в ту же или более позднюю
+// транзакцию, так что точка не опережает вердикты.
+int checkpoint_interval = 60;   // секунд, 0 - без контрольных точек
+
+struct progress_point {
+    char **dirs;                // готовые каталоги в порядке выхода из них
+    size_t count;
+    uint64_t files, bytes, hits;    // с начала проверки, включая прерванные запуски
+};
+
+struct progress_dir {
+    char *path;
+    uint64_t seq;               // путей отправлено в проверку к выходу из каталога
+};
+
+struct scan_progress {
+    char *root;
+    int64_t generation;
+    uint64_t files, bytes, hits;    // до продолжения
+    char **skip;                // обойденные прерванной проверкой, по возрастанию
+    size_t n_skip;
+    uint64_t skipped;           // из них встретилось при продолжении
+    uint64_t next_at;           // время следующей точки
+    uint64_t saved;             // записано точек
+
+    pthread_mutex_t lock;       // для полей ниже
+    struct progress_dir *left;  // каталоги, из которых вышел обход, ещё не записанные
+    size_t n_left, cap_left;
+    unsigned char *marks;       // marks[i] - вердикт по пути номер base + i
+    size_t cap_marks;
+    uint64_t base;
+    uint64_t low;               // все пути с меньшими номерами получили вердикт
+};
+
+void progress_point_free(struct progress_point *p) {
+    for (size_t i = 0; i < p->count; i++) free(p->dirs[i]);
+    free(p->dirs);
+    memset(p, 0, sizeof(*p));
+}
+
+void scan_progress_init(struct scan_progress *p) {
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+}
+
+void scan_progress_free(struct scan_progress *p) {
+    for (size_t i = 0; i < p->n_skip; i++) free(p->skip[i]);
+    for (size_t i = 0; i < p->n_left; i++) free(p->left[i].path);
+    free(p->skip);
+    free(p->left);
+    free(p->marks);
+    free(p->root);
+    pthread_mutex_destroy(&p->lock);
+    memset(p, 0, sizeof(*p));
+}
+
+// Обход вышел из каталога path, отправив в проверку seq путей
+void progress_left(struct scan_progress *p, const char *path, uint64_t seq) {
+    char *copy = strdup(path);
+    pthread_mutex_lock(&p->lock);
+    if (copy && p->n_left == p->cap_left) {
+        size_t capacity = p->cap_left ? p->cap_left * 2 : 256;
+        struct progress_dir *left = realloc(p->left, capacity * sizeof(*left));
+        if (left) {
+            p->left = left;
+            p->cap_left = capacity;
+        }
+    }
+    if (copy && p->n_left < p->cap_left) {
+        p->left[p->n_left++] = (struct progress_dir){ copy, seq };
+        copy = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(copy);     // без памяти каталог не попадёт в точку и будет обойден при продолжении
+}
+
+// Вердикт по пути номер seq записан
+void progress_mark(struct scan_progress *p, uint64_t seq) {
+    pthread_mutex_lock(&p->lock);
+    if (seq - p->base >= p->cap_marks) {
+        // Отметки до low больше не нужны; если места всё равно мало - буфер растёт
+        size_t used = p->low - p->base, keep = p->cap_marks - used;
+        if (used) {
+            memmove(p->marks, p->marks + used, keep);
+            memset(p->marks + keep, 0, used);
+            p->base = p->low;
+        }
+        size_t capacity = p->cap_marks ? p->cap_marks : 4096;
+        while (seq - p->base >= capacity) capacity *= 2;
+        unsigned char *marks = capacity > p->cap_marks ? realloc(p->marks, capacity) : p->marks;
+        if (marks && capacity > p->cap_marks) {
+            memset(marks + p->cap_marks, 0, capacity - p->cap_marks);
+            p->marks = marks;
+            p->cap_marks = capacity;
+        }
+    }
+    if (seq - p->base < p->cap_marks) p->marks[seq - p->base] = 1;
+    while (p->low - p->base < p->cap_marks && p->marks[p->low - p->base]) p->low++;
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Готовые каталоги переходят в pt. -1 - нет памяти.
+int progress_take(struct scan_progress *p, struct progress_point *pt) {
+    memset(pt, 0, sizeof(*pt));
+    pthread_mutex_lock(&p->lock);
+    size_t n = 0;
+    while (n < p->n_left && p->left[n].seq <= p->low) n++;
+    if (n && !(pt->dirs = malloc(n * sizeof(*pt->dirs)))) {
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) pt->dirs[i] = p->left[i].path;
+    pt->count = n;
+    memmove(p->left, p->left + n, (p->n_left - n) * sizeof(*p->left));
+    p->n_left -= n;
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+static int progress_path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Контрольная точка прерванной проверки. 1 - есть, 0 - нет, -1 - ошибка.
+int progress_load(struct scan_progress *p) {
+    sqlite3_stmt *stmt;
+    scan_progress_init(p);
+
+    if (sqlite3_prepare_v2(db, "SELECT root, generation, files, bytes, hits FROM ScanProgress WHERE id = 1;",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
+        scan_progress_free(p);
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        p->root = strdup((const char *)sqlite3_column_text(stmt, 0));
+        p->generation = sqlite3_column_int64(stmt, 1);
+        p->files = sqlite3_column_int64(stmt, 2);
+        p->bytes = sqlite3_column_int64(stmt, 3);
+        p->hits = sqlite3_column_int64(stmt, 4);
+    }
+    sqlite3_finalize(stmt);
+    if (!p->root) {
+        scan_progress_free(p);
+        return 0;
+    }
+
+    // Пути читаются по возрастанию - в порядке strcmp для bsearch
+    if (sqlite3_prepare_v2(db, "SELECT path FROM ScanProgressDirs ORDER BY path;", -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
+        scan_progress_free(p);
+        return -1;
+    }
+    size_t capacity = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (p->n_skip == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            char **items = realloc(p->skip, capacity * sizeof(*items));
+            if (!items) break;
+            p->skip = items;
+        }
+        if (!(p->skip[p->n_skip] = strdup((const char *)sqlite3_column_text(stmt, 0)))) break;
+        p->n_skip++;
+    }
+    sqlite3_finalize(stmt);
+    if (p->n_skip > 1) qsort(p->skip, p->n_skip, sizeof(*p->skip), progress_path_cmp);
+    return 1;
+}
+
+// Каталог обойден прерванной проверкой
+int progress_skip(const struct scan_progress *p, const char *path) {
+    return p->n_skip && bsearch(&path, p->skip, p->n_skip, sizeof(*p->skip), progress_path_cmp) != NULL;
+}
+
+// Запись контрольной точки и фиксация транзакции (вызывается только владельцем соединения с БД).
+// Все вердикты по файлам каталогов точки уже записаны в ту же или более раннюю транзакцию.
+void progress_save(const char *root, int64_t generation, const struct progress_point *pt) {
+    PHASE_START(t);
+    sqlite3_stmt *stmt = db_stmt(STMT_SAVE_PROGRESS);
+    if (!stmt) return;
+    sqlite3_bind_text(stmt, 1, root, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, generation);
+    sqlite3_bind_int64(stmt, 3, pt->files);
+    sqlite3_bind_int64(stmt, 4, pt->bytes);
+    sqlite3_bind_int64(stmt, 5, pt->hits);
+    db_write();
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Ошибка записи контрольной точки: %s\n", sqlite3_errmsg(db));
+    }
+    db_stmt_release(stmt);
+
+    // Каталог обойден после всех вложенных: их строки заменяются одной
+    sqlite3_stmt *del = db_stmt(STMT_DELETE_PROGRESS_DIRS), *ins = db_stmt(STMT_INSERT_PROGRESS_DIR);
+    for (size_t i = 0; del && ins && i < pt->count; i++) {
+        sqlite3_bind_text(del, 1, pt->dirs[i], -1, SQLITE_STATIC);
+        sqlite3_bind_text(ins, 1, pt->dirs[i], -1, SQLITE_STATIC);
+        db_write();
+        if (sqlite3_step(del) != SQLITE_DONE || sqlite3_step(ins) != SQLITE_DONE) {
+            fprintf(stderr, "Ошибка записи контрольной точки: %s\n", sqlite3_errmsg(db));
+        }
+        sqlite3_reset(del);
+        sqlite3_reset(ins);
+    }
+    if (del) db_stmt_release(del);
+    if (ins) db_stmt_release(ins);
+
+    db_batch_commit();
+    PHASE_STOP(PHASE_DB, t);
+}
+
+// Начало новой проверки root: прежняя точка больше не нужна
+void progress_reset(const char *root, int64_t generation) {
+    db_write();
+    if (sqlite3_exec(db, "DELETE FROM ScanProgress; DELETE FROM ScanProgressDirs;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка очистки контрольной точки: %s\n", sqlite3_errmsg(db));
+    }
+    if (!root) return;
+
+    struct progress_point start = { 0 };
+    progress_save(root, generation, &start);
+}
+
+// ====================================== Повторяющиеся файлы ======================================
+// Жёсткие ссылки и копии одного содержимого проверяются один раз, а совпадения записываются
+// под каждым путём.
+// - Обход запоминает (dev, inode) файлов с несколькими ссылками: остальные пути того же inode
+//   ждут вердикта первого и не открываются.
+// - Поток поиска считает SHA-256 файлов от DEDUP_MIN_SIZE байт до поиска. Если такое содержимое
+//   уже проверено (в этой проверке или раньше - по таблице ContentVerdicts), поиск не нужен.
+//   Ключ - криптографический хэш: файл, подобранный под хэш чистого, не унаследует его вердикт.
+// Чистое содержимое хранится в ContentVerdicts с поколением добавленных сигнатур и действует,
+// пока сигнатуры не добавлялись. Заражённое запоминается только до конца проверки.
+#define DEDUP_MIN_SIZE 4096
+
+int dedup_enabled = 1;
+
+// Файл в очереди на проверку. Путь лежит в той же памяти сразу за структурой (file_job_new),
+// так что на файл приходится одно выделение, и его освобождает тот, кто последним держит job.
+struct file_job {
+    char *path;
+    struct file_stamp stamp;
+    int linked;                     // первый путь inode с несколькими ссылками
+    struct shard_set *shard;        // участок [begin, end) большого файла, путь принадлежит shard->job
+    uint64_t begin, end;
+    uint64_t seq;                   // номер пути для контрольных точек
+};
+
+static struct file_job *file_job_new(const char *path, const struct stat *st) {
+    size_t len = strlen(path) + 1;
+    struct file_job *job = malloc(sizeof(*job) + len);
+    if (!job) return NULL;
+
+    *job = (struct file_job){ .path = (char *)(job + 1) };
+    memcpy(job->path, path, len);
+    stamp_from_stat(&job->stamp, st);
+    return job;
+}
+
+enum dedup_kind { DEDUP_INODE, DEDUP_CONTENT };
+enum dedup_state { DEDUP_PENDING, DEDUP_CLEAN, DEDUP_INFECTED, DEDUP_FAILED };
+
+struct dedup_key {
+    unsigned char kind;
+    unsigned char bytes[SHA256_DIGEST_LENGTH];  // SHA-256 содержимого или dev и inode
+};
+
+// Путь, ждущий вердикта по ключу
+struct dedup_alias {
+    struct file_job *job;
+    struct dedup_alias *next;
+};
+
+struct dedup_entry {
+    struct dedup_key key;
+    unsigned char used;
+    unsigned char state;
+    struct hit_list hits;           // для DEDUP_INFECTED
+    struct dedup_alias *aliases;    // для DEDUP_PENDING
+};
+
+// Общая для обхода и потоков поиска таблица, все обращения под lock
+struct dedup_table {
+    struct dedup_entry *slots;
+    size_t capacity;                // степень двойки
+    size_t count;
+    pthread_mutex_t lock;
+};
+
+struct dedup_table dedup = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Результат обращения к таблице
+enum dedup_claim { CLAIM_SCAN, CLAIM_WAIT, CLAIM_DONE };
+
+void dedup_key_inode(struct dedup_key *k, const struct file_stamp *fs) {
+    memset(k, 0, sizeof(*k));
+    k->kind = DEDUP_INODE;
+    memcpy(k->bytes, &fs->dev, sizeof(fs->dev));
+    memcpy(k->bytes + sizeof(fs->dev), &fs->ino, sizeof(fs->ino));
+}
+
+void dedup_key_content(struct dedup_key *k, const unsigned char *digest) {
+    k->kind = DEDUP_CONTENT;
+    memcpy(k->bytes, digest, SHA256_DIGEST_LENGTH);
+}
+
+static size_t dedup_slot(const struct dedup_table *t, const struct dedup_key *k) {
+    uint64_t a, b;
+    memcpy(&a, k->bytes, 8);
+    memcpy(&b, k->bytes + 8, 8);
+    uint64_t h = (a * 0x9E3779B97F4A7C15ull ^ b ^ k->kind) * 0xBF58476D1CE4E5B9ull;
+    size_t i = (h ^ (h >> 31)) & (t->capacity - 1);
+    while (t->slots[i].used && memcmp(&t->slots[i].key, k, sizeof(*k)) != 0) {
+        i = (i + 1) & (t->capacity - 1);
+    }
+    return i;
+}
+
+static int dedup_grow(struct dedup_table *t) {
+    struct dedup_table bigger = { .capacity = t->capacity ? t->capacity * 2 : 1024, .count = t->count };
+    bigger.slots = calloc(bigger.capacity, sizeof(struct dedup_entry));
+    if (!bigger.slots) return -1;
+
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (t->slots[i].used) bigger.slots[dedup_slot(&bigger, &t->slots[i].key)] = t->slots[i];
+    }
+    free(t->slots);
+    t->slots = bigger.slots;
+    t->capacity = bigger.capacity;
+    return 0;
+}
+
+// Запись для ключа: существующая или новая в состоянии state (NULL - нет памяти)
+static struct dedup_entry *dedup_insert(struct dedup_table *t, const struct dedup_key *k, int state, int *created) {
+    if ((t->count + 1) * 2 > t->capacity && dedup_grow(t) != 0) return NULL;
+
+    struct dedup_entry *e = &t->slots[dedup_slot(t, k)];
+    *created = !e->used;
+    if (!e->used) {
+        e->key = *k;
+        e->used = 1;
+        e->state = state;
+        t->count++;
+    }
+    return e;
+}
+
+static int dedup_copy_hits(struct hit_list *dst, const struct hit_list *src) {
+    *dst = *src;
+    dst->capacity = src->count;
+    dst->items = NULL;
+    if (src->count == 0) return 0;
+
+    dst->items = malloc(src->count * sizeof(*src->items));
+    if (!dst->items) return -1;
+    memcpy(dst->items, src->items, src->count * sizeof(*src->items));
+    return 0;
+}
+
+void dedup_free(struct dedup_table *t) {
+    for (size_t i = 0; i < t->capacity; i++) hit_list_free(&t->slots[i].hits);
+    free(t->slots);
+    t->slots = NULL;
+    t->capacity = t->count = 0;
+}
+
+// Обращение пути job к ключу k. Первый обратившийся проверяет файл сам (CLAIM_SCAN) и потом
+// вызывает dedup_finish. Пока проверка идёт, следующие пути встают в ожидание (CLAIM_WAIT, job
+// переходит таблице). Готовый вердикт копируется в hits (CLAIM_DONE).
+enum dedup_claim dedup_claim(struct dedup_table *t, const struct dedup_key *k, struct file_job *job,
+                             struct hit_list *hits) {
+    enum dedup_claim rc = CLAIM_SCAN;
+    int created;
+
+    pthread_mutex_lock(&t->lock);
+    struct dedup_entry *e = dedup_insert(t, k, DEDUP_PENDING, &created);
+    if (e && !created) {
+        if (e->state == DEDUP_PENDING) {
+            struct dedup_alias *a = malloc(sizeof(*a));
+            if (a) {
+                a->job = job;
+                a->next = e->aliases;
+                e->aliases = a;
+                rc = CLAIM_WAIT;
+            }
+        } else if (e->state == DEDUP_CLEAN || e->state == DEDUP_INFECTED) {
+            if (dedup_copy_hits(hits, &e->hits) == 0) rc = CLAIM_DONE;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (rc != CLAIM_SCAN) stat_add(k->kind == DEDUP_INODE ? CTR_DEDUP_LINKS : CTR_DEDUP_COPIES, 1);
+    return rc;
+}
+
+// Вердикт по ключу k от пути, получившего CLAIM_SCAN. Возвращает пути, ждавшие этого вердикта.
+// ok == 0 - файл не удалось проверить, ждавшие проверяются сами, следующие тоже.
+struct dedup_alias *dedup_finish(struct dedup_table *t, const struct dedup_key *k, const struct hit_list *hits, int ok) {
+    struct dedup_alias *aliases = NULL;
+    int created;
+
+    pthread_mutex_lock(&t->lock);
+    struct dedup_entry *e = dedup_insert(t, k, DEDUP_PENDING, &created);
+    if (e) {
+        e->state = !ok ? DEDUP_FAILED : hits->count ? DEDUP_INFECTED : DEDUP_CLEAN;
+        if (e->state == DEDUP_INFECTED && e->hits.count == 0 && dedup_copy_hits(&e->hits, hits) != 0) {
+            e->state = DEDUP_FAILED;
+        }
+        aliases = e->aliases;
+        e->aliases = NULL;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return aliases;
+}
+
+// Начало проверки: чистое содержимое из ContentVerdicts текущего поколения попадает в таблицу,
+// записи старых поколений удаляются.
+int dedup_load(struct dedup_table *t, int64_t generation) {
+    sqlite3_stmt *stmt;
+    char sql[128];
+
+    dedup_free(t);
+    snprintf(sql, sizeof(sql), "DELETE FROM ContentVerdicts WHERE generation <> %lld;", (long long)generation);
+    if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT sha256 FROM ContentVerdicts WHERE hits = 0;", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка чтения вердиктов по содержимому: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(stmt, 0) != SHA256_DIGEST_LENGTH) continue;
+
+        struct dedup_key k;
+        int created;
+        dedup_key_content(&k, sqlite3_column_blob(stmt, 0));
+        if (!dedup_insert(t, &k, DEDUP_CLEAN, &created)) {
+            perror("Ошибка выделения памяти");
+            break;
+        }
+    }
+
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+// Вердикт по содержимому (вызывается только владельцем соединения с БД)
+void save_content_verdict(const unsigned char *digest, int64_t size, int64_t generation, size_t hits) {
+    PHASE_START(t);
+    sqlite3_stmt *stmt = db_stmt(STMT_SAVE_CONTENT_VERDICT);
+    if (!stmt) return;
+
+    sqlite3_bind_blob(stmt, 1, digest, SHA256_DIGEST_LENGTH, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, size);
+    sqlite3_bind_int64(stmt, 3, generation);
+    sqlite3_bind_int64(stmt, 4, hits);
+
+    db_write();
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Ошибка записи вердикта по содержимому: %s\n", sqlite3_errmsg(db));
+    }
+
+    db_stmt_release(stmt);
+    PHASE_STOP(PHASE_DB, t);
+}
+
+// SHA-256 файла. Если файл поместился в один блок, он остаётся в начале буфера sc.
+// size - размер по stat: неполное чтение, дошедшее ровно до него, считается концом файла.
+// Возвращает число прочитанных байт или -1.
+ssize_t content_digest(struct scanner *sc, const struct matcher *m, int fd, uint64_t size, unsigned char *digest) {
+    if (scanner_reserve(sc, m) != 0 || (!sc->md && !(sc->md = EVP_MD_CTX_new())) ||
+        EVP_DigestInit_ex(sc->md, EVP_sha256(), NULL) != 1) {
+        return -1;
+    }
+
+    off_t pos = 0;
+    for (;;) {
+        // Пока файл помещается в блок, он собирается в буфере целиком
+        size_t at = pos < SCAN_CHUNK_SIZE ? pos : 0, want = SCAN_CHUNK_SIZE - at;
+        PHASE_START(rt);
+        ssize_t n = pread(fd, sc->buffer + at, want, pos);
+        PHASE_STOP(PHASE_READ, rt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            stat_add(CTR_READ_ERRORS, 1);
+            return -1;
+        }
+        if (n == 0) break;
+        stat_add(CTR_BYTES_READ, n);
+        gov_read(n);
+
+        PHASE_START(ht);
+        int ok = EVP_DigestUpdate(sc->md, sc->buffer + at, n) == 1;
+        PHASE_STOP(PHASE_HASH, ht);
+        if (!ok) return -1;
+        pos += n;
+        if ((size_t)n < want && (uint64_t)pos == size) break;
+    }
+
+    return EVP_DigestFinal_ex(sc->md, digest, NULL) == 1 ? pos : -1;
+}
+
+// ====================================== Параллельный поиск ======================================
+// Обход каталога кладёт пути в общую очередь, N потоков ищут сигнатуры, а единственный
+// поток записи владеет соединением с БД и получает найденные сигнатуры через свою очередь.
+#define FILE_QUEUE_SIZE 4096
+#define HIT_QUEUE_SIZE  1024
+
+int scan_threads = 0;  // число потоков поиска (0 - по числу процессоров)
+int io_depth = 0;      // запросов чтения в полёте на поток поиска (0 - блокирующее чтение)
+
+enum io_backend { IO_AUTO, IO_URING, IO_POOL };
+enum io_backend io_backend = IO_AUTO;
+static const char *io_backend_names[] = { "auto", "io_uring", "pool" };
+
+// Ограниченная очередь с блокировкой: много производителей, много потребителей
+struct bounded_queue {
+    void **items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+int bq_init(struct bounded_queue *q, size_t capacity) {
+    q->items = malloc(capacity * sizeof(void *));
+    if (!q->items) return -1;
+    q->capacity = capacity;
+    q->head = q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+void bq_destroy(struct bounded_queue *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+}
+
+// Добавление элемента, ждёт, пока в очереди не появится место
+void bq_push(struct bounded_queue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity) pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Извлечение элемента. NULL - очередь закрыта и пуста.
+void *bq_pop(struct bounded_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) pthread_cond_wait(&q->not_empty, &q->lock);
+
+    void *item = NULL;
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+// Извлечение без ожидания. NULL - очередь пуста.
+void *bq_try_pop(struct bounded_queue *q) {
+    void *item = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+// Больше элементов не будет: потребители доберут остаток и получат NULL
+void bq_close(struct bounded_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Сообщение от потока поиска к потоку записи
+enum { MSG_HIT, MSG_CLEAN };
+
+struct hit_msg {
+    int kind;
+    char *path;
+    struct file_job *job;            // путь и отметка ScanState, освобождается вместе с сообщением
+    struct hit_list hits;            // для MSG_HIT
+    int has_digest;                  // содержимое проверено впервые: вердикт в ContentVerdicts
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+struct parallel_scan {
+    struct bounded_queue files;
+    struct bounded_queue hits;
+    const struct matcher *m;
+    int dry_run;                // найденное не пишется в БД (для замеров)
+    int direct;                 // без потоков: сообщения записываются сразу
+    int dedup;                  // ссылки и копии проверяются один раз
+    int64_t generation;         // поколение добавленных сигнатур для ScanState
+    uint64_t files_scanned;     // счётчики обновляются атомарно
+    uint64_t bytes_scanned;
+    uint64_t hits_found;
+    int io_backend_used;        // чем читали потоки поиска при io_depth > 0
+    int workers;                // запущено потоков поиска (участки больших файлов - при > 1)
+    uint64_t jobs_queued;       // путей отправлено в проверку (только поток обхода)
+    struct scan_progress *progress; // контрольные точки (NULL - не ведутся)
+};
+
+// Большой файл, поделённый на участки: последний завершившийся участок выносит вердикт
+struct shard_set {
+    struct file_job *job;
+    pthread_mutex_t lock;
+    unsigned remaining;
+    int failed;
+    struct hit_list hits;
+    uint64_t t0;
+};
+
+// Вердикт по пути записан (или записывать нечего)
+static void file_job_done(struct parallel_scan *ps, struct file_job *job) {
+    if (ps->progress) progress_mark(ps->progress, job->seq);
+    free(job);
+}
+
+// Запись результата по одному пути (вызывается только владельцем соединения с БД)
+static void write_msg(struct parallel_scan *ps, struct hit_msg *msg) {
+    if (msg->kind == MSG_CLEAN) {
+        save_scan_state(&msg->job->stamp, ps->generation);
+    } else {
+        record_file_hits(msg->job->path, &msg->hits);
+    }
+    if (msg->has_digest) {
+        save_content_verdict(msg->digest, msg->job->stamp.size, ps->generation, msg->hits.count);
+    }
+    hit_list_free(&msg->hits);
+    file_job_done(ps, msg->job);
+    free(msg);
+}
+
+static void scan_job(struct parallel_scan *ps, struct scanner *sc, struct file_job *job);
+static void *io_worker(void *arg);
+
+// Вердикт по файлу job (ok == 0 - файл не удалось дочитать): совпадения или отметка о чистом
+// файле уходят потоку записи, а пути, ждавшие этот inode, получают копию вердикта.
+// Забирает job и hits.
+static void scan_verdict(struct parallel_scan *ps, struct scanner *sc, struct file_job *job,
+                         struct hit_list *hits, int ok, const unsigned char *digest);
+
+static void scan_resolve(struct parallel_scan *ps, struct scanner *sc, struct dedup_alias *a,
+                         const struct hit_list *hits, int ok) {
+    while (a) {
+        struct dedup_alias *next = a->next;
+        struct hit_list copy;
+        if (ok && dedup_copy_hits(&copy, hits) == 0) {
+            scan_verdict(ps, sc, a->job, &copy, 1, NULL);
+        } else {
+            scan_job(ps, sc, a->job);   // вердикта нет: путь проверяется сам
+        }
+        free(a);
+        a = next;
+    }
+}
+
+static void scan_verdict(struct parallel_scan *ps, struct scanner *sc, struct file_job *job,
+                         struct hit_list *hits, int ok, const unsigned char *digest) {
+    if (job->linked) {
+        struct dedup_key k;
+        dedup_key_inode(&k, &job->stamp);
+        scan_resolve(ps, sc, dedup_finish(&dedup, &k, hits, ok), hits, ok);
+    }
+
+    struct hit_msg *msg = !ps->dry_run && (hits->count > 0 || ok) ? calloc(1, sizeof(*msg)) : NULL;
+    if (msg) {
+        msg->kind = hits->count > 0 ? MSG_HIT : MSG_CLEAN;
+        msg->job = job;
+        msg->hits = *hits;
+        if (ok && digest) {
+            msg->has_digest = 1;
+            memcpy(msg->digest, digest, SHA256_DIGEST_LENGTH);
+        }
+        if (ps->direct) write_msg(ps, msg);
+        else bq_push(&ps->hits, msg);
+    } else {
+        hit_list_free(hits);
+        file_job_done(ps, job);
+    }
+}
+
+// Участок большого файла. Вердикт по файлу - после последнего участка, совпадения всех
+// участков сливаются без повторов.
+static void scan_shard(struct parallel_scan *ps, struct scanner *sc, struct file_job *job) {
+    struct shard_set *s = job->shard;
+    struct hit_list hits = { 0 };
+    int rc = -1;
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Ошибка открытия файла %s: %s\n", job->path, strerror(errno));
+        stat_add(CTR_OPEN_ERRORS, 1);
+    } else {
+        rc = scan_range(sc, ps->m, fd, job->begin, job->end, collect_hit, &hits);
+        if (rc < 0) fprintf(stderr, "Ошибка чтения файла %s: %s\n", job->path, strerror(errno));
+        gov_drop(fd, job->begin, job->end == UINT64_MAX ? UINT64_MAX : job->end - job->begin);
+        close(fd);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (rc < 0) s->failed = 1;
+    hit_list_append(&s->hits, &hits);
+    int last = --s->remaining == 0;
+    pthread_mutex_unlock(&s->lock);
+    hit_list_free(&hits);
+    free(job);
+    if (!last) return;
+
+    job = s->job;
+    hit_list_unique(&s->hits);
+    if (!s->failed) __atomic_fetch_add(&ps->bytes_scanned, (uint64_t)job->stamp.size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ps->files_scanned, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ps->hits_found, s->hits.count, __ATOMIC_RELAXED);
+    FILE_DONE(s->t0, job->stamp.size);
+    scan_verdict(ps, sc, job, &s->hits, !s->failed, NULL);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+// Проверка одного файла буфером sc. Содержимое, уже проверенное раньше или проверяемое
+// сейчас другим потоком, не ищется.
+static void scan_job(struct parallel_scan *ps, struct scanner *sc, struct file_job *job) {
+    if (job->shard) {
+        scan_shard(ps, sc, job);
+        return;
+    }
+
+    struct hit_list hits = { 0 };
+    gov_file();
+    PHASE_START(t);
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Ошибка открытия файла %s: %s\n", job->path, strerror(errno));
+        stat_add(CTR_OPEN_ERRORS, 1);
+        scan_verdict(ps, sc, job, &hits, 0, NULL);
+        return;
+    }
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct dedup_key k;
+    ssize_t hashed = -1;   // байт в SHA-256, если ключ содержимого занят этим файлом
+    if (ps->dedup && job->stamp.size >= DEDUP_MIN_SIZE) {
+        ssize_t n = content_digest(sc, ps->m, fd, job->stamp.size, digest);
+        if (n >= 0) {
+            dedup_key_content(&k, digest);
+            switch (dedup_claim(&dedup, &k, job, &hits)) {
+                case CLAIM_WAIT:
+                    gov_drop(fd, 0, UINT64_MAX);
+                    close(fd);
+                    return;
+                case CLAIM_DONE:
+                    gov_drop(fd, 0, UINT64_MAX);
+                    close(fd);
+                    scan_verdict(ps, sc, job, &hits, 1, NULL);
+                    return;
+                case CLAIM_SCAN:
+                    hashed = n;
+                    break;
+            }
+        }
+    }
+
+    int rc;
+    if (hashed >= 0 && hashed <= SCAN_CHUNK_SIZE) {
+        // Файл уже целиком в буфере после подсчёта хэша
+        PHASE_START(mt);
+        rc = matcher_scan(ps->m, sc->buffer, hashed, 0, collect_hit, &hits);
+        PHASE_STOP(PHASE_MATCH, mt);
+    } else {
+        rc = scan_fd_sized(sc, ps->m, fd, job->stamp.size, collect_hit, &hits);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Ошибка чтения файла %s: %s\n", job->path, strerror(errno));
+    } else {
+        __atomic_fetch_add(&ps->bytes_scanned, (uint64_t)job->stamp.size, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&ps->files_scanned, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ps->hits_found, hits.count, __ATOMIC_RELAXED);
+    FILE_DONE(t, job->stamp.size);
+    gov_drop(fd, 0, UINT64_MAX);
+    close(fd);
+
+    if (hashed >= 0) scan_resolve(ps, sc, dedup_finish(&dedup, &k, &hits, rc >= 0), &hits, rc >= 0);
+    scan_verdict(ps, sc, job, &hits, rc >= 0, hashed >= 0 ? digest : NULL);
+}
+
+// Поток поиска: берёт пути из очереди и проверяет файлы своим буфером
+static void *scan_worker(void *arg) {
+    struct parallel_scan *ps = arg;
+    struct scanner sc = { 0 };
+    struct file_job *job;
+
+    gov_thread();
+    while ((job = bq_pop(&ps->files)) != NULL) scan_job(ps, &sc, job);
+
+    scanner_free(&sc);
+    return NULL;
+}
+
+static void progress_checkpoint(struct parallel_scan *ps);
+
+// Поток записи: единственный, кто обращается к БД во время параллельной проверки
+static void *db_writer(void *arg) {
+    struct parallel_scan *ps = arg;
+    struct hit_msg *msg;
+
+    while ((msg = bq_pop(&ps->hits)) != NULL) {
+        write_msg(ps, msg);
+        if (ps->progress) progress_checkpoint(ps);
+    }
+    return NULL;
+}
+
+// Большой файл уходит в очередь участками, потоки поиска разбирают их параллельно.
+// Без памяти на участки файл проверяется целиком, как обычный.
+static void queue_shards(struct parallel_scan *ps, struct file_job *job) {
+    uint64_t size = job->stamp.size, length = shard_length(size, ps->workers);
+    unsigned n = (size + length - 1) / length, made = 0;
+    struct shard_set *s = calloc(1, sizeof(*s));
+    struct file_job **parts = calloc(n, sizeof(*parts));
+    while (s && parts && made < n && (parts[made] = malloc(sizeof(**parts))) != NULL) made++;
+    if (made < n) {
+        while (made) free(parts[--made]);
+        free(parts);
+        free(s);
+        bq_push(&ps->files, job);
+        return;
+    }
+
+    s->job = job;
+    s->remaining = n;
+    s->t0 = clock_ns();
+    pthread_mutex_init(&s->lock, NULL);
+    for (unsigned i = 0; i < n; i++) {
+        *parts[i] = (struct file_job){ .path = job->path, .stamp = job->stamp, .shard = s, .begin = i * length,
+                                       .end = i + 1 < n ? (i + 1) * length : UINT64_MAX };  // последний - до конца
+        bq_push(&ps->files, parts[i]);
+    }
+    free(parts);
+}
+
+static void queue_file(const char *path, const struct stat *st, void *ctx) {
+    struct parallel_scan *ps = ctx;
+    if (ps->progress && ps->direct) progress_checkpoint(ps);
+    if (!ps->dry_run && scan_state_unchanged(&scan_states, st)) return;
+
+    struct file_job *job = file_job_new(path, st);
+    if (!job) {
+        perror("Ошибка выделения памяти");
+        return;
+    }
+    job->seq = ps->jobs_queued++;
+
+    // Остальные жёсткие ссылки на inode ждут вердикта по первой
+    if (ps->dedup && st->st_nlink > 1) {
+        struct dedup_key k;
+        struct hit_list hits = { 0 };
+        dedup_key_inode(&k, &job->stamp);
+        switch (dedup_claim(&dedup, &k, job, &hits)) {
+            case CLAIM_WAIT:
+                return;
+            case CLAIM_DONE:
+                scan_verdict(ps, NULL, job, &hits, 1, NULL);
+                return;
+            case CLAIM_SCAN:
+                job->linked = 1;
+                break;
+        }
+    }
+
+    if (ps->direct) scan_job(ps, &default_scanner, job);
+    else if (shard_min_size && ps->workers > 1 && (uint64_t)st->st_size >= shard_min_size) queue_shards(ps, job);
+    else bq_push(&ps->files, job);
+}
+
+// Контрольная точка, если подошёл срок (вызывается только владельцем соединения с БД)
+static void progress_checkpoint(struct parallel_scan *ps) {
+    struct scan_progress *p = ps->progress;
+    uint64_t now = clock_ns();
+    if (now < p->next_at) return;
+    p->next_at = now + checkpoint_interval * 1000000000ull;
+
+    struct progress_point pt;
+    if (progress_take(p, &pt) != 0) return;     // каталоги дождутся следующей точки
+    pt.files = p->files + __atomic_load_n(&ps->files_scanned, __ATOMIC_RELAXED);
+    pt.bytes = p->bytes + __atomic_load_n(&ps->bytes_scanned, __ATOMIC_RELAXED);
+    pt.hits = p->hits + __atomic_load_n(&ps->hits_found, __ATOMIC_RELAXED);
+    progress_save(p->root, ps->generation, &pt);
+    progress_point_free(&pt);
+    p->saved++;
+}
+
+// Каталог, обойденный прерванной проверкой, пропускается
+static int progress_enter(const char *path, void *ctx) {
+    struct parallel_scan *ps = ctx;
+    if (!progress_skip(ps->progress, path)) return 0;
+    ps->progress->skipped++;
+    return 1;
+}
+
+// Выход из каталога: он войдёт в контрольную точку, когда все его пути получат вердикт
+static int progress_leave(const char *path, void *ctx) {
+    struct parallel_scan *ps = ctx;
+    progress_left(ps->progress, path, ps->jobs_queued);
+    if (ps->direct) progress_checkpoint(ps);
+    return 0;
+}
+
+// Обход для проверки: с контрольными точками, если они ведутся
+static void walk_check(const char *basePath, struct parallel_scan *ps) {
+    if (ps->progress) walk_tree(basePath, queue_file, progress_enter, progress_leave, ps, walk_symlinks, walk_xdev);
+    else listFilesRecursive(basePath, queue_file, ps);
+}
+
+// Параллельная проверка каталога. Возвращает 0 при успехе, счётчики остаются в ps.
+int parallel_check(struct parallel_scan *ps, const char *basePath, const struct matcher *m, int n_threads) {
+    pthread_t writer;
+    pthread_t *workers = calloc(n_threads, sizeof(pthread_t));
+    int started = 0;
+
+    ps->m = m;
+    ps->files_scanned = ps->bytes_scanned = ps->hits_found = 0;
+    ps->jobs_queued = 0;
+    if (!workers || bq_init(&ps->files, FILE_QUEUE_SIZE) != 0) {
+        free(workers);
+        return -1;
+    }
+    if (bq_init(&ps->hits, HIT_QUEUE_SIZE) != 0) {
+        bq_destroy(&ps->files);
+        free(workers);
+        return -1;
+    }
+
+    if (pthread_create(&writer, NULL, db_writer, ps) != 0) {
+        perror("Ошибка запуска потока записи");
+        bq_destroy(&ps->files);
+        bq_destroy(&ps->hits);
+        free(workers);
+        return -1;
+    }
+    for (; started < n_threads; started++) {
+        if (pthread_create(&workers[started], NULL, io_depth > 0 ? io_worker : scan_worker, ps) != 0) {
+            perror("Ошибка запуска потока поиска");
+            break;
+        }
+    }
+
+    // Обход идёт в текущем потоке, пока потоки поиска разбирают очередь
+    ps->workers = started;
+    if (started > 0) walk_check(basePath, ps);
+
+    bq_close(&ps->files);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    bq_close(&ps->hits);
+    pthread_join(writer, NULL);
+
+    // Пути, которые не успели разобрать, если потоки не запустились
+    struct file_job *left;
+    while ((left = bq_pop(&ps->files)) != NULL) free(left);
+
+    bq_destroy(&ps->files);
+    bq_destroy(&ps->hits);
+    free(workers);
+    return started > 0 ? 0 : -1;
+}
+
+int default_scan_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// Проверка startPath: однопоточный обход или параллельный с n_threads потоками.
+// resume - контрольная точка прерванной проверки этого каталога (NULL - новая проверка).
+static void check_run(const char *startPath, int n_threads, struct scan_progress *resume) {
+    matcher = matcher_prepare(db, matcher); // автомат по текущему набору сигнатур
+    if (!matcher || (matcher->n_patterns == 0 && matcher->n_masked == 0)) return;
+
+    if (n_threads <= 0) n_threads = scan_threads > 0 ? scan_threads : default_scan_threads();
+
+    // Файлы, не менявшиеся с прошлой чистой проверки, пропускаются
+    scan_states_load(&scan_states);
+    if (dedup_enabled) dedup_load(&dedup, scan_states.generation);
+    uint64_t links = counters[CTR_DEDUP_LINKS], copies = counters[CTR_DEDUP_COPIES];
+    uint64_t waits = counters[CTR_GOV_WAITS], backoffs = counters[CTR_GOV_BACKOFFS], waited = phase_ns[PHASE_THROTTLE];
+    db_batch_start();
+
+    // Продолжение возможно, только если с контрольной точки не добавлялось сигнатур
+    struct scan_progress fresh, *progress = resume;
+    scan_progress_init(&fresh);
+    if (resume && resume->generation != scan_states.generation) {
+        printf("Сигнатуры добавлялись после контрольной точки: проверка начинается заново\n");
+        progress = NULL;
+    }
+    if (!progress) {
+        progress = &fresh;
+        fresh.root = strdup(startPath);
+        progress_reset(checkpoint_interval > 0 ? startPath : NULL, scan_states.generation);
+    }
+    progress->next_at = checkpoint_interval > 0 ? clock_ns() + checkpoint_interval * 1000000000ull : UINT64_MAX;
+    gov_begin();
+
+    struct parallel_scan ps = { .dry_run = 0, .dedup = dedup_enabled, .generation = scan_states.generation };
+    if (progress->root && (checkpoint_interval > 0 || progress->n_skip)) ps.progress = progress;
+    if ((n_threads == 1 && io_depth == 0) || parallel_check(&ps, startPath, matcher, n_threads) != 0) {
+        if (n_threads != 1 || io_depth != 0) fprintf(stderr, "Ошибка параллельной проверки, выполняем однопоточную\n");
+        ps.m = matcher;
+        ps.direct = 1;                      // файл проверяется прямо во время обхода
+        walk_check(startPath, &ps);
+    } else {
+        printf("Проверено файлов: %llu (%d потоков)\n", (unsigned long long)ps.files_scanned, n_threads);
+        if (io_depth > 0) printf("Чтение: %s, глубина %d\n", io_backend_names[ps.io_backend_used], io_depth);
+    }
+
+    // Проверка дошла до конца: контрольная точка не нужна. Записи ScanState в пропущенных
+    // каталогах не встретились обходу, но удалять их нельзя.
+    gov_end();
+    if (progress->skipped == 0) purge_unseen_scan_states(&scan_states);
+    progress_reset(NULL, 0);
+    db_batch_end();
+    if (progress->skipped) {
+        printf("Пропущено каталогов, проверенных до прерывания: %llu\n", (unsigned long long)progress->skipped);
+    }
+    if (progress->saved) printf("Контрольных точек: %llu\n", (unsigned long long)progress->saved);
+    if (counters[CTR_GOV_WAITS] != waits || counters[CTR_GOV_BACKOFFS] != backoffs) {
+        printf("Ограничение нагрузки: пауз %llu (%.1f с), снижений скорости %llu\n",
+               (unsigned long long)(counters[CTR_GOV_WAITS] - waits), (phase_ns[PHASE_THROTTLE] - waited) / 1e9,
+               (unsigned long long)(counters[CTR_GOV_BACKOFFS] - backoffs));
+    }
+    printf("Пропущено неизменённых файлов: %llu\n", (unsigned long long)scan_states.skipped);
+    if (dedup_enabled) {
+        printf("Без повторной проверки: жёстких ссылок %llu, копий %llu\n",
+               (unsigned long long)(counters[CTR_DEDUP_LINKS] - links),
+               (unsigned long long)(counters[CTR_DEDUP_COPIES] - copies));
+    }
+    scan_states_free(&scan_states);
+    dedup_free(&dedup);
+    scan_progress_free(&fresh);
+    stats_export();
+}
+
+// Команда check: новая проверка startPath
+void check(const char *startPath, int n_threads) {
+    check_run(startPath, n_threads, NULL);
+}
+
+// Команда check resume: продолжение прерванной проверки с последней контрольной точки
+void check_resume(int n_threads) {
+    struct scan_progress p;
+    int rc = progress_load(&p);
+    if (rc == 0) printf("Прерванной проверки нет\n");
+    if (rc <= 0) return;
+
+    printf("Продолжение проверки %s: до прерывания проверено файлов %llu (%.1f МБ), совпадений %llu, "
+           "обойдено каталогов %zu\n", p.root, (unsigned long long)p.files, p.bytes / (1024.0 * 1024.0),
+           (unsigned long long)p.hits, p.n_skip);
+    check_run(p.root, n_threads, &p);
+    scan_progress_free(&p);
+}
+
+// ====================================== Асинхронное чтение ======================================
+// При io_depth > 0 поток поиска не ждёт каждое чтение: он держит в полёте до io_depth чтений и
+// открытий по нескольким файлам сразу и сопоставляет прочитанные блоки по мере готовности.
+// Блоки одного файла сопоставляются строго по порядку смещений: конец предыдущего блока
+// (max_len - 1 байт) копируется перед следующим, как в scan_fd.
+// - io_uring: кольцо на поток, открытие через IORING_OP_OPENAT, чтение в зарегистрированные
+//   буферы (IORING_OP_READ_FIXED; если регистрация не удалась - IORING_OP_READ).
+//   Системные вызовы напрямую, без liburing.
+// - Если io_uring недоступен (старое ядро, seccomp, io_uring_disabled), те же запросы выполняет
+//   пул потоков с open/pread.
+// Повторы по содержимому: файл из одного блока хэшируется до поиска, как в scan_job. Больший
+// хэшируется по ходу чтения, поэтому его копия просматривается, а вердикт и ContentVerdicts
+// общие - ожидание полного хэша перед чтением свело бы на нет чтение вперёд.
+#define IO_CHUNK_SIZE  (256 << 10)
+#define IO_FILE_READS  4            // чтений в полёте на один файл
+#define IO_POOL_MAX    64           // потоков пула на один поток поиска
+#define IO_DEPTH_MAX   1024
+
+void io_set(enum io_backend backend, int depth) {
+    io_backend = backend;
+    io_depth = depth < 0 ? 0 : depth > IO_DEPTH_MAX ? IO_DEPTH_MAX : depth;
+}
+
+// Буфер блока: перед данными место под перекрытие с предыдущим блоком
+struct io_buf {
+    unsigned char *data;        // pad байт перекрытия, затем IO_CHUNK_SIZE данных
+    struct io_file *file;
+    uint64_t offset;
+    ssize_t n;                  // результат чтения: байты или -errno
+    unsigned index;             // номер зарегистрированного буфера
+    struct io_buf *next;        // свободные или готовые блоки файла
+};
+
+// Файл в полёте. Запрос открытия отличается от чтения младшим битом указателя.
+struct io_file {
+    struct file_job *job;       // NULL - путь передан таблице повторов
+    int fd;                     // после открытия; < 0 - -errno
+    int reads;                  // чтений в полёте
+    int eof;                    // сопоставлено всё до конца файла (или ошибка)
+    int failed;
+    uint64_t read_off;          // следующее запрашиваемое смещение
+    uint64_t scan_off;          // следующее сопоставляемое смещение
+    struct io_buf *ready;       // прочитанные блоки, отсортированы по смещению
+    unsigned char *tail;        // конец сопоставленных данных для перекрытия
+    size_t tail_len;
+    struct hit_list hits;
+    EVP_MD_CTX *md;             // SHA-256 файла больше блока
+    int hashed;                 // ключ содержимого занят этим файлом
+    int verdict_done;           // вердикт взят из таблицы повторов
+    struct dedup_key key;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    uint64_t t0;
+    struct io_file *next;
+};
+
+// ----- io_uring -----
+struct io_ring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    unsigned pending;           // SQE, ещё не переданные ядру
+    int fixed;                  // буферы зарегистрированы
+};
+
+static void io_ring_free(struct io_ring *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_len);
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_ring_len);
+    if (r->fd >= 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static int io_ring_init(struct io_ring *r, unsigned entries) {
+    struct io_uring_params p = { 0 };
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len) r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = r->sq_ring_len;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                      IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        io_ring_free(r);
+        return -1;
+    }
+    r->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ring :
+                 mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                      IORING_OFF_CQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if (r->cq_ring == MAP_FAILED) r->cq_ring = NULL;
+        if (r->sqes == MAP_FAILED) r->sqes = NULL;
+        io_ring_free(r);
+        return -1;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static int io_ring_enter(struct io_ring *r, unsigned wait_nr) {
+    for (;;) {
+        int n = syscall(__NR_io_uring_enter, r->fd, r->pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                        NULL, 0);
+        if (n >= 0) {
+            r->pending -= (unsigned)n < r->pending ? (unsigned)n : r->pending;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+        if (errno != EINTR) wait_nr = 0;    // ядру не хватает ресурсов: сначала разобрать готовое
+        if (errno != EINTR && !wait_nr) return 0;
+    }
+}
+
+// Свободный SQE; заполненный уходит ядру при следующем io_ring_enter
+static struct io_uring_sqe *io_ring_sqe(struct io_ring *r) {
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+        if (io_ring_enter(r, 0) != 0) return NULL;
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) return NULL;
+    }
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void io_ring_push(struct io_ring *r) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+// ----- Движок чтения потока поиска -----
+struct io_engine {
+    enum io_backend backend;
+    unsigned depth;
+    size_t pad;                 // место под перекрытие, кратно 64
+    size_t slot;                // размер буфера блока
+    unsigned char *arena;
+    struct io_buf *bufs;
+    struct io_buf *free_bufs;
+    struct io_ring ring;
+    struct bounded_queue todo;  // запросы пулу
+    struct bounded_queue done;  // выполненные запросы
+    pthread_t *threads;
+    int n_threads;
+};
+
+static void *io_pool_thread(void *arg) {
+    struct io_engine *e = arg;
+    void *op;
+
+    gov_thread();
+    while ((op = bq_pop(&e->todo)) != NULL) {
+        if ((uintptr_t)op & 1) {
+            struct io_file *f = (void *)((uintptr_t)op & ~(uintptr_t)1);
+            f->fd = open(f->job->path, O_RDONLY | O_CLOEXEC);
+            if (f->fd < 0) f->fd = -errno;
+        } else {
+            struct io_buf *b = op;
+            do b->n = pread(b->file->fd, b->data + e->pad, IO_CHUNK_SIZE, b->offset);
+            while (b->n < 0 && errno == EINTR);
+            if (b->n < 0) b->n = -errno;
+        }
+        bq_push(&e->done, op);
+    }
+    return NULL;
+}
+
+static void io_engine_free(struct io_engine *e) {
+    if (e->threads) {
+        bq_close(&e->todo);
+        for (int i = 0; i < e->n_threads; i++) pthread_join(e->threads[i], NULL);
+        bq_destroy(&e->todo);
+        bq_destroy(&e->done);
+        free(e->threads);
+    }
+    if (e->ring.fd >= 0) io_ring_free(&e->ring);
+    if (e->arena) munmap(e->arena, e->slot * e->depth);
+    free(e->bufs);
+    memset(e, 0, sizeof(*e));
+}
+
+// Буферы и кольцо (или пул) на depth запросов. -1 - нет памяти.
+static int io_engine_init(struct io_engine *e, const struct matcher *m, unsigned depth, enum io_backend backend) {
+    memset(e, 0, sizeof(*e));
+    e->ring.fd = -1;
+    e->depth = depth;
+    e->pad = ((m->max_len ? m->max_len - 1 : 0) + 63) & ~(size_t)63;
+    e->slot = (e->pad + IO_CHUNK_SIZE + 4095) & ~(size_t)4095;
+    e->arena = mmap(NULL, e->slot * depth, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    e->bufs = calloc(depth, sizeof(*e->bufs));
+    if (e->arena == MAP_FAILED || !e->bufs) {
+        if (e->arena == MAP_FAILED) e->arena = NULL;
+        io_engine_free(e);
+        return -1;
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        e->bufs[i] = (struct io_buf){ .data = e->arena + i * e->slot, .index = i, .next = e->free_bufs };
+        e->free_bufs = &e->bufs[i];
+    }
+
+    // Открытия и чтения в полёте одновременно: до двух запросов на буфер
+    if (backend != IO_POOL && io_ring_init(&e->ring, depth * 2) == 0) {
+        struct iovec *iov = malloc(depth * sizeof(*iov));
+        for (unsigned i = 0; iov && i < depth; i++) iov[i] = (struct iovec){ e->bufs[i].data, e->slot };
+        e->ring.fixed = iov && syscall(__NR_io_uring_register, e->ring.fd, IORING_REGISTER_BUFFERS, iov, depth) == 0;
+        free(iov);
+        e->backend = IO_URING;
+        return 0;
+    }
+
+    int n = depth < IO_POOL_MAX ? depth : IO_POOL_MAX;
+    e->threads = calloc(n, sizeof(pthread_t));
+    if (!e->threads || bq_init(&e->todo, depth * 2 + 2) != 0) {
+        free(e->threads);
+        e->threads = NULL;
+        io_engine_free(e);
+        return -1;
+    }
+    if (bq_init(&e->done, depth * 2 + 2) != 0) {
+        bq_destroy(&e->todo);
+        free(e->threads);
+        e->threads = NULL;
+        io_engine_free(e);
+        return -1;
+    }
+    while (e->n_threads < n && pthread_create(&e->threads[e->n_threads], NULL, io_pool_thread, e) == 0) e->n_threads++;
+    e->backend = IO_POOL;
+    if (e->n_threads == 0) {
+        io_engine_free(e);
+        return -1;
+    }
+    return 0;
+}
+
+static void io_submit_open(struct io_engine *e, struct io_file *f) {
+    void *op = (void *)((uintptr_t)f | 1);
+    struct io_uring_sqe *sqe = e->backend == IO_URING ? io_ring_sqe(&e->ring) : NULL;
+    if (sqe) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)f->job->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = (uintptr_t)op;
+        io_ring_push(&e->ring);
+    } else if (e->backend == IO_URING) {
+        // Кольцо не принимает запрос: открываем сами, результат - как у выполненного открытия
+        f->fd = open(f->job->path, O_RDONLY | O_CLOEXEC);
+        if (f->fd < 0) f->fd = -errno;
+        f->reads = -1;      // отметка для io_wait: открытие уже выполнено
+    } else {
+        bq_push(&e->todo, op);
+    }
+}
+
+static void io_submit_read(struct io_engine *e, struct io_buf *b) {
+    struct io_uring_sqe *sqe = e->backend == IO_URING ? io_ring_sqe(&e->ring) : NULL;
+    if (sqe) {
+        sqe->opcode = e->ring.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = b->file->fd;
+        sqe->addr = (uintptr_t)(b->data + e->pad);
+        sqe->len = IO_CHUNK_SIZE;
+        sqe->off = b->offset;
+        sqe->buf_index = b->index;
+        sqe->user_data = (uintptr_t)b;
+        io_ring_push(&e->ring);
+    } else if (e->backend == IO_URING) {
+        do b->n = pread(b->file->fd, b->data + e->pad, IO_CHUNK_SIZE, b->offset);
+        while (b->n < 0 && errno == EINTR);
+        if (b->n < 0) b->n = -errno;
+        b->index |= 1u << 31;   // отметка для io_wait: чтение уже выполнено
+    } else {
+        bq_push(&e->todo, b);
+    }
+}
+
+// Следующий выполненный запрос. Запросы, которые кольцо не приняло, выполнены сразу
+// и отдаются первыми через список sync.
+static void *io_wait(struct io_engine *e, void **sync, size_t *n_sync) {
+    if (*n_sync) return sync[--*n_sync];
+    if (e->backend == IO_POOL) return bq_pop(&e->done);
+
+    struct io_ring *r = &e->ring;
+    for (;;) {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            void *op = (void *)(uintptr_t)cqe->user_data;
+            if ((uintptr_t)op & 1) ((struct io_file *)((uintptr_t)op & ~(uintptr_t)1))->fd = cqe->res;
+            else ((struct io_buf *)op)->n = cqe->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return op;
+        }
+        if (io_ring_enter(r, 1) != 0) return NULL;
+    }
+}
+
+// ----- Поток поиска с асинхронным чтением -----
+static void io_release(struct io_engine *e, struct io_buf *b) {
+    b->file = NULL;
+    b->index &= ~(1u << 31);
+    b->next = e->free_bufs;
+    e->free_bufs = b;
+}
+
+// Новые чтения файла: до IO_FILE_READS вперёд по ожидаемому размеру; за его пределами
+// (файл вырос) - по одному блоку, пока не встретится конец файла
+static void io_issue(struct io_engine *e, struct io_file *f, void **sync, size_t *n_sync) {
+    if (f->fd < 0 || f->eof) return;
+    while (e->free_bufs && f->reads < IO_FILE_READS &&
+           (f->read_off < f->job->stamp.size || (f->reads == 0 && !f->ready && f->read_off == f->scan_off))) {
+        struct io_buf *b = e->free_bufs;
+        e->free_bufs = b->next;
+        b->file = f;
+        b->offset = f->read_off;
+        b->next = NULL;
+        f->read_off += IO_CHUNK_SIZE;
+        f->reads++;
+        io_submit_read(e, b);
+        if (b->index >> 31) sync[(*n_sync)++] = b;
+    }
+}
+
+// Сопоставление очередного по порядку блока файла
+static void io_match(struct parallel_scan *ps, struct io_engine *e, struct io_file *f, struct io_buf *b) {
+    unsigned char *data = b->data + e->pad;
+    size_t n = b->n;
+
+    // Весь файл в одном блоке: сначала поиск повторов по содержимому, как в scan_job
+    int dedup_size = ps->dedup && f->job->stamp.size >= DEDUP_MIN_SIZE;
+    if (dedup_size && b->offset == 0 && n < IO_CHUNK_SIZE) {
+        PHASE_START(ht);
+        int ok = EVP_Digest(data, n, f->digest, NULL, EVP_sha256(), NULL) == 1;
+        PHASE_STOP(PHASE_HASH, ht);
+        if (ok) {
+            dedup_key_content(&f->key, f->digest);
+            switch (dedup_claim(&dedup, &f->key, f->job, &f->hits)) {
+                case CLAIM_WAIT:
+                    f->job = NULL;
+                    f->eof = 1;
+                    return;
+                case CLAIM_DONE:
+                    f->verdict_done = 1;
+                    f->eof = 1;
+                    return;
+                case CLAIM_SCAN:
+                    f->hashed = 1;
+                    break;
+            }
+        }
+    } else if (dedup_size) {
+        // Большой файл: хэш считается по ходу, повтор проверяется в конце
+        if (b->offset == 0 && (f->md = EVP_MD_CTX_new()) && EVP_DigestInit_ex(f->md, EVP_sha256(), NULL) != 1) {
+            EVP_MD_CTX_free(f->md);
+            f->md = NULL;
+        }
+        PHASE_START(ht);
+        if (f->md && EVP_DigestUpdate(f->md, data, n) != 1) {
+            EVP_MD_CTX_free(f->md);
+            f->md = NULL;
+        }
+        PHASE_STOP(PHASE_HASH, ht);
+    }
+
+    // Перед блоком - конец предыдущего, совпадения целиком из него отсекает фильтр
+    unsigned char *start = data - f->tail_len;
+    if (f->tail_len) memcpy(start, f->tail, f->tail_len);
+    struct chunk_filter filter = { collect_hit, &f->hits, b->offset, UINT64_MAX };
+    PHASE_START(mt);
+    int stop = matcher_scan(ps->m, start, f->tail_len + n, b->offset - f->tail_len, chunk_filter_hit, &filter);
+    PHASE_STOP(PHASE_MATCH, mt);
+    if (stop || n < IO_CHUNK_SIZE) {
+        f->eof = 1;
+        return;
+    }
+
+    size_t overlap = ps->m->max_len ? ps->m->max_len - 1 : 0, total = f->tail_len + n;
+    size_t keep = total < overlap ? total : overlap;
+    if (keep && !f->tail && !(f->tail = malloc(overlap))) {
+        f->failed = f->eof = 1;
+        return;
+    }
+    memcpy(f->tail, start + total - keep, keep);
+    f->tail_len = keep;
+}
+
+// Прочитанный блок встаёт в очередь файла; готовые по порядку блоки сопоставляются
+static void io_advance(struct parallel_scan *ps, struct io_engine *e, struct io_file *f, struct io_buf *b) {
+    struct io_buf **p = &f->ready;
+    while (*p && (*p)->offset < b->offset) p = &(*p)->next;
+    b->next = *p;
+    *p = b;
+
+    while (f->ready && !f->eof && f->ready->offset == f->scan_off) {
+        b = f->ready;
+        f->ready = b->next;
+        if (b->n < 0) {
+            fprintf(stderr, "Ошибка чтения файла %s: %s\n", f->job->path, strerror(-b->n));
+            stat_add(CTR_READ_ERRORS, 1);
+            f->failed = f->eof = 1;
+        } else {
+            stat_add(CTR_BYTES_READ, b->n);
+            gov_read(b->n);
+            io_match(ps, e, f, b);
+            f->scan_off += b->n;
+        }
+        io_release(e, b);
+    }
+
+    // Блоки за концом файла больше не нужны
+    while (f->eof && f->ready) {
+        b = f->ready;
+        f->ready = b->next;
+        io_release(e, b);
+    }
+}
+
+// Все чтения файла завершены: вердикт, как в scan_job
+static void io_finish(struct parallel_scan *ps, struct scanner *sc, struct io_file *f) {
+    if (f->fd >= 0) {
+        gov_drop(f->fd, 0, UINT64_MAX);
+        close(f->fd);
+    }
+    free(f->tail);
+    struct file_job *job = f->job;
+    int ok = !f->failed;
+
+    if (job && !f->verdict_done) {
+        if (ok) __atomic_fetch_add(&ps->bytes_scanned, (uint64_t)job->stamp.size, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ps->files_scanned, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ps->hits_found, f->hits.count, __ATOMIC_RELAXED);
+        FILE_DONE(f->t0, job->stamp.size);
+    }
+
+    // Большой файл уже просмотрен; ключ содержимого нужен остальным копиям и ContentVerdicts
+    if (job && f->md && ok && EVP_DigestFinal_ex(f->md, f->digest, NULL) == 1) {
+        struct hit_list known = { 0 };
+        dedup_key_content(&f->key, f->digest);
+        switch (dedup_claim(&dedup, &f->key, job, &known)) {
+            case CLAIM_WAIT:
+                job = NULL;             // путь получит вердикт проверяемой сейчас копии
+                break;
+            case CLAIM_DONE:
+                hit_list_free(&known);
+                break;
+            case CLAIM_SCAN:
+                f->hashed = 1;
+                break;
+        }
+    }
+    EVP_MD_CTX_free(f->md);
+
+    if (!job) {
+        hit_list_free(&f->hits);
+    } else if (f->verdict_done) {
+        scan_verdict(ps, sc, job, &f->hits, 1, NULL);
+    } else {
+        if (f->hashed) scan_resolve(ps, sc, dedup_finish(&dedup, &f->key, &f->hits, ok), &f->hits, ok);
+        scan_verdict(ps, sc, job, &f->hits, ok, f->hashed ? f->digest : NULL);
+    }
+    free(f);
+}
+
+// Поток поиска при io_depth > 0: файлы из очереди открываются и читаются асинхронно
+static void *io_worker(void *arg) {
+    struct parallel_scan *ps = arg;
+    struct scanner sc = { 0 };
+    struct io_engine e;
+    unsigned depth = io_depth > 0 ? io_depth : 1;
+
+    gov_thread();
+    if (io_engine_init(&e, ps->m, depth, io_backend) != 0) {
+        perror("Ошибка подготовки асинхронного чтения");
+        return scan_worker(arg);
+    }
+    __atomic_store_n(&ps->io_backend_used, e.backend, __ATOMIC_RELAXED);
+
+    void *sync[2 * depth];      // запросы, выполненные без кольца
+    size_t n_sync = 0;
+    struct io_file *active = NULL;
+    unsigned n_active = 0;
+    int closed = 0;
+
+    for (;;) {
+        // Новые файлы, пока есть место: без ожидания, если уже есть чем заняться
+        while (!closed && n_active < depth) {
+            struct file_job *job = n_active ? bq_try_pop(&ps->files) : bq_pop(&ps->files);
+            if (!job) {
+                closed = !n_active;
+                break;
+            }
+            struct io_file *f = job->shard ? NULL : calloc(1, sizeof(*f));
+            if (!f) {               // участок большого файла (или нет памяти): обычное чтение
+                scan_job(ps, &sc, job);
+                continue;
+            }
+            gov_file();
+            f->job = job;
+            f->fd = -1;
+            f->t0 = clock_ns();
+            f->next = active;
+            active = f;
+            n_active++;
+            io_submit_open(&e, f);
+            if (f->reads < 0) {
+                f->reads = 0;
+                sync[n_sync++] = (void *)((uintptr_t)f | 1);
+            }
+        }
+        if (n_active == 0) break;
+
+        if (e.backend == IO_URING && e.ring.pending && io_ring_enter(&e.ring, 0) != 0) {
+            perror("Ошибка io_uring_enter");
+        }
+        PHASE_START(wt);
+        void *op = io_wait(&e, sync, &n_sync);
+        PHASE_STOP(PHASE_READ, wt);
+        if (!op) {
+            perror("Ошибка ожидания чтения");
+            break;
+        }
+
+        struct io_file *f;
+        if ((uintptr_t)op & 1) {
+            f = (void *)((uintptr_t)op & ~(uintptr_t)1);
+            if (f->fd < 0) {
+                fprintf(stderr, "Ошибка открытия файла %s: %s\n", f->job->path, strerror(-f->fd));
+                stat_add(CTR_OPEN_ERRORS, 1);
+                f->failed = f->eof = 1;
+            }
+        } else {
+            struct io_buf *b = op;
+            f = b->file;
+            f->reads--;
+            io_advance(ps, &e, f, b);
+        }
+
+        if (f->eof && f->reads == 0) {
+            for (struct io_file **p = &active; *p; p = &(*p)->next) {
+                if (*p == f) {
+                    *p = f->next;
+                    break;
+                }
+            }
+            n_active--;
+            io_finish(ps, &sc, f);
+        }
+        for (struct io_file *a = active; a; a = a->next) io_issue(&e, a, sync, &n_sync);
+    }
+
+    // Ошибка кольца: оставшиеся файлы проверяются обычным чтением после закрытия кольца
+    io_engine_free(&e);
+    while (active) {
+        struct io_file *f = active;
+        active = f->next;
+        if (f->fd >= 0) close(f->fd);
+        hit_list_free(&f->hits);
+        EVP_MD_CTX_free(f->md);
+        free(f->tail);
+        if (f->hashed) scan_resolve(ps, &sc, dedup_finish(&dedup, &f->key, &f->hits, 0), &f->hits, 0);
+        if (f->job) scan_job(ps, &sc, f->job);
+        free(f);
+    }
+    struct file_job *job;
+    while (!closed && (job = bq_pop(&ps->files)) != NULL) scan_job(ps, &sc, job);
+
+    scanner_free(&sc);
+    return NULL;
+}
+
+// ====================================== Наблюдение за изменениями ======================================
+// Команда watch проверяет файлы дерева сразу после изменения, не обходя всё дерево.
+// Отметка ставится на каждый каталог: fanotify с FAN_REPORT_DFID_NAME (событие несёт дескриптор
+// каталога и имя файла), а если ядро, права или файловая система этого не позволяют - inotify.
+// Новые и переименованные в дерево каталоги отмечаются по событию, их файлы ставятся в очередь.
+// Закрытие после записи и переименование в дерево кладут путь в очередь с задержкой: повторное
+// событие по тому же пути сдвигает срок проверки, но не дальше WATCH_MAX_DELAY_MS от первого,
+// так что файл, который пишут несколькими заходами, проверяется один раз.
+#define WATCH_DEBOUNCE_MS  50
+#define WATCH_MAX_DELAY_MS 1000
+#define WATCH_EVENT_BUF    (64 * 1024)
+#define WATCH_KEY_MAX      (sizeof(fsid_t) + sizeof(int) + MAX_HANDLE_SZ)
+
+#define WATCH_FAN_MASK (FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_CREATE | FAN_ONDIR | FAN_EVENT_ON_CHILD)
+#define WATCH_IN_MASK  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+enum watch_backend { WATCH_AUTO, WATCH_FANOTIFY, WATCH_INOTIFY };
+
+static const char *watch_backend_names[] = { "auto", "fanotify", "inotify" };
+
+int watch_debounce_ms = WATCH_DEBOUNCE_MS;
+int watch_active;               // отметки расставлены, события принимаются
+
+// ----- Таблица по ключу -----
+// Открытая адресация с удалением сдвигом. Каталоги: ключ события (номер наблюдения inotify или
+// fsid + дескриптор файла каталога для fanotify) -> путь. Очередь: путь -> сроки проверки.
+struct watch_slot {
+    unsigned char *key;         // NULL - слот свободен; для очереди это и есть путь
+    uint32_t key_len;
+    uint64_t hash;
+    char *path;                 // путь каталога
+    uint64_t first;             // время первого события, нс
+    uint64_t due;               // срок проверки, нс
+};
+
+struct watch_map {
+    struct watch_slot *slots;
+    size_t capacity;            // степень двойки
+    size_t count;
+};
+
+static uint64_t watch_hash(const void *key, size_t len) {
+    const unsigned char *p = key;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static struct watch_slot *watch_map_find(struct watch_map *m, const void *key, uint32_t len) {
+    if (m->capacity == 0) return NULL;
+
+    uint64_t h = watch_hash(key, len);
+    for (size_t i = h & (m->capacity - 1); m->slots[i].key; i = (i + 1) & (m->capacity - 1)) {
+        struct watch_slot *s = &m->slots[i];
+        if (s->hash == h && s->key_len == len && memcmp(s->key, key, len) == 0) return s;
+    }
+    return NULL;
+}
+
+static int watch_map_grow(struct watch_map *m) {
+    size_t capacity = m->capacity ? m->capacity * 2 : 64;
+    struct watch_slot *slots = calloc(capacity, sizeof(*slots));
+    if (!slots) return -1;
+
+    for (size_t i = 0; i < m->capacity; i++) {
+        if (!m->slots[i].key) continue;
+        size_t j = m->slots[i].hash & (capacity - 1);
+        while (slots[j].key) j = (j + 1) & (capacity - 1);
+        slots[j] = m->slots[i];
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->capacity = capacity;
+    return 0;
+}
+
+// Слот для ключа: существующий или новый с копией ключа (с нулём в конце)
+static struct watch_slot *watch_map_add(struct watch_map *m, const void *key, uint32_t len) {
+    struct watch_slot *s = watch_map_find(m, key, len);
+    if (s) return s;
+    if ((m->count + 1) * 2 > m->capacity && watch_map_grow(m) != 0) return NULL;
+
+    uint64_t h = watch_hash(key, len);
+    size_t i = h & (m->capacity - 1);
+    while (m->slots[i].key) i = (i + 1) & (m->capacity - 1);
+
+    s = &m->slots[i];
+    s->key = malloc(len + 1);
+    if (!s->key) return NULL;
+    memcpy(s->key, key, len);
+    s->key[len] = '\0';
+    s->key_len = len;
+    s->hash = h;
+    s->path = NULL;
+    m->count++;
+    return s;
+}
+
+static void watch_map_remove(struct watch_map *m, struct watch_slot *s) {
+    size_t mask = m->capacity - 1, i = s - m->slots, j = i;
+    free(s->key);
+    free(s->path);
+
+    // Следующие за дырой слоты сдвигаются назад, если их место в цепочке не дальше дыры
+    for (;;) {
+        m->slots[i].key = NULL;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (!m->slots[j].key) {
+                m->count--;
+                return;
+            }
+            size_t k = m->slots[j].hash & mask;
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+            break;
+        }
+        m->slots[i] = m->slots[j];
+        i = j;
+    }
+}
+
+static void watch_map_free(struct watch_map *m) {
+    for (size_t i = 0; i < m->capacity; i++) {
+        if (!m->slots[i].key) continue;
+        free(m->slots[i].key);
+        free(m->slots[i].path);
+    }
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+// ----- Наблюдатель -----
+// Пути ждут проверки в кольцевой очереди в порядке первого события. Срок элемента из очереди
+// сверяется со сроком в таблице: если его сдвинули, путь возвращается в конец очереди.
+struct watch_item {
+    const char *path;           // ключ слота в таблице pending
+    uint64_t due;
+};
+
+struct watcher {
+    enum watch_backend backend;
+    int fd;
+    struct watch_map dirs;
+    struct watch_map pending;
+    struct watch_item *queue;
+    size_t head, count, capacity;
+    const char *root;
+    uint64_t scanned, infected;
+};
+
+static int watch_queue_push(struct watcher *w, const char *path, uint64_t due) {
+    if (w->count == w->capacity) {
+        size_t capacity = w->capacity ? w->capacity * 2 : 256;
+        struct watch_item *q = malloc(capacity * sizeof(*q));
+        if (!q) return -1;
+        for (size_t i = 0; i < w->count; i++) q[i] = w->queue[(w->head + i) % w->capacity];
+        free(w->queue);
+        w->queue = q;
+        w->capacity = capacity;
+        w->head = 0;
+    }
+    w->queue[(w->head + w->count++) % w->capacity] = (struct watch_item){ path, due };
+    return 0;
+}
+
+static void watch_enqueue(struct watcher *w, const char *path) {
+    uint64_t now = clock_ns(), delay = (uint64_t)watch_debounce_ms * 1000000;
+    uint32_t len = strlen(path);
+
+    struct watch_slot *s = watch_map_find(&w->pending, path, len);
+    if (s) {
+        uint64_t limit = s->first + (uint64_t)WATCH_MAX_DELAY_MS * 1000000;
+        s->due = now + delay < limit ? now + delay : limit;
+        stat_add(CTR_WATCH_COALESCED, 1);
+        return;
+    }
+
+    s = watch_map_add(&w->pending, path, len);
+    if (!s || watch_queue_push(w, (const char *)s->key, now + delay) != 0) {
+        if (s) watch_map_remove(&w->pending, s);
+        perror("Ошибка выделения памяти");
+        return;
+    }
+    s->first = now;
+    s->due = now + delay;
+}
+
+// Ключ fanotify: fsid файловой системы, тип и байты дескриптора файла
+static uint32_t watch_fid_key(unsigned char *key, const void *fsid, const struct file_handle *fh) {
+    uint32_t n = fh->handle_bytes > MAX_HANDLE_SZ ? MAX_HANDLE_SZ : fh->handle_bytes;
+    memcpy(key, fsid, sizeof(fsid_t));
+    memcpy(key + sizeof(fsid_t), &fh->handle_type, sizeof(int));
+    memcpy(key + sizeof(fsid_t) + sizeof(int), fh->f_handle, n);
+    return sizeof(fsid_t) + sizeof(int) + n;
+}
+
+static int watch_add_dir(struct watcher *w, const char *path) {
+    unsigned char key[WATCH_KEY_MAX];
+    uint32_t key_len;
+
+    if (w->backend == WATCH_FANOTIFY) {
+        struct {
+            struct file_handle fh;
+            unsigned char bytes[MAX_HANDLE_SZ];
+        } h;
+        struct statfs sfs;
+        int mount_id;
+
+        h.fh.handle_bytes = MAX_HANDLE_SZ;
+        if (fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_ONLYDIR, WATCH_FAN_MASK, AT_FDCWD, path) != 0 ||
+            name_to_handle_at(AT_FDCWD, path, &h.fh, &mount_id, 0) != 0 || statfs(path, &sfs) != 0) {
+            return -1;
+        }
+        key_len = watch_fid_key(key, &sfs.f_fsid, &h.fh);
+    } else {
+        int wd = inotify_add_watch(w->fd, path, WATCH_IN_MASK);
+        if (wd < 0) return -1;
+        memcpy(key, &wd, sizeof(wd));
+        key_len = sizeof(wd);
+    }
+
+    // Повторная отметка (каталог переименован внутри дерева) обновляет путь
+    struct watch_slot *s = watch_map_add(&w->dirs, key, key_len);
+    char *copy = strdup(path);
+    if (!s || !copy) {
+        free(copy);
+        errno = ENOMEM;
+        return -1;
+    }
+    free(s->path);
+    s->path = copy;
+    return 0;
+}
+
+// Отметка каталога и всех вложенных. Символические ссылки не разыменовываются, чтобы не
+// выйти за пределы дерева. enqueue - поставить найденные файлы в очередь (новый каталог мог
+// наполниться до того, как на нём появилась отметка).
+static int watch_mark_dir(const char *path, void *ctx) {
+    struct watcher *w = ctx;
+    if (watch_add_dir(w, path) == 0) return 0;
+
+    fprintf(stderr, "Не удалось наблюдать за %s: %s\n", path, strerror(errno));
+    if (errno == ENOSPC) {
+        fprintf(stderr, "Превышен лимит отметок (fs.inotify.max_user_watches / fs.fanotify.max_user_marks)\n");
+    }
+    return -1;
+}
+
+static void watch_mark_file(const char *path, const struct stat *st, void *ctx) {
+    watch_enqueue(ctx, path);
+}
+
+static int watch_add_tree(struct watcher *w, const char *basePath, int enqueue) {
+    if (watch_mark_dir(basePath, w) != 0) return -1;
+    walk_tree(basePath, enqueue ? watch_mark_file : NULL, watch_mark_dir, NULL, w, WALK_SYMLINKS_SKIP, 0);
+    return 0;
+}
+
+// Очередь переполнилась в ядре: часть событий потеряна, в очередь ставится всё дерево.
+// Неизменённые с прошлой проверки файлы отсеет ScanState.
+static void watch_overflow(struct watcher *w) {
+    fprintf(stderr, "Очередь событий переполнена, проверяем всё дерево %s\n", w->root);
+    watch_add_tree(w, w->root, 1);
+}
+
+// Событие name в отмеченном каталоге
+static void watch_event(struct watcher *w, const struct watch_slot *dir, const char *name, int is_dir, int created) {
+    char path[1024];
+    if (!dir || strcmp(name, ".") == 0) return;
+    snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+
+    stat_add(CTR_WATCH_EVENTS, 1);
+    if (is_dir) watch_add_tree(w, path, 1);
+    else if (!created) watch_enqueue(w, path);
+}
+
+// Записи fanotify выровнены только по 4 байтам, а в заголовке есть 64-битная маска:
+// заголовок копируется, остальные поля (fsid, file_handle) 4-байтовые
+static void watch_read_fanotify(struct watcher *w, char *buf, ssize_t len) {
+    struct fanotify_event_metadata md;
+
+    for (char *p = buf; buf + len - p >= (ssize_t)sizeof(md); p += md.event_len) {
+        memcpy(&md, p, sizeof(md));
+        if (md.event_len < sizeof(md) || md.event_len > buf + len - p) return;
+        if (md.vers != FANOTIFY_METADATA_VERSION) {
+            fprintf(stderr, "Неизвестная версия событий fanotify: %d\n", md.vers);
+            return;
+        }
+        if (md.mask & FAN_Q_OVERFLOW) {
+            watch_overflow(w);
+            continue;
+        }
+
+        struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(p + md.metadata_len);
+        if ((char *)(fid + 1) > p + md.event_len || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+            continue;
+        }
+
+        struct file_handle *fh = (struct file_handle *)fid->handle;
+        unsigned char key[WATCH_KEY_MAX];
+        uint32_t key_len = watch_fid_key(key, &fid->fsid, fh);
+        const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+
+        watch_event(w, watch_map_find(&w->dirs, key, key_len), name, (md.mask & FAN_ONDIR) != 0,
+                    (md.mask & (FAN_CREATE | FAN_MOVED_TO | FAN_CLOSE_WRITE)) == FAN_CREATE);
+    }
+}
+
+static void watch_read_inotify(struct watcher *w, char *buf, ssize_t len) {
+    for (char *p = buf; p < buf + len; ) {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        p += sizeof(*ev) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            watch_overflow(w);
+            continue;
+        }
+
+        struct watch_slot *dir = watch_map_find(&w->dirs, &ev->wd, sizeof(ev->wd));
+        if (ev->mask & IN_IGNORED) {
+            if (dir) watch_map_remove(&w->dirs, dir);  // каталог удалён
+            continue;
+        }
+        if (ev->len == 0) continue;
+
+        watch_event(w, dir, ev->name, (ev->mask & IN_ISDIR) != 0, (ev->mask & IN_CREATE) != 0);
+    }
+}
+
+// Чтение всех накопившихся событий (дескриптор неблокирующий)
+static void watch_read(struct watcher *w) {
+    static char buf[WATCH_EVENT_BUF] __attribute__((aligned(8)));
+
+    for (;;) {
+        ssize_t len = read(w->fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) perror("Ошибка чтения событий");
+            return;
+        }
+        if (len == 0) return;
+
+        if (w->backend == WATCH_FANOTIFY) watch_read_fanotify(w, buf, len);
+        else watch_read_inotify(w, buf, len);
+    }
+}
+
+// Проверка файла из очереди; first - время первого события по нему
+static void watch_scan(struct watcher *w, const char *path, uint64_t first) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return;  // удалён или заменён до срока
+    if (scan_state_unchanged(&scan_states, &st)) return;       // закрыт без изменений
+
+    PHASE_START(t);
+    int rc = search_signatures_in_file(path);
+    if (rc == 0) {
+        struct file_stamp fs;
+        stamp_from_stat(&fs, &st);
+        save_scan_state(&fs, scan_states.generation);
+    }
+    FILE_DONE(t, st.st_size);
+    hist_observe(HIST_WATCH_LATENCY, clock_ns() - first);
+
+    w->scanned++;
+    if (rc > 0) w->infected++;
+}
+
+// Проверка путей, срок которых наступил (all - всех ожидающих).
+// Возвращает число проверенных путей.
+static size_t watch_drain(struct watcher *w, int all) {
+    uint64_t now = clock_ns();
+    size_t done = 0;
+
+    if (w->count == 0) return 0;
+    if (!all && w->queue[w->head].due > now) return 0;
+    matcher = matcher_prepare(db, matcher);     // набор сигнатур мог обновиться
+
+    while (w->count > 0) {
+        struct watch_item it = w->queue[w->head];
+        if (!all && it.due > now) break;
+        w->head = (w->head + 1) % w->capacity;
+        w->count--;
+
+        struct watch_slot *s = watch_map_find(&w->pending, it.path, strlen(it.path));
+        if (!s) continue;
+        if (!all && s->due > now) {
+            watch_queue_push(w, it.path, s->due);   // события продолжались
+            continue;
+        }
+
+        uint64_t first = s->first;
+        if (matcher) watch_scan(w, it.path, first);
+        watch_map_remove(&w->pending, s);
+        done++;
+    }
+    return done;
+}
+
+// Миллисекунды до ближайшего срока (-1 - очередь пуста)
+static int watch_timeout(const struct watcher *w) {
+    if (w->count == 0) return -1;
+
+    uint64_t now = clock_ns(), due = w->queue[w->head].due;
+    return due <= now ? 0 : (int)((due - now + 999999) / 1000000);
+}
+
+static int watch_open(struct watcher *w, const char *root, enum watch_backend backend) {
+    w->root = root;
+    w->fd = -1;
+
+    if (backend != WATCH_INOTIFY) {
+        w->backend = WATCH_FANOTIFY;
+        w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY);
+        if (w->fd >= 0 && watch_add_tree(w, root, 0) == 0) return 0;
+
+        if (w->fd < 0) fprintf(stderr, "fanotify недоступен: %s\n", strerror(errno));
+        if (backend == WATCH_FANOTIFY) return -1;
+        if (w->fd >= 0) close(w->fd);
+        watch_map_free(&w->dirs);
+        printf("Переходим на inotify\n");
+    }
+
+    w->backend = WATCH_INOTIFY;
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0) {
+        perror("Ошибка inotify_init1");
+        return -1;
+    }
+    return watch_add_tree(w, root, 0);
+}
+
+static void watch_close(struct watcher *w) {
+    if (w->fd >= 0) close(w->fd);
+    watch_map_free(&w->dirs);
+    watch_map_free(&w->pending);
+    free(w->queue);
+    memset(w, 0, sizeof(*w));
+}
+
+// Команда watch: наблюдение за деревом root до ввода в stop_fd (Enter в консоли).
+// Ожидающие проверки файлы проверяются перед выходом.
+int watch_run(const char *root, enum watch_backend backend, int stop_fd) {
+    matcher = matcher_prepare(db, matcher);
+    if (!matcher || (matcher->n_patterns == 0 && matcher->n_masked == 0)) return -1;
+
+    struct watcher w = { 0 };
+    if (watch_open(&w, root, backend) != 0) {
+        watch_close(&w);
+        return -1;
+    }
+
+    scan_states_load(&scan_states);
+    db_batch_start();
+    gov_begin();
+    printf("Наблюдение за %s (%s, каталогов %zu), Enter - остановить\n", root,
+           watch_backend_names[w.backend], w.dirs.count);
+    __atomic_store_n(&watch_active, 1, __ATOMIC_RELEASE);
+
+    struct pollfd fds[2] = { { w.fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+    for (;;) {
+        int n = poll(fds, 2, watch_timeout(&w));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Ошибка poll");
+            break;
+        }
+        if (fds[1].revents) break;
+        if (fds[0].revents & POLLIN) watch_read(&w);
+
+        // Вердикты сразу видны другим соединениям с БД
+        if (watch_drain(&w, 0) > 0) db_batch_commit();
+    }
+
+    __atomic_store_n(&watch_active, 0, __ATOMIC_RELEASE);
+    watch_drain(&w, 1);
+    gov_end();
+    db_batch_end();
+    printf("Проверено изменённых файлов: %llu, с сигнатурами: %llu\n", (unsigned long long)w.scanned,
+           (unsigned long long)w.infected);
+
+    watch_close(&w);
+    scan_states_free(&scan_states);
+    stats_export();
+    return 0;
+}
+
+// ====================================== Служба на UNIX-сокете ======================================
+// Команда daemon держит собранный автомат и соединение с БД и принимает запросы на проверку
+// по локальному сокету, без запуска процесса на каждый файл. Протокол строковый, по запросу
+// на строку; ответы идут в порядке запросов, поэтому клиент может отправить несколько
+// запросов подряд, не дожидаясь ответов:
+//   SCAN <путь>   - проверить файл по пути (путь - остаток строки, до перевода строки)
+//   FD            - проверить файл, дескриптор которого передан в том же sendmsg (SCM_RIGHTS)
+//   RELOAD        - пересобрать автомат, если набор сигнатур изменился
+//   PING
+// Ответы:
+//   CLEAN
+//   FOUND <n> <сигнатура>:<смещение>:<длина> ...   - первые DAEMON_REPORT_HITS по смещению
+//   OK <число сигнатур> | PONG | ERROR <причина>
+// Каждый клиент обслуживается своим потоком со своим буфером чтения; автомат общий, RELOAD
+// заменяет его под блокировкой записи. Сокет создаётся с правами 0600.
+#define DAEMON_SOCKET       "antivir.sock"  // по умолчанию - рядом с antivir.db
+#define DAEMON_LINE_MAX     8192
+#define DAEMON_MAX_FDS      16              // дескрипторов в одном сообщении
+#define DAEMON_MAX_CLIENTS  256
+#define DAEMON_REPORT_HITS  64
+#define DAEMON_OUT_FLUSH    (64 << 10)      // ответы копятся до конца пачки запросов или этого размера
+
+struct daemon_client {
+    int fd;
+    struct daemon_client *next;
+    struct scanner sc;
+    char in[DAEMON_LINE_MAX];
+    size_t in_len;
+    int fds[DAEMON_MAX_FDS];    // принятые, но ещё не использованные дескрипторы
+    size_t n_fds;
+    char *out;
+    size_t out_len, out_cap;
+};
+
+static pthread_rwlock_t daemon_matcher_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t daemon_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t daemon_idle = PTHREAD_COND_INITIALIZER;
+static struct daemon_client *daemon_clients;
+static size_t daemon_n_clients;
+static int daemon_signal_fd = -1;           // запись в канал из обработчика SIGINT/SIGTERM
+int daemon_active = 0;                      // служба принимает соединения
+
+static void daemon_printf(struct daemon_client *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void daemon_printf(struct daemon_client *c, const char *fmt, ...) {
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(c->out + c->out_len, c->out_cap - c->out_len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (c->out_len + n < c->out_cap) {
+            c->out_len += n;
+            return;
+        }
+
+        size_t cap = c->out_cap ? c->out_cap * 2 : 4096;
+        while (cap <= c->out_len + n) cap *= 2;
+        char *p = realloc(c->out, cap);
+        if (!p) return;
+        c->out = p;
+        c->out_cap = cap;
+    }
+}
+
+// Отправка накопленных ответов. -1 - клиент отключился.
+static int daemon_flush(struct daemon_client *c) {
+    size_t done = 0;
+    while (done < c->out_len) {
+        ssize_t n = send(c->fd, c->out + done, c->out_len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    c->out_len = 0;
+    return 0;
+}
+
+static int file_hit_offset_cmp(const void *a, const void *b) {
+    const struct file_hit *x = a, *y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->signature_id < y->signature_id ? -1 : x->signature_id > y->signature_id;
+}
+
+// Проверка открытого файла и ответ клиенту
+static void daemon_scan(struct daemon_client *c, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        stat_add(CTR_STAT_ERRORS, 1);
+        daemon_printf(c, "ERROR %s\n", strerror(errno));
+        return;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        daemon_printf(c, "ERROR not a regular file\n");
+        return;
+    }
+
+    uint64_t t = clock_ns();
+    struct hit_list hits = { 0 };
+    const char *error = NULL;
+    int rc = 0;
+    pthread_rwlock_rdlock(&daemon_matcher_lock);
+    if (!matcher) {
+        rc = -1;
+        error = "no signatures";
+    } else if (matcher->n_patterns || matcher->n_masked) {
+        rc = scan_fd_sized(&c->sc, matcher, fd, st.st_size, collect_hit, &hits);
+        if (rc < 0) error = strerror(errno);
+    }
+    pthread_rwlock_unlock(&daemon_matcher_lock);
+    FILE_DONE(t, st.st_size);
+
+    if (rc < 0 && hits.count == 0) {
+        daemon_printf(c, "ERROR %s\n", error);
+    } else if (hits.count == 0) {
+        daemon_printf(c, "CLEAN\n");
+    } else {
+        stat_add(CTR_FILES_INFECTED, 1);
+        stat_add(CTR_HITS, hits.count);
+        qsort(hits.items, hits.count, sizeof(*hits.items), file_hit_offset_cmp);
+        daemon_printf(c, "FOUND %zu%s", hits.count, hits.truncated || rc < 0 ? "+" : "");
+        for (size_t i = 0; i < hits.count && i < DAEMON_REPORT_HITS; i++) {
+            daemon_printf(c, " %lld:%llu:%u", (long long)hits.items[i].signature_id,
+                          (unsigned long long)hits.items[i].offset, hits.items[i].length);
+        }
+        daemon_printf(c, "\n");
+    }
+    hit_list_free(&hits);
+}
+
+static void daemon_request(struct daemon_client *c, char *line) {
+    uint64_t t = clock_ns();
+
+    if (strncmp(line, "SCAN ", 5) == 0) {
+        int fd = open(line + 5, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0) {
+            stat_add(CTR_OPEN_ERRORS, 1);
+            daemon_printf(c, "ERROR %s\n", strerror(errno));
+        } else {
+            daemon_scan(c, fd);
+            close(fd);
+        }
+    } else if (strcmp(line, "FD") == 0) {
+        if (c->n_fds == 0) {
+            daemon_printf(c, "ERROR no descriptor\n");
+        } else {
+            int fd = c->fds[0];
+            memmove(c->fds, c->fds + 1, --c->n_fds * sizeof(int));
+            daemon_scan(c, fd);
+            close(fd);
+        }
+    } else if (strcmp(line, "RELOAD") == 0) {
+        pthread_rwlock_wrlock(&daemon_matcher_lock);
+        matcher = matcher_prepare(db, matcher);
+        if (matcher) daemon_printf(c, "OK %u\n", matcher_signature_count(matcher));
+        else daemon_printf(c, "ERROR no signatures\n");
+        pthread_rwlock_unlock(&daemon_matcher_lock);
+    } else if (strcmp(line, "PING") == 0) {
+        daemon_printf(c, "PONG\n");
+    } else {
+        daemon_printf(c, "ERROR unknown request\n");
+    }
+
+    stat_add(CTR_DAEMON_REQUESTS, 1);
+    hist_observe(HIST_DAEMON_LATENCY, clock_ns() - t);
+}
+
+// Чтение очередной порции запросов вместе с переданными дескрипторами. 0 - клиент отключился.
+static ssize_t daemon_recv(struct daemon_client *c) {
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(DAEMON_MAX_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { c->in + c->in_len, sizeof(c->in) - c->in_len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+
+    ssize_t n;
+    do n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+    while (n < 0 && errno == EINTR);
+
+    for (struct cmsghdr *h = CMSG_FIRSTHDR(&msg); h; h = CMSG_NXTHDR(&msg, h)) {
+        if (h->cmsg_level != SOL_SOCKET || h->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (h->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *)CMSG_DATA(h);
+        for (size_t i = 0; i < count; i++) {
+            // Лишние дескрипторы закрываем: запрос FD к ним получит ERROR
+            if (c->n_fds < DAEMON_MAX_FDS) c->fds[c->n_fds++] = fds[i];
+            else close(fds[i]);
+        }
+    }
+    return n;
+}
+
+static void *daemon_client_thread(void *arg) {
+    struct daemon_client *c = arg;
+
+    for (;;) {
+        ssize_t n = daemon_recv(c);
+        if (n <= 0) break;
+        c->in_len += n;
+
+        // Все полные строки пачки; ответы уходят одной записью
+        char *line = c->in, *end;
+        while ((end = memchr(line, '\n', c->in + c->in_len - line))) {
+            *end = '\0';
+            if (end > line && end[-1] == '\r') end[-1] = '\0';
+            daemon_request(c, line);
+            line = end + 1;
+            if (c->out_len >= DAEMON_OUT_FLUSH && daemon_flush(c) != 0) goto done;
+        }
+        c->in_len -= line - c->in;
+        memmove(c->in, line, c->in_len);
+
+        if (c->in_len == sizeof(c->in)) {
+            daemon_printf(c, "ERROR line too long\n");
+            daemon_flush(c);
+            break;
+        }
+        if (daemon_flush(c) != 0) break;
+    }
+
+done:
+    pthread_mutex_lock(&daemon_mutex);
+    for (struct daemon_client **p = &daemon_clients; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    daemon_n_clients--;
+    pthread_cond_signal(&daemon_idle);
+    pthread_mutex_unlock(&daemon_mutex);
+
+    for (size_t i = 0; i < c->n_fds; i++) close(c->fds[i]);
+    close(c->fd);
+    scanner_free(&c->sc);
+    free(c->out);
+    free(c);
+    return NULL;
+}
+
+// Новое соединение: отдельный поток, пока клиентов не больше DAEMON_MAX_CLIENTS
+static void daemon_accept(int lfd) {
+    int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EINTR && errno != EAGAIN) perror("Ошибка accept");
+        return;
+    }
+
+    struct daemon_client *c = calloc(1, sizeof(*c));
+    pthread_mutex_lock(&daemon_mutex);
+    if (!c || daemon_n_clients >= DAEMON_MAX_CLIENTS) {
+        pthread_mutex_unlock(&daemon_mutex);
+        send(fd, "ERROR busy\n", 11, MSG_NOSIGNAL);
+        close(fd);
+        free(c);
+        return;
+    }
+
+    c->fd = fd;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, daemon_client_thread, c) != 0) {
+        pthread_mutex_unlock(&daemon_mutex);
+        perror("Ошибка создания потока клиента");
+        close(fd);
+        free(c);
+    } else {
+        c->next = daemon_clients;
+        daemon_clients = c;
+        daemon_n_clients++;
+        pthread_mutex_unlock(&daemon_mutex);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Сокет службы. Оставшийся от упавшей службы файл удаляется, работающая служба - ошибка.
+static int daemon_listen(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Слишком длинный путь сокета: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Ошибка создания сокета");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Служба уже запущена: %s\n", path);
+        close(fd);
+        return -1;
+    }
+    if (errno == ECONNREFUSED) unlink(path);
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old = umask(0077);
+    int rc = fd < 0 ? -1 : bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old);
+    if (rc != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Ошибка открытия сокета %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void daemon_on_signal(int sig) {
+    int saved = errno;
+    if (write(daemon_signal_fd, "", 1) < 0) {}
+    errno = saved;
+}
+
+// Команда daemon: приём запросов на сокете path до ввода в stop_fd (Enter в консоли),
+// SIGINT или SIGTERM. stop_fd < 0 - только по сигналу.
+int daemon_run(const char *path, int stop_fd) {
+    uint64_t t = clock_ns();
+    matcher = matcher_prepare(db, matcher);
+    if (!matcher) return -1;
+    printf("Сигнатуры готовы за %.1f мс\n", (clock_ns() - t) / 1e6);
+
+    int lfd = daemon_listen(path);
+    int stop[2];
+    if (lfd < 0) return -1;
+    if (pipe2(stop, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("Ошибка создания канала");
+        close(lfd);
+        return -1;
+    }
+
+    daemon_signal_fd = stop[1];
+    struct sigaction sa = { .sa_handler = daemon_on_signal }, old_int, old_term;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    printf("Служба слушает %s%s\n", path, stop_fd >= 0 ? ", Enter - остановить" : "");
+    fflush(stdout);
+    uint64_t requests = counters[CTR_DAEMON_REQUESTS];
+    __atomic_store_n(&daemon_active, 1, __ATOMIC_RELEASE);
+
+    struct pollfd fds[3] = { { lfd, POLLIN, 0 }, { stop[0], POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("Ошибка poll");
+            break;
+        }
+        if (fds[1].revents || fds[2].revents) break;
+        if (fds[0].revents & POLLIN) daemon_accept(lfd);
+    }
+
+    // Новых соединений нет; текущие клиенты дочитывают пачку и видят конец потока
+    __atomic_store_n(&daemon_active, 0, __ATOMIC_RELEASE);
+    close(lfd);
+    unlink(path);
+    pthread_mutex_lock(&daemon_mutex);
+    for (struct daemon_client *c = daemon_clients; c; c = c->next) shutdown(c->fd, SHUT_RDWR);
+    while (daemon_n_clients > 0) pthread_cond_wait(&daemon_idle, &daemon_mutex);
+    pthread_mutex_unlock(&daemon_mutex);
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    daemon_signal_fd = -1;
+    close(stop[0]);
+    close(stop[1]);
+
+    printf("Обработано запросов: %llu\n", (unsigned long long)(counters[CTR_DAEMON_REQUESTS] - requests));
+    stats_export();
+    return 0;
+}
+
+// ====================================== Замеры производительности ======================================
+// Собирается отдельно: gcc -DAV_BENCH Main.c -o bench -lsqlite3 -lcrypto -pthread
+#ifdef AV_BENCH
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ----- Задержки файлов -----
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *bench_latency;     // время проверки каждого файла, нс
+static size_t bench_files, bench_latency_cap;
+static uint64_t bench_bytes;
+
+void bench_file_done(uint64_t ns, uint64_t bytes) {
+    pthread_mutex_lock(&bench_lock);
+    if (bench_files == bench_latency_cap) {
+        size_t cap = bench_latency_cap ? bench_latency_cap * 2 : 4096;
+        uint64_t *p = realloc(bench_latency, cap * sizeof(*p));
+        if (p) {
+            bench_latency = p;
+            bench_latency_cap = cap;
+        }
+    }
+    if (bench_files < bench_latency_cap) bench_latency[bench_files++] = ns;
+    bench_bytes += bytes;
+    pthread_mutex_unlock(&bench_lock);
+}
+
+static void bench_reset() {
+    memset(phase_ns, 0, sizeof(phase_ns));
+    bench_files = 0;
+    bench_bytes = 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// ----- Параметры вида ключ=значение -----
+static const char *bench_opt(int argc, char *argv[], const char *key, const char *def) {
+    size_t n = strlen(key);
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], key, n) == 0 && argv[i][n] == '=') return argv[i] + n + 1;
+    }
+    return def;
+}
+
+// Размер с суффиксом K, M или G
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'K': case 'k': return v << 10;
+        case 'M': case 'm': return v << 20;
+        case 'G': case 'g': return v << 30;
+        default:            return v;
+    }
+}
+
+// Диапазон "мин-макс" или одно значение
+static void parse_range(const char *s, uint64_t *lo, uint64_t *hi) {
+    const char *dash = strchr(s, '-');
+    *lo = parse_size(s);
+    *hi = dash ? parse_size(dash + 1) : *lo;
+    if (*hi < *lo) *hi = *lo;
+}
+
+// xorshift64*: быстрый воспроизводимый генератор по seed
+static uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static void bench_fill(uint64_t *state, unsigned char *buf, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t r = bench_rand(state);
+        memcpy(buf + i, &r, 8);
+    }
+    for (; i < len; i++) buf[i] = bench_rand(state);
+}
+
+// Вывод этапа проверки уходит в /dev/null, чтобы не мерить терминал
+static int bench_quiet() {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    return saved;
+}
+
+static void bench_loud(int saved) {
+    fflush(stdout);
+    if (saved < 0) return;
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+// ----- Генератор набора сигнатур -----
+// Заменяет сигнатуры в antivir.db текущего каталога на count случайных длиной len_min..len_max.
+// masked% из них - маскированные: случайные байты, часть заменена на "??", посередине пропуск.
+// Случайная сигнатура: байты в sig либо маска в text. Возвращает длину записи, *kind - её вид.
+static size_t bench_signature(uint64_t *state, uint64_t len_min, uint64_t len_max, int masked,
+                              unsigned char *sig, size_t sig_cap, char *text, int *kind) {
+    uint64_t len = len_min + bench_rand(state) % (len_max - len_min + 1);
+    if (len > sig_cap) len = sig_cap;
+    bench_fill(state, sig, len);
+    *kind = MASK_KIND_EXACT;
+    if ((int)(bench_rand(state) % 100) >= masked) return len;
+
+    // Две половины через пропуск [1-8]; каждый восьмой байт - "??"
+    int t = 0;
+    for (uint64_t j = 0; j < len; j++) {
+        if (j == len / 2) t += sprintf(text + t, "[1-8] ");
+        if (j % 8 == 7) t += sprintf(text + t, "?? ");
+        else t += sprintf(text + t, "%02X ", sig[j]);
+    }
+    *kind = MASK_KIND_MASKED;
+    return t - 1;
+}
+
+int bench_sigs(uint64_t count, uint64_t len_min, uint64_t len_max, int masked, uint64_t seed) {
+    sqlite3_stmt *stmt;
+    const char *sql = "INSERT OR IGNORE INTO Signatures (signature, kind) VALUES (?, ?);";
+
+    if (len_min < 2) len_min = 2;
+    if (len_max < len_min) len_max = len_min;
+    if (sqlite3_exec(db, "DELETE FROM Signatures; BEGIN;", NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка подготовки набора сигнатур: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    uint64_t state = seed | 1;
+    unsigned char sig[4096];
+    char text[4096 * 3 + 32];
+    uint64_t inserted = 0;
+
+    for (uint64_t i = 0; i < count; i++) {
+        int kind;
+        size_t n = bench_signature(&state, len_min, len_max, masked, sig, sizeof(sig), text, &kind);
+        sqlite3_bind_blob(stmt, 1, kind == MASK_KIND_MASKED ? (void *)text : sig, n, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, kind);
+
+        if (sqlite3_step(stmt) == SQLITE_DONE) inserted += sqlite3_changes(db);
+        sqlite3_reset(stmt);
+    }
+
+    sqlite3_finalize(stmt);
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка фиксации набора сигнатур: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    printf("Сигнатур в наборе: %llu\n", (unsigned long long)inserted);
+    return 0;
+}
+
+// ----- Генератор дерева файлов -----
+// Размер файла: fixed - всегда минимальный, uniform - равномерно в диапазоне,
+// log - равномерно по степеням двойки (много мелких файлов, мало крупных).
+static uint64_t corpus_size(uint64_t *state, const char *dist, uint64_t lo, uint64_t hi) {
+    if (strcmp(dist, "fixed") == 0 || hi == lo) return lo;
+    if (strcmp(dist, "log") == 0 && lo > 0) {
+        int bits = 0;
+        while ((lo << (bits + 1)) <= hi) bits++;
+        uint64_t from = lo << (bench_rand(state) % (bits + 1));
+        uint64_t size = from + bench_rand(state) % from;
+        return size > hi ? hi : size;
+    }
+    return lo + bench_rand(state) % (hi - lo + 1);
+}
+
+// Экземпляр маскированной сигнатуры: маски заполняются случайно, пропуски минимальные
+static size_t render_masked(const struct matcher *m, const struct masked_sig *sig, uint64_t *state,
+                            unsigned char *out, size_t cap) {
+    size_t n = 0;
+    for (uint32_t f = 0; f < sig->n_frags; f++) {
+        const struct mask_frag *fr = &m->frags[sig->frag + f];
+        if (n + fr->gap_min + fr->length > cap) return 0;
+        bench_fill(state, out + n, fr->gap_min);
+        n += fr->gap_min;
+        for (uint32_t j = 0; j < fr->length; j++) {
+            const struct mask_elem *e = &m->elems[fr->elem + j];
+            out[n++] = e->value | (bench_rand(state) & ~e->mask);
+        }
+    }
+    return n;
+}
+
+// Вставленная сигнатура: смещение, id и номер файла
+struct planted {
+    uint64_t at;
+    int64_t id;
+    uint64_t file;
+};
+
+static void corpus_path(char *path, size_t size, const char *dir, uint64_t dirs, uint64_t i) {
+    snprintf(path, size, "%s/d%04llu/f%07llu.bin", dir, (unsigned long long)(i % dirs), (unsigned long long)i);
+}
+
+// Копия файла src в dst через буфер buf
+static int corpus_copy(const char *src, const char *dst, unsigned char *buf, size_t chunk) {
+    int in = open(src, O_RDONLY), out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644), rc = 0;
+    uint64_t pos = 0;
+    ssize_t n;
+    while (in >= 0 && out >= 0 && (n = pread(in, buf, chunk, pos)) > 0) {
+        if ((rc = write_at(out, buf, n, pos)) != 0) break;
+        pos += n;
+    }
+    if (in < 0 || out < 0) rc = -1;
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    return rc;
+}
+
+// files файлов в dirs подкаталогах dir. В plant% файлов вставлено от 1 до 3 сигнатур
+// из текущего набора; их места записываются в манифест <dir>.manifest (смещение, id, путь).
+// dup% файлов - повторы более ранних: поровну жёсткие ссылки и копии.
+int bench_corpus(const char *dir, uint64_t files, uint64_t dirs, uint64_t lo, uint64_t hi,
+                 const char *dist, int plant, int dup, uint64_t seed) {
+    char manifest_path[1024], path[1024];
+    snprintf(manifest_path, sizeof(manifest_path), "%s.manifest", dir);
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        perror("Ошибка создания каталога");
+        return -1;
+    }
+    FILE *manifest = fopen(manifest_path, "w");
+    if (!manifest) {
+        perror("Ошибка создания манифеста");
+        return -1;
+    }
+
+    // Сигнатуры, которые можно вставить: обычные и маскированные
+    uint32_t n_sigs = matcher_signature_count(matcher);
+    uint32_t *exact = malloc((matcher->n_patterns + 1) * sizeof(uint32_t));
+    uint32_t n_exact = 0;
+    for (uint32_t p = 0; p < matcher->n_patterns; p++) {
+        if (matcher->patterns[p].owner == AC_NONE) exact[n_exact++] = p;
+    }
+
+    size_t chunk = SCAN_CHUNK_SIZE;
+    unsigned char *buf = malloc(chunk);
+    unsigned char sig[8192];
+    uint64_t state = seed | 1, total = 0, planted = 0, n_dups = 0;
+    struct planted *marks = NULL;
+    size_t n_marks = 0, marks_cap = 0;
+    if (!buf || !exact) {
+        perror("Ошибка выделения памяти");
+        free(buf);
+        free(exact);
+        fclose(manifest);
+        return -1;
+    }
+    if (dirs == 0) dirs = 1;
+
+    for (uint64_t i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/d%04llu", dir, (unsigned long long)(i % dirs));
+        mkdir(path, 0777);
+        corpus_path(path, sizeof(path), dir, dirs, i);
+
+        // Повтор: ссылка или копия случайного более раннего файла с теми же сигнатурами
+        if (i > 0 && (int)(bench_rand(&state) % 100) < dup) {
+            char src[1024];
+            uint64_t j = bench_rand(&state) % i;
+            corpus_path(src, sizeof(src), dir, dirs, j);
+            unlink(path);
+            int rc = bench_rand(&state) & 1 ? link(src, path) : corpus_copy(src, path, buf, chunk);
+            if (rc != 0) {
+                perror("Ошибка создания повтора");
+                break;
+            }
+            for (size_t k = 0, n = n_marks; k < n; k++) {
+                if (marks[k].file != j) continue;
+                fprintf(manifest, "%llu\t%lld\t%s\n", (unsigned long long)marks[k].at, (long long)marks[k].id, path);
+                planted++;
+            }
+            n_dups++;
+            continue;
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("Ошибка создания файла");
+            break;
+        }
+
+        uint64_t size = corpus_size(&state, dist, lo, hi);
+        for (uint64_t done = 0; done < size; ) {
+            size_t n = size - done < chunk ? size - done : chunk;
+            bench_fill(&state, buf, n);
+            if (write_at(fd, buf, n, done) != 0) break;
+            done += n;
+        }
+
+        // Сигнатуры ставятся в разные части файла, чтобы не перекрываться
+        if (n_sigs > 0 && (int)(bench_rand(&state) % 100) < plant) {
+            int k = 1 + bench_rand(&state) % 3;
+            uint64_t part = size / k;
+            for (int j = 0; j < k; j++) {
+                uint32_t pick = bench_rand(&state) % (n_exact + matcher->n_masked);
+                int64_t id;
+                size_t len;
+                if (pick < n_exact) {
+                    const struct ac_pattern *p = &matcher->patterns[exact[pick]];
+                    id = p->id;
+                    len = p->length < sizeof(sig) ? p->length : 0;
+                    memcpy(sig, matcher->bytes + p->offset, len);
+                } else {
+                    const struct masked_sig *ms = &matcher->masked[pick - n_exact];
+                    id = ms->id;
+                    len = render_masked(matcher, ms, &state, sig, sizeof(sig));
+                }
+                if (len == 0 || len > part) continue;
+
+                uint64_t at = part * j + bench_rand(&state) % (part - len + 1);
+                if (write_at(fd, sig, len, at) == 0) {
+                    fprintf(manifest, "%llu\t%lld\t%s\n", (unsigned long long)at, (long long)id, path);
+                    planted++;
+                    if (dup > 0 && n_marks == marks_cap) {
+                        marks_cap = marks_cap ? marks_cap * 2 : 1024;
+                        struct planted *p = realloc(marks, marks_cap * sizeof(*p));
+                        if (!p) {
+                            perror("Ошибка выделения памяти");
+                            marks_cap = n_marks;
+                            continue;
+                        }
+                        marks = p;
+                    }
+                    if (dup > 0) marks[n_marks++] = (struct planted){ at, id, i };
+                }
+            }
+        }
+
+        close(fd);
+        total += size;
+    }
+
+    printf("Создано файлов: %llu (повторов %llu), %.1f МБ, вставлено сигнатур: %llu\nМанифест: %s\n",
+           (unsigned long long)files, (unsigned long long)n_dups, total / (1024.0 * 1024.0),
+           (unsigned long long)planted, manifest_path);
+    free(marks);
+    free(buf);
+    free(exact);
+    fclose(manifest);
+    return 0;
+}
+
+// ----- Проверка дерева с разбивкой по этапам -----
+
+static void print_phases(int from, int to, double wall) {
+    for (int p = from; p < to; p++) {
+        double sec = phase_ns[p] / 1e9;
+        printf("  %9.3f с %6.1f%%  %s\n", sec, wall > 0 ? 100 * sec / wall : 0, phase_names[p][1]);
+    }
+}
+
+// Сколько вставленных сигнатур из манифеста нашлось в таблице Hits
+static void bench_verify(const char *manifest_path) {
+    FILE *f = fopen(manifest_path, "r");
+    if (!f) {
+        perror("Ошибка открытия манифеста");
+        return;
+    }
+
+    sqlite3_stmt *stmt;
+    const char *sql = "SELECT 1 FROM FoundFiles f JOIN Hits h ON h.file_id = f.id "
+                      "WHERE f.path = ? AND h.offset = ? AND h.signature_id = ?;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка подготовки запроса: %s\n", sqlite3_errmsg(db));
+        fclose(f);
+        return;
+    }
+
+    char line[1200], path[1024];
+    unsigned long long offset, total = 0, found = 0;
+    long long id;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%llu\t%lld\t%1023[^\n]", &offset, &id, path) != 3) continue;
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, offset);
+        sqlite3_bind_int64(stmt, 3, id);
+        if (sqlite3_step(stmt) == SQLITE_ROW) found++;
+        else if (total - found < 5) printf("  не найдена: %s +%llu (сигнатура %lld)\n", path, offset, id);
+        sqlite3_reset(stmt);
+        total++;
+    }
+    sqlite3_finalize(stmt);
+    fclose(f);
+    printf("Найдено вставленных сигнатур: %llu из %llu\n", found, total);
+}
+
+// Полная проверка dir (состояние прошлых проверок сбрасывается), затем сверка с манифестом
+// и, если actions, действия над найденными файлами: статусы 1-3 раздаются по кругу.
+void bench_run(const char *dir, int threads, const char *manifest, int actions) {
+    if (sqlite3_exec(db, "DELETE FROM FoundFiles; DELETE FROM ScanState; DELETE FROM ContentVerdicts;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Ошибка очистки БД: %s\n", sqlite3_errmsg(db));
+        return;
+    }
+
+    bench_reset();
+    uint64_t links = counters[CTR_DEDUP_LINKS], copies = counters[CTR_DEDUP_COPIES];
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    int saved = bench_quiet();
+    double t0 = now_seconds();
+    check(dir, threads);
+    double wall = now_seconds() - t0;
+    bench_loud(saved);
+    getrusage(RUSAGE_SELF, &ru1);
+
+    double mb = bench_bytes / (1024.0 * 1024.0);
+    printf("Файлов: %zu, %.1f МБ за %.3f с: %.0f файлов/с, %.1f МБ/с\n",
+           bench_files, mb, wall, bench_files / wall, mb / wall);
+    printf("Промахов страниц: %ld, процессор: %.3f с польз. + %.3f с сист.\n", ru1.ru_minflt - ru0.ru_minflt,
+           (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) + (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e6,
+           (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6);
+    if (bench_files > 0) {
+        qsort(bench_latency, bench_files, sizeof(uint64_t), cmp_u64);
+        printf("Задержка на файл: p50 %.3f мс, p99 %.3f мс, макс %.3f мс\n",
+               bench_latency[bench_files / 2] / 1e6, bench_latency[bench_files * 99 / 100] / 1e6,
+               bench_latency[bench_files - 1] / 1e6);
+    }
+    if (dedup_enabled) {
+        printf("Без повторной проверки: жёстких ссылок %llu, копий %llu\n",
+               (unsigned long long)(counters[CTR_DEDUP_LINKS] - links),
+               (unsigned long long)(counters[CTR_DEDUP_COPIES] - copies));
+    }
+    printf("Этапы (сумма по потокам, %% от общего времени):\n");
+    print_phases(PHASE_WALK, PHASE_DELETE, wall);
+
+    if (manifest) bench_verify(manifest);
+    if (!actions) return;
+
+    sqlite3_exec(db, "UPDATE FoundFiles SET status = 1 + id % 3;", NULL, NULL, NULL);
+    bench_reset();
+    saved = bench_quiet();
+    t0 = now_seconds();
+    process_table_info();
+    wall = now_seconds() - t0;
+    bench_loud(saved);
+
+    printf("Действия над найденными файлами за %.3f с:\n", wall);
+    print_phases(PHASE_DELETE, PHASE_COUNT, wall);
+    print_phases(PHASE_DB, PHASE_DB + 1, wall);
+}
+
+// ----- Задержка обнаружения в режиме watch -----
+// Наблюдение идёт в отдельном потоке (он владеет соединением с БД), а этот поток пишет files
+// файлов по size байт в dir; в plant% из них - первая обычная сигнатура набора.
+struct bench_watch {
+    const char *dir;
+    enum watch_backend backend;
+    int stop[2];
+};
+
+static void *bench_watch_thread(void *arg) {
+    struct bench_watch *bw = arg;
+    watch_run(bw->dir, bw->backend, bw->stop[0]);
+    return NULL;
+}
+
+void bench_watch(const char *dir, uint64_t files, uint64_t size, int plant, enum watch_backend backend) {
+    const struct ac_pattern *sig = NULL;
+    for (uint32_t p = 0; p < matcher->n_patterns && !sig; p++) {
+        if (matcher->patterns[p].owner == AC_NONE) sig = &matcher->patterns[p];
+    }
+
+    unsigned char *buf = malloc(size ? size : 1);
+    struct bench_watch bw = { dir, backend, { -1, -1 } };
+    if (!buf || (mkdir(dir, 0777) != 0 && errno != EEXIST) || pipe(bw.stop) != 0) {
+        perror("Ошибка подготовки замера");
+        free(buf);
+        return;
+    }
+
+    int saved = bench_quiet();
+    pthread_t thread;
+    pthread_create(&thread, NULL, bench_watch_thread, &bw);
+    while (!__atomic_load_n(&watch_active, __ATOMIC_ACQUIRE)) usleep(1000);
+
+    uint64_t state = 1, planted = 0, base = counters[CTR_FILES_SCANNED] + counters[CTR_FILES_SKIPPED];
+    double t0 = now_seconds();
+    for (uint64_t i = 0; i < files; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/w%07llu.bin", dir, (unsigned long long)i);
+
+        bench_fill(&state, buf, size);
+        if (sig && sig->length <= size && (int)(bench_rand(&state) % 100) < plant) {
+            memcpy(buf + (size - sig->length) / 2, matcher->bytes + sig->offset, sig->length);
+            planted++;
+        }
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write_at(fd, buf, size, 0) != 0) perror("Ошибка записи файла");
+        if (fd >= 0) close(fd);
+    }
+    double written = now_seconds() - t0;
+
+    // Ждём вердикта по всем файлам, но не дольше 30 с
+    while (counters[CTR_FILES_SCANNED] + counters[CTR_FILES_SKIPPED] - base < files && now_seconds() - t0 < 30) {
+        usleep(1000);
+    }
+    double wall = now_seconds() - t0;
+    uint64_t infected = counters[CTR_FILES_INFECTED];
+
+    if (write(bw.stop[1], "\n", 1) != 1) perror("Ошибка остановки наблюдения");
+    pthread_join(thread, NULL);
+    bench_loud(saved);
+
+    const struct histogram *h = &histograms[HIST_WATCH_LATENCY];
+    printf("Файлов: %llu по %llu Б, записаны за %.3f с, все проверены через %.3f с\n",
+           (unsigned long long)files, (unsigned long long)size, written, wall);
+    printf("Событий: %llu, слито: %llu, с сигнатурами: %llu из %llu вставленных\n",
+           (unsigned long long)counters[CTR_WATCH_EVENTS], (unsigned long long)counters[CTR_WATCH_COALESCED],
+           (unsigned long long)infected, (unsigned long long)planted);
+    if (h->count) {
+        printf("От события до вердикта (задержка очереди %d мс): среднее %.3f мс, p50 <= %.3f мс, p99 <= %.3f мс\n",
+               watch_debounce_ms, (double)h->sum / h->count / 1e6, hist_quantile(h, 0.5) / 1e6,
+               hist_quantile(h, 0.99) / 1e6);
+    }
+
+    close(bw.stop[0]);
+    close(bw.stop[1]);
+    free(buf);
+}
+
+// ----- Служба на сокете -----
+// Клиенты держат в полёте до depth запросов; задержка считается от отправки до строки ответа.
+struct bench_daemon {
+    const char *socket_path;
+    int stop[2];
+};
+
+static void *bench_daemon_thread(void *arg) {
+    struct bench_daemon *bd = arg;
+    daemon_run(bd->socket_path, bd->stop[0]);
+    return NULL;
+}
+
+struct bench_paths {
+    char **items;
+    size_t count, capacity;
+};
+
+static void bench_collect_path(const char *path, const struct stat *st, void *ctx) {
+    struct bench_paths *bp = ctx;
+    if (bp->count == bp->capacity) {
+        size_t cap = bp->capacity ? bp->capacity * 2 : 1024;
+        char **p = realloc(bp->items, cap * sizeof(*p));
+        if (!p) return;
+        bp->items = p;
+        bp->capacity = cap;
+    }
+    bp->items[bp->count] = strdup(path);
+    if (bp->items[bp->count]) bp->count++;
+}
+
+struct bench_daemon_client {
+    const char *socket_path;
+    const struct bench_paths *paths;
+    size_t first;               // номер первого файла клиента
+    uint64_t requests;
+    int depth;
+    int use_fd;
+    uint64_t *latency;          // нс на запрос
+    uint64_t found, errors;
+};
+
+static void *bench_daemon_client(void *arg) {
+    struct bench_daemon_client *bc = arg;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", bc->socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    FILE *in = NULL;
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || !(in = fdopen(dup(fd), "r"))) {
+        perror("Ошибка подключения к службе");
+        if (fd >= 0) close(fd);
+        bc->errors = bc->requests;
+        return NULL;
+    }
+
+    uint64_t sent_at[bc->depth];
+    uint64_t sent = 0, done = 0, wanted = bc->requests;
+    char line[DAEMON_LINE_MAX];
+    while (done < bc->requests) {
+        while (sent < bc->requests && sent - done < (uint64_t)bc->depth) {
+            const char *path = bc->paths->items[(bc->first + sent) % bc->paths->count];
+            int ok;
+            if (bc->use_fd) {
+                int file = open(path, O_RDONLY | O_CLOEXEC);
+                union {
+                    struct cmsghdr h;
+                    char buf[CMSG_SPACE(sizeof(int))];
+                } control = { 0 };
+                struct iovec iov = { "FD\n", 3 };
+                struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                                      .msg_controllen = sizeof(control.buf) };
+                struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+                h->cmsg_level = SOL_SOCKET;
+                h->cmsg_type = SCM_RIGHTS;
+                h->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(h), &file, sizeof(int));
+                ok = file >= 0 && sendmsg(fd, &msg, MSG_NOSIGNAL) == 3;
+                if (file >= 0) close(file);
+            } else {
+                int n = snprintf(line, sizeof(line), "SCAN %s\n", path);
+                ok = send(fd, line, n, MSG_NOSIGNAL) == n;
+            }
+            if (!ok) {
+                bc->requests = sent;    // дальше не отправляем, дочитываем ответы
+                break;
+            }
+            sent_at[sent++ % bc->depth] = clock_ns();
+        }
+
+        if (!fgets(line, sizeof(line), in)) break;
+        bc->latency[done] = clock_ns() - sent_at[done % bc->depth];
+        if (strncmp(line, "FOUND", 5) == 0) bc->found++;
+        else if (strncmp(line, "CLEAN", 5) != 0) bc->errors++;
+        done++;
+    }
+    bc->errors += wanted - done;
+    bc->requests = done;
+
+    fclose(in);
+    close(fd);
+    return NULL;
+}
+
+void bench_daemon(const char *dir, int clients, int depth, uint64_t requests, int use_fd) {
+    struct bench_paths paths = { 0 };
+    listFilesRecursive(dir, bench_collect_path, &paths);
+    if (paths.count == 0) {
+        fprintf(stderr, "В каталоге %s нет файлов\n", dir);
+        return;
+    }
+    if (clients < 1) clients = 1;
+    if (depth < 1) depth = 1;
+
+    // Проверка в этом же процессе, без сокета: нижняя граница задержки
+    uint64_t direct_n = paths.count < 2000 ? paths.count : 2000;
+    double t0 = now_seconds();
+    for (uint64_t i = 0; i < direct_n; i++) {
+        struct hit_list hits = { 0 };
+        int fd = open(paths.items[i], O_RDONLY);
+        if (fd >= 0) {
+            scan_fd(&default_scanner, matcher, fd, collect_hit, &hits);
+            close(fd);
+        }
+        hit_list_free(&hits);
+    }
+    double direct = (now_seconds() - t0) / direct_n;
+
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/av-bench-%d.sock", (int)getpid());
+    struct bench_daemon bd = { socket_path, { -1, -1 } };
+    if (pipe(bd.stop) != 0) {
+        perror("Ошибка подготовки замера");
+        return;
+    }
+    pthread_t server;
+    pthread_create(&server, NULL, bench_daemon_thread, &bd);
+    while (!__atomic_load_n(&daemon_active, __ATOMIC_ACQUIRE)) usleep(1000);
+
+    struct bench_daemon_client bc[clients];
+    pthread_t threads[clients];
+    uint64_t *latency = malloc(requests * sizeof(*latency));
+    uint64_t per_client = requests / clients;
+    t0 = now_seconds();
+    for (int i = 0; i < clients; i++) {
+        bc[i] = (struct bench_daemon_client){ socket_path, &paths, i * paths.count / clients,
+                                              per_client, depth, use_fd, latency + i * per_client, 0, 0 };
+        pthread_create(&threads[i], NULL, bench_daemon_client, &bc[i]);
+    }
+    uint64_t done = 0, found = 0, errors = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        memmove(latency + done, bc[i].latency, bc[i].requests * sizeof(*latency));
+        done += bc[i].requests;
+        found += bc[i].found;
+        errors += bc[i].errors;
+    }
+    double wall = now_seconds() - t0;
+
+    if (write(bd.stop[1], "\n", 1) != 1) perror("Ошибка остановки службы");
+    pthread_join(server, NULL);
+
+    qsort(latency, done, sizeof(*latency), cmp_u64);
+    printf("Клиентов: %d, запросов в полёте: %d, передача: %s\n", clients, depth, use_fd ? "SCM_RIGHTS" : "путь");
+    printf("Запросов: %llu за %.3f с: %.0f в секунду; с сигнатурами %llu, ошибок %llu\n",
+           (unsigned long long)done, wall, done / wall, (unsigned long long)found, (unsigned long long)errors);
+    if (done) {
+        printf("Задержка, мкс: p50 %.1f, p99 %.1f, макс. %.1f; проверка без службы %.1f мкс на файл\n",
+               latency[done / 2] / 1e3, latency[done * 99 / 100] / 1e3, latency[done - 1] / 1e3, direct * 1e6);
+    }
+
+    close(bd.stop[0]);
+    close(bd.stop[1]);
+    free(latency);
+    for (size_t i = 0; i < paths.count; i++) free(paths.items[i]);
+    free(paths.items);
+}
+
+// Пропускная способность параллельной проверки в зависимости от числа потоков
+void bench_threads(const char *dir, int max_threads) {
+    struct parallel_scan ps = { .dry_run = 1 };
+
+    // Прогрев кэша страниц, чтобы все замеры шли в одинаковых условиях
+    parallel_check(&ps, dir, matcher, 1);
+    printf("Потоки | Файлы | МБ | Секунды | МБ/с | Ускорение\n");
+
+    double base = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+        bench_reset();
+        double t0 = now_seconds();
+        parallel_check(&ps, dir, matcher, n);
+        double dt = now_seconds() - t0;
+        double mb = ps.bytes_scanned / (1024.0 * 1024.0);
+        if (n == 1) base = dt;
+        printf("%6d | %5llu | %.1f | %.3f | %.1f | %.2f\n", n, (unsigned long long)ps.files_scanned,
+               mb, dt, mb / dt, base / dt);
+    }
+}
+
+// Скорость обхода каталога без проверки файлов (кэш каталогов прогрет первым проходом)
+static void bench_count_file(const char *path, const struct stat *st, void *ctx) {
+    ((uint64_t *)ctx)[0]++;
+    ((uint64_t *)ctx)[1] += strlen(path);
+}
+
+void bench_walk(const char *dir, int reps) {
+    uint64_t seen[2] = { 0 };
+    listFilesRecursive(dir, bench_count_file, seen);
+    printf("Файлов: %llu, средняя длина пути %.0f, ссылки: %s, xdev: %d\n", (unsigned long long)seen[0],
+           seen[0] ? (double)seen[1] / seen[0] : 0.0, walk_symlinks_names[walk_symlinks], walk_xdev);
+
+    double best = 0;
+    for (int i = 0; i < (reps > 0 ? reps : 1); i++) {
+        seen[0] = seen[1] = 0;
+        double t0 = now_seconds();
+        listFilesRecursive(dir, bench_count_file, seen);
+        double dt = now_seconds() - t0;
+        if (i == 0 || dt < best) best = dt;
+    }
+    printf("Обход: %.3f с (лучший из %d), %.0f файлов/с\n", best, reps, seen[0] / (best > 0 ? best : 1e-9));
+}
+
+// Поиск в одном большом файле участками в n потоках (кэш страниц прогрет первым проходом)
+void bench_shard(const char *path, const char *threads) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Ошибка открытия файла");
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    struct hit_list hits = { 0 };
+    scan_fd(&default_scanner, matcher, fd, collect_hit, &hits);
+    size_t base_hits = hits.count;
+    hit_list_free(&hits);
+    double mb = st.st_size / (1024.0 * 1024.0), base = 0;
+    printf("Потоки | Участок, МБ | Секунды | МБ/с | Ускорение | Совпадений\n");
+
+    for (const char *p = threads; *p; ) {
+        char *end;
+        long n = strtol(p, &end, 10);
+        if (end == p) break;
+        p = *end == ',' ? end + 1 : end;
+        if (n < 1) continue;
+
+        double t0 = now_seconds();
+        int rc = n == 1 ? scan_fd(&default_scanner, matcher, fd, collect_hit, &hits) :
+                 scan_fd_sharded(matcher, fd, st.st_size, n, &hits);
+        double dt = now_seconds() - t0;
+        if (base == 0) base = dt;
+        printf("%6ld | %11.0f | %.3f | %.1f | %.2f | %zu%s\n", n,
+               n == 1 ? mb : shard_length(st.st_size, n) / (1024.0 * 1024.0), dt, mb / dt, base / dt, hits.count,
+               rc < 0 ? " ОШИБКА" : hits.count != base_hits ? " РАСХОЖДЕНИЕ" : "");
+        hit_list_free(&hits);
+    }
+    close(fd);
+}
+
+// Доля страниц файлов в кэше (mincore): показывает, удалось ли вытеснить данные
+static double bench_resident(const struct bench_paths *bp) {
+    uint64_t pages = 0, resident = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char *vec = NULL;
+    size_t vec_len = 0;
+
+    for (size_t i = 0; i < bp->count; i++) {
+        int fd = open(bp->items[i], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0) continue;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size_t n = (st.st_size + page - 1) / page;
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (n > vec_len) {
+                unsigned char *v = realloc(vec, n);
+                if (v) vec = v, vec_len = n;
+            }
+            if (p != MAP_FAILED && n <= vec_len && mincore(p, st.st_size, vec) == 0) {
+                for (size_t j = 0; j < n; j++) resident += vec[j] & 1;
+                pages += n;
+            }
+            if (p != MAP_FAILED) munmap(p, st.st_size);
+        }
+        close(fd);
+    }
+    free(vec);
+    return pages ? 100.0 * resident / pages : 0;
+}
+
+// Вытеснение файлов из кэша страниц перед холодным замером
+static void bench_evict(const struct bench_paths *bp) {
+    sync();
+    for (size_t i = 0; i < bp->count; i++) {
+        int fd = open(bp->items[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Скорость проверки каталога в зависимости от числа чтений в полёте. Глубина 0 - блокирующее
+// чтение (scan_worker), затем каждый механизм с каждой глубиной; cold=1 - перед каждым
+// замером файлы вытесняются из кэша страниц.
+void bench_io(const char *dir, const char *depths, const char *backends, int threads, int cold) {
+    struct parallel_scan ps = { .dry_run = 1 };
+    struct bench_paths bp = { 0 };
+    int saved_depth = io_depth;
+    enum io_backend saved_backend = io_backend;
+
+    listFilesRecursive(dir, bench_collect_path, &bp);
+    if (!cold) parallel_check(&ps, dir, matcher, 1);    // прогрев
+    printf("Механизм | Глубина | Файлы | МБ | Секунды | МБ/с | В кэше до, %%\n");
+
+    for (int b = -1; b < 2; b++) {
+        enum io_backend backend = b == 0 ? IO_URING : IO_POOL;
+        if (b >= 0 && !strstr(backends, b == 0 ? "uring" : "pool")) continue;
+
+        for (const char *d = b < 0 ? "0" : depths; *d; ) {
+            char *end;
+            long depth = strtol(d, &end, 10);
+            if (end == d) break;
+            d = *end == ',' ? end + 1 : end;
+
+            io_set(backend, depth);
+            if (cold) bench_evict(&bp);
+            double resident = cold ? bench_resident(&bp) : 100;
+            if (cold) bench_evict(&bp);     // mincore через mmap мог подтянуть страницы
+
+            bench_reset();
+            double t0 = now_seconds();
+            parallel_check(&ps, dir, matcher, threads);
+            double dt = now_seconds() - t0;
+            double mb = ps.bytes_scanned / (1024.0 * 1024.0);
+            printf("%8s | %7d | %5llu | %.1f | %.3f | %.1f | %.1f\n",
+                   io_depth ? io_backend_names[ps.io_backend_used] : "блок.", io_depth,
+                   (unsigned long long)ps.files_scanned, mb, dt, mb / dt, resident);
+            fflush(stdout);
+        }
+    }
+
+    io_set(saved_backend, saved_depth);
+    for (size_t i = 0; i < bp.count; i++) free(bp.items[i]);
+    free(bp.items);
+}
+
+// ----- Ограничение нагрузки рядом с чужой службой -----
+// Соседняя служба в духе fio: один поток случайных чтений (и записей) по 4 КБ в очереди глубины 1
+// мимо кэша страниц (O_DIRECT), с задержкой каждого запроса. Она работает одна, рядом с проверкой
+// без ограничений и рядом с проверкой с заданными ограничениями.
+#define BENCH_FG_BLOCK 4096
+
+struct bench_fg {
+    int fd;
+    uint64_t blocks;
+    int write_pct;
+    int stop;
+    uint64_t *lat;
+    size_t count, capacity;
+};
+
+static void *bench_fg_thread(void *arg) {
+    struct bench_fg *fg = arg;
+    uint64_t state = 12345;
+    void *buf;
+    if (posix_memalign(&buf, BENCH_FG_BLOCK, BENCH_FG_BLOCK) != 0) return NULL;
+    bench_fill(&state, buf, BENCH_FG_BLOCK);
+
+    while (!__atomic_load_n(&fg->stop, __ATOMIC_RELAXED)) {
+        off_t off = (off_t)(bench_rand(&state) % fg->blocks) * BENCH_FG_BLOCK;
+        int write = (int)(bench_rand(&state) % 100) < fg->write_pct;
+        uint64_t t0 = clock_ns();
+        ssize_t n = write ? pwrite(fg->fd, buf, BENCH_FG_BLOCK, off) : pread(fg->fd, buf, BENCH_FG_BLOCK, off);
+        uint64_t dt = clock_ns() - t0;
+        if (n != BENCH_FG_BLOCK) {
+            perror("Ошибка ввода-вывода соседней службы");
+            break;
+        }
+        if (fg->count == fg->capacity) {
+            size_t cap = fg->capacity ? fg->capacity * 2 : 65536;
+            uint64_t *p = realloc(fg->lat, cap * sizeof(*p));
+            if (!p) break;
+            fg->lat = p;
+            fg->capacity = cap;
+        }
+        fg->lat[fg->count++] = dt;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Файл соседней службы рядом с каталогом (не попадает в проверку)
+static int bench_fg_open(const char *dir, uint64_t size, int *direct) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.fg", dir);
+    struct stat st;
+    if (stat(path, &st) != 0 || (uint64_t)st.st_size != size) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        unsigned char *buf = malloc(1 << 20);
+        uint64_t state = 1;
+        for (uint64_t done = 0; fd >= 0 && buf && done < size; done += 1 << 20) {
+            size_t len = size - done < (1 << 20) ? size - done : (1 << 20);
+            bench_fill(&state, buf, len);
+            if (write(fd, buf, len) != (ssize_t)len) break;
+        }
+        free(buf);
+        if (fd < 0 || fsync(fd) != 0) {
+            perror("Ошибка создания файла соседней службы");
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+
+    // Без O_DIRECT (tmpfs и т.п.) запросы идут через кэш и почти не зависят от диска
+    int fd = open(path, O_RDWR | O_DIRECT | O_CLOEXEC);
+    *direct = fd >= 0;
+    if (fd < 0) fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) perror("Ошибка открытия файла соседней службы");
+    return fd;
+}
+
+// Один замер: соседняя служба secs секунд или, при scan, пока идёт проверка
+static void bench_governor_row(const char *title, const char *dir, struct bench_fg *fg, const struct bench_paths *bp,
+                               int scan, int secs, int threads, int cold) {
+    struct parallel_scan ps = { .dry_run = 1 };
+    pthread_t thread;
+    double dt = 0, resident = 0;
+
+    if (cold) bench_evict(bp);
+    bench_reset();
+    fg->count = 0;
+    fg->stop = 0;
+    if (pthread_create(&thread, NULL, bench_fg_thread, fg) != 0) {
+        perror("Ошибка запуска соседней службы");
+        return;
+    }
+    uint64_t waits = counters[CTR_GOV_WAITS], backoffs = counters[CTR_GOV_BACKOFFS], psi0 = 0, psi1 = 0;
+    gov_psi_total(&psi0);
+    double t0 = now_seconds();
+    if (scan) {
+        gov_begin();
+        parallel_check(&ps, dir, matcher, threads);
+        gov_end();
+    } else {
+        sleep(secs);
+    }
+    dt = now_seconds() - t0;
+    gov_psi_total(&psi1);
+    __atomic_store_n(&fg->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+    if (scan) resident = bench_resident(bp);
+
+    uint64_t *lat = fg->lat;
+    size_t n = fg->count;
+    if (n) qsort(lat, n, sizeof(*lat), cmp_u64);
+    double mb = ps.bytes_scanned / (1024.0 * 1024.0), psi = psi1 > psi0 ? (psi1 - psi0) / (dt * 1e4) : 0;
+    printf("%7.2f | %6.1f | %5llu/%-5llu | %5.1f | %7.0f | %6.3f | %6.3f | %7.3f | %7.2f | %5.1f | %s\n", dt,
+           scan ? mb / dt : 0, (unsigned long long)(counters[CTR_GOV_WAITS] - waits),
+           (unsigned long long)(counters[CTR_GOV_BACKOFFS] - backoffs), psi, n / dt,
+           n ? lat[n / 2] / 1e6 : 0, n ? lat[n * 99 / 100] / 1e6 : 0, n ? lat[n * 999 / 1000] / 1e6 : 0,
+           n ? lat[n - 1] / 1e6 : 0, resident, title);
+    fflush(stdout);
+}
+
+void bench_governor(const char *dir, uint64_t fg_size, int write_pct, int secs, int threads, int cold) {
+    struct bench_paths bp = { 0 };
+    struct bench_fg fg = { .write_pct = write_pct, .blocks = fg_size / BENCH_FG_BLOCK };
+    int direct;
+
+    if (fg.blocks == 0 || (fg.fd = bench_fg_open(dir, fg.blocks * BENCH_FG_BLOCK, &direct)) < 0) return;
+    listFilesRecursive(dir, bench_collect_path, &bp);
+    printf("Соседняя служба: случайные блоки по 4 КБ, записей %d%%, файл %.0f МБ%s\n", write_pct,
+           fg_size / (1024.0 * 1024.0), direct ? "" : " (без O_DIRECT)");
+    printf("Проверка: файлов %zu, потоков %d, %s\n", bp.count, threads, cold ? "холодный кэш" : "кэш прогрет");
+    gov_print();
+    if (!cold) parallel_check(&(struct parallel_scan){ .dry_run = 1 }, dir, matcher, threads);
+    printf("Секунды | МБ/с   | Пауз/сниж.  | PSI, %% | Оп/с    | p50 мс | p99 мс | p99.9 мс | Макс мс | В кэше, %% | Режим\n");
+
+    // Ограничения, заданные параметрами, снимаются на время замера без них
+    uint64_t bytes_rate = gov_bytes_rate, files_rate = gov_files_rate;
+    double psi_max = gov_psi_max, load_max = gov_load_max;
+    int idle = gov_idle, nice = gov_nice, dontneed = gov_dontneed;
+
+    bench_governor_row("только служба", dir, &fg, &bp, 0, secs, threads, cold);
+    gov_bytes_rate = gov_files_rate = 0;
+    gov_psi_max = gov_load_max = 0;
+    gov_idle = gov_nice = gov_dontneed = 0;
+    bench_governor_row("без ограничений", dir, &fg, &bp, 1, secs, threads, cold);
+    gov_bytes_rate = bytes_rate, gov_files_rate = files_rate;
+    gov_psi_max = psi_max, gov_load_max = load_max;
+    gov_idle = idle, gov_nice = nice, gov_dontneed = dontneed;
+    bench_governor_row("с ограничением", dir, &fg, &bp, 1, secs, threads, cold);
+
+    close(fg.fd);
+    free(fg.lat);
+    for (size_t i = 0; i < bp.count; i++) free(bp.items[i]);
+    free(bp.items);
+}
+
+static int count_hit(void *ctx, const struct matcher *m, const struct ac_pattern *p,
+                     uint64_t offset, uint32_t length) {
+    (*(uint64_t *)ctx)++;
+    return 0;
+}
+
+// Скорость поиска в памяти для каждого ядра предфильтра и для одного автомата
+void bench_simd(size_t mb) {
+    size_t len = mb << 20;
+    unsigned char *buf = malloc(len);
+    if (!buf) {
+        perror("Ошибка выделения памяти");
+        return;
+    }
+
+    // Случайные данные с вкраплениями каждой сигнатуры
+    srand(1);
+    for (size_t i = 0; i < len; i++) buf[i] = rand() >> 7;
+    for (uint32_t p = 0; p < matcher->n_patterns; p++) {
+        const struct ac_pattern *pat = &matcher->patterns[p];
+        size_t at = ((size_t)rand() * 4099) % (len - pat->length);
+        memcpy(buf + at, matcher->bytes + pat->offset, pat->length);
+    }
+
+    printf("Ядро | МБ/с | Совпадений\n");
+    for (int isa = -1; isa < PF_ISA_COUNT; isa++) {
+        if (isa >= 0 && (!matcher->pf || !pf_isa_supported(isa))) continue;
+        prefilter_enabled = isa >= 0;
+        if (isa >= 0) pf_isa = isa;
+
+        uint64_t hits = 0;
+        double t0 = now_seconds();
+        matcher_scan(matcher, buf, len, 0, count_hit, &hits);
+        double dt = now_seconds() - t0;
+        printf("%s | %.1f | %llu\n", isa < 0 ? "automaton" : pf_isa_names[isa], mb / dt, (unsigned long long)hits);
+    }
+
+    prefilter_enabled = 1;
+    pf_isa = pf_detect_isa();
+    free(buf);
+}
+
+// ----- Автомат против хэша окна -----
+// Наборы собираются в памяти, без antivir.db. Данные - случайные байты с вкраплениями
+// сигнатур (маскированные - целиком), одни и те же для обоих движков.
+void bench_engines(const char *counts, uint64_t len_min, uint64_t len_max, int masked, size_t mb, uint64_t seed) {
+    size_t len = mb << 20;
+    unsigned char *buf = malloc(len);
+    if (!buf) {
+        perror("Ошибка выделения памяти");
+        return;
+    }
+    if (len_min < 2) len_min = 2;
+    if (len_max < len_min) len_max = len_min;
+
+    printf("Сигнатур | Состояний | Сборка автомата, с | Сборка хэша, с | Фильтр, КБ | "
+           "Автомат, МБ/с | Хэш, МБ/с | Совпадений автомат/хэш\n");
+    for (const char *c = counts; *c; c += *c == ',') {
+        char item[32];
+        size_t n = strcspn(c, ",");
+        snprintf(item, sizeof(item), "%.*s", (int)(n < sizeof(item) ? n : sizeof(item) - 1), c);
+        c += n;
+        uint64_t count = parse_size(item);
+
+        uint64_t state = seed | 1;
+        struct sig_set set = { 0 };
+        unsigned char sig[4096];
+        char text[4096 * 3 + 32];
+        for (uint64_t i = 0; i < count; i++) {
+            int kind;
+            size_t sn = bench_signature(&state, len_min, len_max, masked, sig, sizeof(sig), text, &kind);
+            int rc = kind == MASK_KIND_MASKED ? sig_set_add_masked(&set, i + 1, text, sn)
+                                              : sig_set_add_literal(&set, i + 1, sig, sn, AC_NONE, 0);
+            if (rc != 0 && kind == MASK_KIND_EXACT) {
+                perror("Ошибка выделения памяти");
+                sig_set_free(&set);
+                free(buf);
+                return;
+            }
+        }
+
+        double t0 = now_seconds();
+        struct matcher *m = matcher_from_set(&set);
+        if (!m) break;
+        m->sa = shift_and_build(m);
+        double t1 = now_seconds();
+        struct rk_index *rk = rk_build(m);
+        double t2 = now_seconds();
+
+        // Вкрапления: не больше одной сигнатуры на 4 КБ данных
+        bench_fill(&state, buf, len);
+        uint64_t plants = len / 4096 < m->n_patterns ? len / 4096 : m->n_patterns;
+        for (uint64_t k = 0; k < plants; k++) {
+            const struct ac_pattern *p = &m->patterns[bench_rand(&state) % m->n_patterns];
+            const unsigned char *data = m->bytes + p->offset;
+            size_t dn = p->length;
+            if (p->owner != AC_NONE) {
+                dn = render_masked(m, &m->masked[p->owner], &state, sig, sizeof(sig));
+                data = sig;
+            }
+            if (dn < len) memcpy(buf + bench_rand(&state) % (len - dn), data, dn);
+        }
+
+        uint64_t hits_ac = 0, hits_rk = 0;
+        double t3 = now_seconds();
+        matcher_scan(m, buf, len, 0, count_hit, &hits_ac);
+        double t4 = now_seconds();
+        m->rk = rk;
+        if (rk) matcher_scan(m, buf, len, 0, count_hit, &hits_rk);
+        double t5 = now_seconds();
+
+        printf("%llu | %u | %.2f | %.2f | %zu | %.1f | %.1f | %llu/%llu%s\n",
+               (unsigned long long)count, m->n_states, t1 - t0, t2 - t1, rk ? rk->bloom_bytes >> 10 : 0,
+               mb / (t4 - t3), rk ? mb / (t5 - t4) : 0.0, (unsigned long long)hits_ac,
+               (unsigned long long)hits_rk, hits_ac == hits_rk ? "" : " РАСХОЖДЕНИЕ");
+        fflush(stdout);
+        matcher_free(m);
+    }
+    free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    int need_dir = argc > 1 && (strcmp(argv[1], "threads") == 0 || strcmp(argv[1], "corpus") == 0 ||
+                                strcmp(argv[1], "run") == 0 || strcmp(argv[1], "watch") == 0 ||
+                                strcmp(argv[1], "daemon") == 0 || strcmp(argv[1], "io") == 0 ||
+                                strcmp(argv[1], "walk") == 0 || strcmp(argv[1], "shard") == 0 ||
+                                strcmp(argv[1], "governor") == 0);
+    if (argc < 2 || (need_dir && argc < 3)) {
+        fprintf(stderr, "Использование: %s threads <каталог> [макс. потоков]\n", argv[0]);
+        fprintf(stderr, "               %s simd [МБ]\n", argv[0]);
+        fprintf(stderr, "               %s sigs [count=1000] [len=8-32] [masked=0] [seed=1]\n", argv[0]);
+        fprintf(stderr, "               %s engines [counts=1000,10000,100000,1000000] [len=8-32] [masked=5] [mb=64] [seed=1]\n",
+                argv[0]);
+        fprintf(stderr, "               %s corpus <каталог> [files=1000] [dirs=10] [size=4K-1M] "
+                        "[dist=log|uniform|fixed] [plant=10] [dup=0] [seed=1]\n", argv[0]);
+        fprintf(stderr, "               %s run <каталог> [threads=0] [manifest=путь] [actions=0] [dedup=1] "
+                        "[engine=auto|ac|hash] [io=[uring:|pool:]глубина]\n", argv[0]);
+        fprintf(stderr, "               %s watch <каталог> [files=1000] [size=4K] [plant=10] "
+                        "[debounce=50] [backend=auto|fanotify|inotify]\n", argv[0]);
+        fprintf(stderr, "               %s daemon <каталог> [clients=4] [depth=8] [requests=20000] "
+                        "[mode=path|fd]\n", argv[0]);
+        fprintf(stderr, "               %s walk <каталог> [reps=5] [symlinks=skip|files|all] [xdev=0]\n", argv[0]);
+        fprintf(stderr, "               %s shard <файл> [threads=1,2,4,8]\n", argv[0]);
+        fprintf(stderr, "               %s io <каталог> [depths=1,4,16,64] [backend=uring,pool] [threads=1] "
+                        "[cold=1]\n", argv[0]);
+        fprintf(stderr, "               %s governor <каталог> [limit=МБ/с] [files=0] [psi=0] [load=0] [idle=1] [nice=0] "
+                        "[dontneed=1] [threads=1] [fgsize=256M] [write=0] [secs=5] [cold=1]\n", argv[0]);
+        return 1;
+    }
+
+    initialize_db(&db);
+
+    // Набор сигнатур меняется до сборки автомата
+    if (strcmp(argv[1], "sigs") == 0) {
+        uint64_t len_min, len_max;
+        parse_range(bench_opt(argc, argv, "len", "8-32"), &len_min, &len_max);
+        int rc = bench_sigs(parse_size(bench_opt(argc, argv, "count", "1000")), len_min, len_max,
+                            atoi(bench_opt(argc, argv, "masked", "0")),
+                            parse_size(bench_opt(argc, argv, "seed", "1")));
+        db_stmt_cache_free();
+        sqlite3_close(db);
+        return rc != 0;
+    }
+    if (strcmp(argv[1], "engines") == 0) {
+        uint64_t len_min, len_max;
+        parse_range(bench_opt(argc, argv, "len", "8-32"), &len_min, &len_max);
+        bench_engines(bench_opt(argc, argv, "counts", "1000,10000,100000,1000000"), len_min, len_max,
+                      atoi(bench_opt(argc, argv, "masked", "5")), parse_size(bench_opt(argc, argv, "mb", "64")),
+                      parse_size(bench_opt(argc, argv, "seed", "1")));
+        db_stmt_cache_free();
+        sqlite3_close(db);
+        return 0;
+    }
+
+    const char *engine = bench_opt(argc, argv, "engine", "auto");
+    scan_engine = strcmp(engine, "ac") == 0 ? ENGINE_AC : strcmp(engine, "hash") == 0 ? ENGINE_HASH : ENGINE_AUTO;
+    const char *symlinks = bench_opt(argc, argv, "symlinks", walk_symlinks_names[walk_symlinks]);
+    for (int i = 0; i <= WALK_SYMLINKS_ALL; i++) {
+        if (strcmp(symlinks, walk_symlinks_names[i]) == 0) walk_symlinks = i;
+    }
+    walk_xdev = atoi(bench_opt(argc, argv, "xdev", "0"));
+    shard_min_size = parse_size(bench_opt(argc, argv, "shard", "256M"));
+    const char *io = bench_opt(argc, argv, "io", "0");    // [uring:|pool:]глубина
+    io_set(strncmp(io, "uring:", 6) == 0 ? IO_URING : strncmp(io, "pool:", 5) == 0 ? IO_POOL : IO_AUTO,
+           atoi(strchr(io, ':') ? strchr(io, ':') + 1 : io));
+    matcher = matcher_prepare(db, matcher);
+    if (!matcher) return 1;
+
+    if (strcmp(argv[1], "corpus") == 0) {
+        uint64_t lo, hi;
+        parse_range(bench_opt(argc, argv, "size", "4K-1M"), &lo, &hi);
+        bench_corpus(argv[2], parse_size(bench_opt(argc, argv, "files", "1000")),
+                     parse_size(bench_opt(argc, argv, "dirs", "10")), lo, hi,
+                     bench_opt(argc, argv, "dist", "log"), atoi(bench_opt(argc, argv, "plant", "10")),
+                     atoi(bench_opt(argc, argv, "dup", "0")), parse_size(bench_opt(argc, argv, "seed", "1")));
+    } else if (strcmp(argv[1], "run") == 0) {
+        dedup_enabled = atoi(bench_opt(argc, argv, "dedup", "1"));
+        bench_run(argv[2], atoi(bench_opt(argc, argv, "threads", "0")), bench_opt(argc, argv, "manifest", NULL),
+                  atoi(bench_opt(argc, argv, "actions", "0")));
+    } else if (strcmp(argv[1], "watch") == 0) {
+        const char *backend = bench_opt(argc, argv, "backend", "auto");
+        watch_debounce_ms = atoi(bench_opt(argc, argv, "debounce", "50"));
+        bench_watch(argv[2], parse_size(bench_opt(argc, argv, "files", "1000")),
+                    parse_size(bench_opt(argc, argv, "size", "4K")), atoi(bench_opt(argc, argv, "plant", "10")),
+                    strcmp(backend, "fanotify") == 0 ? WATCH_FANOTIFY :
+                    strcmp(backend, "inotify") == 0 ? WATCH_INOTIFY : WATCH_AUTO);
+    } else if (strcmp(argv[1], "daemon") == 0) {
+        bench_daemon(argv[2], atoi(bench_opt(argc, argv, "clients", "4")), atoi(bench_opt(argc, argv, "depth", "8")),
+                     parse_size(bench_opt(argc, argv, "requests", "20000")),
+                     strcmp(bench_opt(argc, argv, "mode", "path"), "fd") == 0);
+    } else if (strcmp(argv[1], "walk") == 0) {
+        bench_walk(argv[2], atoi(bench_opt(argc, argv, "reps", "5")));
+    } else if (strcmp(argv[1], "shard") == 0) {
+        bench_shard(argv[2], bench_opt(argc, argv, "threads", "1,2,4,8"));
+    } else if (strcmp(argv[1], "io") == 0) {
+        int threads = atoi(bench_opt(argc, argv, "threads", "1"));
+        bench_io(argv[2], bench_opt(argc, argv, "depths", "1,4,16,64"), bench_opt(argc, argv, "backend", "uring,pool"),
+                 threads > 0 ? threads : 1, atoi(bench_opt(argc, argv, "cold", "1")));
+    } else if (strcmp(argv[1], "governor") == 0) {
+        int threads = atoi(bench_opt(argc, argv, "threads", "1"));
+        gov_bytes_rate = atof(bench_opt(argc, argv, "limit", "0")) * 1024 * 1024;
+        gov_files_rate = parse_size(bench_opt(argc, argv, "files", "0"));
+        gov_psi_max = atof(bench_opt(argc, argv, "psi", "0"));
+        gov_load_max = atof(bench_opt(argc, argv, "load", "0"));
+        gov_idle = atoi(bench_opt(argc, argv, "idle", "1"));
+        gov_nice = atoi(bench_opt(argc, argv, "nice", "0"));
+        gov_dontneed = atoi(bench_opt(argc, argv, "dontneed", "1"));
+        bench_governor(argv[2], parse_size(bench_opt(argc, argv, "fgsize", "256M")),
+                       atoi(bench_opt(argc, argv, "write", "0")), atoi(bench_opt(argc, argv, "secs", "5")),
+                       threads > 0 ? threads : 1, atoi(bench_opt(argc, argv, "cold", "1")));
+    } else if (strcmp(argv[1], "threads") == 0) {
+        int max_threads = argc > 3 ? atoi(argv[3]) : default_scan_threads();
+        bench_threads(argv[2], max_threads > 0 ? max_threads : 1);
+    } else if (strcmp(argv[1], "simd") == 0) {
+        int mb = argc > 2 ? atoi(argv[2]) : 256;
+        bench_simd(mb > 0 ? mb : 256);
+    } else {
+        fprintf(stderr, "Неизвестный замер: %s\n", argv[1]);
+    }
+
+    matcher_free(matcher);
+    db_stmt_cache_free();
+    sqlite3_close(db);
+    return 0;
+}
+#else
+
+void main(int argc, char *argv[]) {
+    initialize_db(&db);
+    char command[100];
+    const char *startPath = "../ForAntivirus"; // Директория по умолчанию
+    int number = 0;  // Переменная для хранения числа
+    double value = 0;
+
+    // Запуск службой: ./antivirus daemon [путь сокета], остановка по SIGTERM
+    if (argc > 1 && strcmp(argv[1], "daemon") == 0) {
+        daemon_run(argc > 2 ? argv[2] : DAEMON_SOCKET, -1);
+        matcher_free(matcher);
+        db_stmt_cache_free();
+        sqlite3_close(db);
+        return;
+    }
+
+    while (1) {
+        printf("> ");
+        if (fgets(command, 100, stdin) == NULL) {
+            perror("Ошибка ввода");
+            continue;
+        }
+
+        // Удаляем символ новой строки в конце команды
+        command[strcspn(command, "\n")] = '\0';
+
+        if (strcmp(command, "check") == 0) {
+            check(startPath, 0);                    // запускаем поиск вирусов
+
+        } else if (strcmp(command, "check resume") == 0) {
+            check_resume(0);                        // продолжение прерванной проверки
+
+        } else if (sscanf(command, "check resume %d", &number) == 1) {
+            check_resume(number);
+
+        } else if (sscanf(command, "check %d", &number) == 1) {
+            check(startPath, number);               // поиск вирусов в number потоков
+
+        } else if (strncmp(command, "watch", 5) == 0 && (command[5] == '\0' || command[5] == ' ')) {
+            enum watch_backend backend = WATCH_AUTO;  // watch [fanotify|inotify]
+            if (strcmp(command + 5, " fanotify") == 0) backend = WATCH_FANOTIFY;
+            if (strcmp(command + 5, " inotify") == 0) backend = WATCH_INOTIFY;
+            if (watch_run(startPath, backend, STDIN_FILENO) == 0) {
+                fgets(command, 100, stdin);         // строка, остановившая наблюдение
+            }
+
+        } else if (strncmp(command, "daemon", 6) == 0 && (command[6] == '\0' || command[6] == ' ')) {
+            // daemon [путь сокета]
+            if (daemon_run(command[6] ? command + 7 : DAEMON_SOCKET, STDIN_FILENO) == 0) {
+                fgets(command, 100, stdin);         // строка, остановившая службу
+            }
+
+        } else if (strcmp(command, "start") == 0) {
+            process_table_info();                                  // запускаем выполнение установленных работ
+
+        } else if (strcmp(command, "exit") == 0) {
+            break;                                  // выход из программы
+
+        } else if (strcmp(command, "sigcache on") == 0) {
+            sig_cache_enabled = 1;                  // сохранять скомпилированные сигнатуры на диск
+
+        } else if (strcmp(command, "sigcache off") == 0) {
+            sig_cache_enabled = 0;
+
+        } else if (strcmp(command, "dedup off") == 0) {
+            dedup_enabled = 0;                      // проверять каждую ссылку и копию
+
+        } else if (strcmp(command, "dedup on") == 0) {
+            dedup_enabled = 1;
+
+        } else if (strcmp(command, "simd off") == 0) {
+            prefilter_enabled = 0;                  // искать только автоматом
+
+        } else if (strcmp(command, "simd on") == 0) {
+            prefilter_enabled = 1;
+
+        } else if (strcmp(command, "engine auto") == 0) {
+            scan_engine = ENGINE_AUTO;              // хэш окна для больших наборов, иначе автомат
+
+        } else if (strcmp(command, "engine ac") == 0) {
+            scan_engine = ENGINE_AC;                // только автомат и предфильтр
+
+        } else if (strcmp(command, "engine hash") == 0) {
+            scan_engine = ENGINE_HASH;              // всегда хэш окна с фильтром Блума
+
+        } else if (strcmp(command, "walk") == 0) {
+            printf("Символические ссылки: %s, другие файловые системы: %s\n", walk_symlinks_names[walk_symlinks],
+                   walk_xdev ? "пропускать" : "обходить");
+
+        } else if (strcmp(command, "walk symlinks skip") == 0) {
+            walk_symlinks = WALK_SYMLINKS_SKIP;     // ссылки не разыменовываются
+
+        } else if (strcmp(command, "walk symlinks files") == 0) {
+            walk_symlinks = WALK_SYMLINKS_FILES;    // только ссылки на файлы
+
+        } else if (strcmp(command, "walk symlinks all") == 0) {
+            walk_symlinks = WALK_SYMLINKS_ALL;      // и на каталоги, без циклов
+
+        } else if (strcmp(command, "walk xdev on") == 0) {
+            walk_xdev = 1;                          // не выходить за файловую систему каталога
+
+        } else if (strcmp(command, "walk xdev off") == 0) {
+            walk_xdev = 0;
+
+        } else if (strcmp(command, "shard off") == 0) {
+            shard_min_size = 0;                     // большие файлы целиком в одном потоке
+
+        } else if (sscanf(command, "shard %d", &number) == 1) {
+            shard_min_size = number > 0 ? (uint64_t)number << 20 : 0;   // порог в МБ
+
+        } else if (strcmp(command, "io off") == 0) {
+            io_depth = 0;                           // блокирующее чтение в потоке поиска
+
+        } else if (sscanf(command, "io %d", &number) == 1) {
+            io_set(IO_AUTO, number);                // io_uring, если доступен, иначе пул pread
+
+        } else if (sscanf(command, "io uring %d", &number) == 1) {
+            io_set(IO_URING, number);
+
+        } else if (sscanf(command, "io pool %d", &number) == 1) {
+            io_set(IO_POOL, number);
+
+        } else if (strncmp(command, "import ", 7) == 0) {
+            import_signatures(command + 7);         // файл обновлений одной транзакцией
+
+        } else if (strcmp(command, "sync") == 0) {
+            sync_signatures(FEED_DIR);              // изменения, подложенные в ../Updates
+
+        } else if (strncmp(command, "sync ", 5) == 0) {
+            sync_signatures(command + 5);           // каталог или http://узел[:порт]/путь
+
+        } else if (strcmp(command, "checkpoint off") == 0) {
+            checkpoint_interval = 0;                // без контрольных точек
+
+        } else if (sscanf(command, "checkpoint %d", &number) == 1) {
+            checkpoint_interval = number > 0 ? number : 0;  // секунд между контрольными точками
+
+        } else if (strcmp(command, "limit") == 0) {
+            gov_print();                            // ограничения нагрузки check и watch
+
+        } else if (strcmp(command, "limit off") == 0) {
+            gov_bytes_rate = gov_files_rate = 0;    // без пределов скорости и отступления
+            gov_psi_max = gov_load_max = 0;
+
+        } else if (sscanf(command, "limit files %d", &number) == 1) {
+            gov_files_rate = number > 0 ? number : 0;
+
+        } else if (sscanf(command, "limit psi %lf", &value) == 1) {
+            gov_psi_max = value > 0 ? value : 0;    // % времени, когда задачи ждут диск
+
+        } else if (sscanf(command, "limit load %lf", &value) == 1) {
+            gov_load_max = value > 0 ? value : 0;   // loadavg за минуту
+
+        } else if (strcmp(command, "limit idle on") == 0) {
+            gov_idle = 1;                           // класс ввода-вывода idle
+
+        } else if (strcmp(command, "limit idle off") == 0) {
+            gov_idle = 0;
+
+        } else if (sscanf(command, "limit nice %d", &number) == 1) {
+            gov_nice = number < 0 ? 0 : number > 19 ? 19 : number;
+
+        } else if (strcmp(command, "limit dontneed on") == 0) {
+            gov_dontneed = 1;                       // сбрасывать страницы проверенных файлов
+
+        } else if (strcmp(command, "limit dontneed off") == 0) {
+            gov_dontneed = 0;
+
+        } else if (sscanf(command, "limit %lf", &value) == 1) {
+            gov_bytes_rate = value > 0 ? value * 1024 * 1024 : 0;   // МБ/с
+
+        } else if (strcmp(command, "info") == 0) {
+            get_info();
+
+        } else if (strcmp(command, "stats") == 0) {
+            print_stats();                          // счётчики и распределения проверок
+
+        } else if (strcmp(command, "info0") == 0) {
+            display_files_with_status(0);
+
+        } else if (sscanf(command, "info %d", &number) == 1) {
+            display_files_with_status(number);
+
+        } else if (sscanf(command, "hits %d", &number) == 1) {
+            display_hits(number);
 
         } else if (sscanf(command, "del %d", &number) == 1) {
             update_status_by_id(number, 1);
@@ -641,9 +8396,13 @@ void main(int argc, char *argv[]) {
     }
 
     // Закрываем базу данных
+    matcher_free(matcher);
+    scanner_free(&default_scanner);
+    db_stmt_cache_free();
     sqlite3_close(db);
     return;
 }
+#endif
 
 
 